@@ -15,117 +15,322 @@ AES::AES(const AESKeyLength keyLength) {
       this->Nr = 14;
       break;
   }
+  keyExpanded = false;
+  backend = AESBackend::Reference;
+  if (BackendAvailable(AESBackend::AESNI)) {
+    backend = AESBackend::AESNI;
+  } else if (BackendAvailable(AESBackend::TTable)) {
+    backend = AESBackend::TTable;
+  }
 }
 
-unsigned char *AES::EncryptECB(const unsigned char in[], unsigned int inLen,
-                               const unsigned char key[]) {
-  CheckLength(inLen);
-  unsigned char *out = new unsigned char[inLen];
-  unsigned char *roundKeys = new unsigned char[4 * Nb * (Nr + 1)];
-  KeyExpansion(key, roundKeys);
-  for (unsigned int i = 0; i < inLen; i += blockBytesLen) {
-    EncryptBlock(in + i, out + i, roundKeys);
+bool AES::BackendAvailable(AESBackend backend) {
+  switch (backend) {
+    case AESBackend::Reference:
+      return true;
+#ifdef AES_HOST_BACKEND
+    case AESBackend::TTable:
+      return true;
+    case AESBackend::AESNI:
+      return AESHost::HasAESNI();
+#endif
+    default:
+      return false;
   }
+}
 
-  delete[] roundKeys;
-
-  return out;
+bool AES::SetBackend(AESBackend backend) {
+  if (!BackendAvailable(backend)) return false;
+  this->backend = backend;
+  return true;
 }
 
-unsigned char *AES::DecryptECB(const unsigned char in[], unsigned int inLen,
-                               const unsigned char key[]) {
-  CheckLength(inLen);
-  unsigned char *out = new unsigned char[inLen];
-  unsigned char *roundKeys = new unsigned char[4 * Nb * (Nr + 1)];
+AESBackend AES::GetBackend() const { return backend; }
+
+void AES::SetKey(const unsigned char key[]) {
   KeyExpansion(key, roundKeys);
-  for (unsigned int i = 0; i < inLen; i += blockBytesLen) {
-    DecryptBlock(in + i, out + i, roundKeys);
+#ifdef AES_HOST_BACKEND
+  AESHost::ExpandDecryptionKeys(roundKeys, decRoundKeys, Nr);
+#endif
+  keyExpanded = true;
+}
+
+// The first 4 * Nk bytes of the expanded key are the key itself.
+void AES::UseKey(const unsigned char key[]) {
+  if (!keyExpanded || memcmp(roundKeys, key, 4 * Nk) != 0) {
+    SetKey(key);
   }
+}
 
-  delete[] roundKeys;
+void AES::EncryptBlocks(const unsigned char in[], unsigned char out[],
+                        unsigned int n) {
+#ifdef AES_HOST_BACKEND
+  if (backend == AESBackend::AESNI) {
+    AESHost::EncryptAESNI(roundKeys, Nr, in, out, n);
+    return;
+  }
+  if (backend == AESBackend::TTable) {
+    AESHost::EncryptTTable(roundKeys, Nr, in, out, n);
+    return;
+  }
+#endif
+  for (unsigned int i = 0; i < n; i++) {
+    EncryptBlock(in + i * blockBytesLen, out + i * blockBytesLen, roundKeys);
+  }
+}
 
-  return out;
+void AES::DecryptBlocks(const unsigned char in[], unsigned char out[],
+                        unsigned int n) {
+#ifdef AES_HOST_BACKEND
+  if (backend == AESBackend::AESNI) {
+    AESHost::DecryptAESNI(decRoundKeys, Nr, in, out, n);
+    return;
+  }
+  if (backend == AESBackend::TTable) {
+    AESHost::DecryptTTable(decRoundKeys, Nr, in, out, n);
+    return;
+  }
+#endif
+  for (unsigned int i = 0; i < n; i++) {
+    DecryptBlock(in + i * blockBytesLen, out + i * blockBytesLen, roundKeys);
+  }
 }
 
-unsigned char *AES::EncryptCBC(const unsigned char in[], unsigned int inLen,
-                               const unsigned char key[],
-                               const unsigned char *iv) {
-  CheckLength(inLen);
-  unsigned char *out = new unsigned char[inLen];
+bool AES::EncryptECB(const unsigned char in[], unsigned char out[],
+                     unsigned int inLen) {
+  if (inLen % blockBytesLen != 0) return false;
+  EncryptBlocks(in, out, inLen / blockBytesLen);
+  return true;
+}
+
+bool AES::DecryptECB(const unsigned char in[], unsigned char out[],
+                     unsigned int inLen) {
+  if (inLen % blockBytesLen != 0) return false;
+  DecryptBlocks(in, out, inLen / blockBytesLen);
+  return true;
+}
+
+bool AES::EncryptCBC(const unsigned char in[], unsigned char out[],
+                     unsigned int inLen, const unsigned char *iv) {
+  if (inLen % blockBytesLen != 0) return false;
   unsigned char block[blockBytesLen];
-  unsigned char *roundKeys = new unsigned char[4 * Nb * (Nr + 1)];
-  KeyExpansion(key, roundKeys);
   memcpy(block, iv, blockBytesLen);
   for (unsigned int i = 0; i < inLen; i += blockBytesLen) {
     XorBlocks(block, in + i, block, blockBytesLen);
-    EncryptBlock(block, out + i, roundKeys);
+    EncryptBlocks(block, out + i, 1);
     memcpy(block, out + i, blockBytesLen);
   }
 
-  delete[] roundKeys;
-
-  return out;
+  return true;
 }
 
-unsigned char *AES::DecryptCBC(const unsigned char in[], unsigned int inLen,
-                               const unsigned char key[],
-                               const unsigned char *iv) {
-  CheckLength(inLen);
-  unsigned char *out = new unsigned char[inLen];
+// Decrypts a chunk of blocks at a time, then undoes the chaining.
+// The ciphertext is kept because out may be the same buffer as in.
+bool AES::DecryptCBC(const unsigned char in[], unsigned char out[],
+                     unsigned int inLen, const unsigned char *iv) {
+  if (inLen % blockBytesLen != 0) return false;
   unsigned char block[blockBytesLen];
-  unsigned char *roundKeys = new unsigned char[4 * Nb * (Nr + 1)];
-  KeyExpansion(key, roundKeys);
+  unsigned char saved[chunkBlocks * blockBytesLen];
   memcpy(block, iv, blockBytesLen);
-  for (unsigned int i = 0; i < inLen; i += blockBytesLen) {
-    DecryptBlock(in + i, out + i, roundKeys);
+  for (unsigned int i = 0; i < inLen; i += chunkBlocks * blockBytesLen) {
+    unsigned int len = inLen - i < chunkBlocks * blockBytesLen
+                           ? inLen - i
+                           : chunkBlocks * blockBytesLen;
+    memcpy(saved, in + i, len);
+    DecryptBlocks(saved, out + i, len / blockBytesLen);
     XorBlocks(block, out + i, out + i, blockBytesLen);
-    memcpy(block, in + i, blockBytesLen);
+    XorBlocks(saved, out + i + blockBytesLen, out + i + blockBytesLen,
+              len - blockBytesLen);
+    memcpy(block, saved + len - blockBytesLen, blockBytesLen);
   }
 
-  delete[] roundKeys;
-
-  return out;
+  return true;
 }
 
-unsigned char *AES::EncryptCFB(const unsigned char in[], unsigned int inLen,
-                               const unsigned char key[],
-                               const unsigned char *iv) {
-  CheckLength(inLen);
-  unsigned char *out = new unsigned char[inLen];
+bool AES::EncryptCFB(const unsigned char in[], unsigned char out[],
+                     unsigned int inLen, const unsigned char *iv) {
+  if (inLen % blockBytesLen != 0) return false;
   unsigned char block[blockBytesLen];
   unsigned char encryptedBlock[blockBytesLen];
-  unsigned char *roundKeys = new unsigned char[4 * Nb * (Nr + 1)];
-  KeyExpansion(key, roundKeys);
   memcpy(block, iv, blockBytesLen);
   for (unsigned int i = 0; i < inLen; i += blockBytesLen) {
-    EncryptBlock(block, encryptedBlock, roundKeys);
+    EncryptBlocks(block, encryptedBlock, 1);
     XorBlocks(in + i, encryptedBlock, out + i, blockBytesLen);
     memcpy(block, out + i, blockBytesLen);
   }
 
-  delete[] roundKeys;
+  return true;
+}
+
+// The key stream for a chunk is the IV or previous ciphertext block
+// followed by the chunk's ciphertext less its last block.
+bool AES::DecryptCFB(const unsigned char in[], unsigned char out[],
+                     unsigned int inLen, const unsigned char *iv) {
+  if (inLen % blockBytesLen != 0) return false;
+  unsigned char block[blockBytesLen];
+  unsigned char stream[chunkBlocks * blockBytesLen];
+  memcpy(block, iv, blockBytesLen);
+  for (unsigned int i = 0; i < inLen; i += chunkBlocks * blockBytesLen) {
+    unsigned int len = inLen - i < chunkBlocks * blockBytesLen
+                           ? inLen - i
+                           : chunkBlocks * blockBytesLen;
+    memcpy(stream, block, blockBytesLen);
+    memcpy(stream + blockBytesLen, in + i, len - blockBytesLen);
+    memcpy(block, in + i + len - blockBytesLen, blockBytesLen);
+    EncryptBlocks(stream, stream, len / blockBytesLen);
+    XorBlocks(in + i, stream, out + i, len);
+  }
+
+  return true;
+}
+
+bool AES::CheckFrames(const AESFrame frames[], unsigned int count) {
+  for (unsigned int f = 0; f < count; f++) {
+    if (frames[f].len % blockBytesLen != 0) return false;
+  }
+  return true;
+}
+
+// Each frame has a lane in state holding its chaining block.
+// All lanes go through the cipher together. Lanes of frames that have
+// ended keep turning over, which is cheaper than compacting them.
+void AES::EncryptChained(AESFrame frames[], unsigned int count, bool cfb) {
+  unsigned char state[chunkBlocks * blockBytesLen];
+  unsigned int maxLen = 0;
+
+  for (unsigned int f = 0; f < count; f++) {
+    memcpy(state + f * blockBytesLen, frames[f].iv, blockBytesLen);
+    if (frames[f].len > maxLen) maxLen = frames[f].len;
+  }
+
+  for (unsigned int i = 0; i < maxLen; i += blockBytesLen) {
+    if (!cfb) {
+      for (unsigned int f = 0; f < count; f++) {
+        if (i < frames[f].len) {
+          unsigned char *lane = state + f * blockBytesLen;
+          XorBlocks(lane, frames[f].in + i, lane, blockBytesLen);
+        }
+      }
+    }
+
+    EncryptBlocks(state, state, count);
+
+    for (unsigned int f = 0; f < count; f++) {
+      if (i >= frames[f].len) continue;
+      unsigned char *lane = state + f * blockBytesLen;
+      if (cfb) {
+        XorBlocks(frames[f].in + i, lane, lane, blockBytesLen);
+      }
+      memcpy(frames[f].out + i, lane, blockBytesLen);
+    }
+  }
+}
+
+bool AES::EncryptECB(AESFrame frames[], unsigned int count) {
+  if (!CheckFrames(frames, count)) return false;
+  for (unsigned int f = 0; f < count; f++) {
+    EncryptECB(frames[f].in, frames[f].out, frames[f].len);
+  }
+  return true;
+}
+
+bool AES::DecryptECB(AESFrame frames[], unsigned int count) {
+  if (!CheckFrames(frames, count)) return false;
+  for (unsigned int f = 0; f < count; f++) {
+    DecryptECB(frames[f].in, frames[f].out, frames[f].len);
+  }
+  return true;
+}
+
+bool AES::EncryptCBC(AESFrame frames[], unsigned int count) {
+  if (!CheckFrames(frames, count)) return false;
+  for (unsigned int f = 0; f < count; f += chunkBlocks) {
+    EncryptChained(frames + f, count - f < chunkBlocks ? count - f : chunkBlocks,
+                   false);
+  }
+  return true;
+}
+
+bool AES::DecryptCBC(AESFrame frames[], unsigned int count) {
+  if (!CheckFrames(frames, count)) return false;
+  for (unsigned int f = 0; f < count; f++) {
+    DecryptCBC(frames[f].in, frames[f].out, frames[f].len, frames[f].iv);
+  }
+  return true;
+}
+
+bool AES::EncryptCFB(AESFrame frames[], unsigned int count) {
+  if (!CheckFrames(frames, count)) return false;
+  for (unsigned int f = 0; f < count; f += chunkBlocks) {
+    EncryptChained(frames + f, count - f < chunkBlocks ? count - f : chunkBlocks,
+                   true);
+  }
+  return true;
+}
 
+bool AES::DecryptCFB(AESFrame frames[], unsigned int count) {
+  if (!CheckFrames(frames, count)) return false;
+  for (unsigned int f = 0; f < count; f++) {
+    DecryptCFB(frames[f].in, frames[f].out, frames[f].len, frames[f].iv);
+  }
+  return true;
+}
+
+unsigned char *AES::EncryptECB(const unsigned char in[], unsigned int inLen,
+                               const unsigned char key[]) {
+  CheckLength(inLen);
+  unsigned char *out = new unsigned char[inLen];
+  UseKey(key);
+  EncryptECB(in, out, inLen);
   return out;
 }
 
-unsigned char *AES::DecryptCFB(const unsigned char in[], unsigned int inLen,
+unsigned char *AES::DecryptECB(const unsigned char in[], unsigned int inLen,
+                               const unsigned char key[]) {
+  CheckLength(inLen);
+  unsigned char *out = new unsigned char[inLen];
+  UseKey(key);
+  DecryptECB(in, out, inLen);
+  return out;
+}
+
+unsigned char *AES::EncryptCBC(const unsigned char in[], unsigned int inLen,
                                const unsigned char key[],
                                const unsigned char *iv) {
   CheckLength(inLen);
   unsigned char *out = new unsigned char[inLen];
-  unsigned char block[blockBytesLen];
-  unsigned char encryptedBlock[blockBytesLen];
-  unsigned char *roundKeys = new unsigned char[4 * Nb * (Nr + 1)];
-  KeyExpansion(key, roundKeys);
-  memcpy(block, iv, blockBytesLen);
-  for (unsigned int i = 0; i < inLen; i += blockBytesLen) {
-    EncryptBlock(block, encryptedBlock, roundKeys);
-    XorBlocks(in + i, encryptedBlock, out + i, blockBytesLen);
-    memcpy(block, in + i, blockBytesLen);
-  }
+  UseKey(key);
+  EncryptCBC(in, out, inLen, iv);
+  return out;
+}
 
-  delete[] roundKeys;
+unsigned char *AES::DecryptCBC(const unsigned char in[], unsigned int inLen,
+                               const unsigned char key[],
+                               const unsigned char *iv) {
+  CheckLength(inLen);
+  unsigned char *out = new unsigned char[inLen];
+  UseKey(key);
+  DecryptCBC(in, out, inLen, iv);
+  return out;
+}
 
+unsigned char *AES::EncryptCFB(const unsigned char in[], unsigned int inLen,
+                               const unsigned char key[],
+                               const unsigned char *iv) {
+  CheckLength(inLen);
+  unsigned char *out = new unsigned char[inLen];
+  UseKey(key);
+  EncryptCFB(in, out, inLen, iv);
+  return out;
+}
+
+unsigned char *AES::DecryptCFB(const unsigned char in[], unsigned int inLen,
+                               const unsigned char key[],
+                               const unsigned char *iv) {
+  CheckLength(inLen);
+  unsigned char *out = new unsigned char[inLen];
+  UseKey(key);
+  DecryptCFB(in, out, inLen, iv);
   return out;
 }
 
@@ -386,70 +591,60 @@ void AES::printHexVector(std::vector<unsigned char> a) {
   }
 }
 
-std::vector<unsigned char> AES::ArrayToVector(unsigned char *a,
-                                              unsigned int len) {
-  std::vector<unsigned char> v(a, a + len * sizeof(unsigned char));
-  return v;
-}
-
-unsigned char *AES::VectorToArray(std::vector<unsigned char> &a) {
-  return a.data();
-}
-
-std::vector<unsigned char> AES::EncryptECB(std::vector<unsigned char> in,
-                                           std::vector<unsigned char> key) {
-  unsigned char *out = EncryptECB(VectorToArray(in), (unsigned int)in.size(),
-                                  VectorToArray(key));
-  std::vector<unsigned char> v = ArrayToVector(out, in.size());
-  delete[] out;
-  return v;
+std::vector<unsigned char> AES::EncryptECB(const std::vector<unsigned char> &in,
+                                           const std::vector<unsigned char> &key) {
+  CheckLength((unsigned int)in.size());
+  std::vector<unsigned char> out(in.size());
+  UseKey(key.data());
+  EncryptECB(in.data(), out.data(), (unsigned int)in.size());
+  return out;
 }
 
-std::vector<unsigned char> AES::DecryptECB(std::vector<unsigned char> in,
-                                           std::vector<unsigned char> key) {
-  unsigned char *out = DecryptECB(VectorToArray(in), (unsigned int)in.size(),
-                                  VectorToArray(key));
-  std::vector<unsigned char> v = ArrayToVector(out, (unsigned int)in.size());
-  delete[] out;
-  return v;
+std::vector<unsigned char> AES::DecryptECB(const std::vector<unsigned char> &in,
+                                           const std::vector<unsigned char> &key) {
+  CheckLength((unsigned int)in.size());
+  std::vector<unsigned char> out(in.size());
+  UseKey(key.data());
+  DecryptECB(in.data(), out.data(), (unsigned int)in.size());
+  return out;
 }
 
-std::vector<unsigned char> AES::EncryptCBC(std::vector<unsigned char> in,
-                                           std::vector<unsigned char> key,
-                                           std::vector<unsigned char> iv) {
-  unsigned char *out = EncryptCBC(VectorToArray(in), (unsigned int)in.size(),
-                                  VectorToArray(key), VectorToArray(iv));
-  std::vector<unsigned char> v = ArrayToVector(out, in.size());
-  delete[] out;
-  return v;
+std::vector<unsigned char> AES::EncryptCBC(const std::vector<unsigned char> &in,
+                                           const std::vector<unsigned char> &key,
+                                           const std::vector<unsigned char> &iv) {
+  CheckLength((unsigned int)in.size());
+  std::vector<unsigned char> out(in.size());
+  UseKey(key.data());
+  EncryptCBC(in.data(), out.data(), (unsigned int)in.size(), iv.data());
+  return out;
 }
 
-std::vector<unsigned char> AES::DecryptCBC(std::vector<unsigned char> in,
-                                           std::vector<unsigned char> key,
-                                           std::vector<unsigned char> iv) {
-  unsigned char *out = DecryptCBC(VectorToArray(in), (unsigned int)in.size(),
-                                  VectorToArray(key), VectorToArray(iv));
-  std::vector<unsigned char> v = ArrayToVector(out, (unsigned int)in.size());
-  delete[] out;
-  return v;
+std::vector<unsigned char> AES::DecryptCBC(const std::vector<unsigned char> &in,
+                                           const std::vector<unsigned char> &key,
+                                           const std::vector<unsigned char> &iv) {
+  CheckLength((unsigned int)in.size());
+  std::vector<unsigned char> out(in.size());
+  UseKey(key.data());
+  DecryptCBC(in.data(), out.data(), (unsigned int)in.size(), iv.data());
+  return out;
 }
 
-std::vector<unsigned char> AES::EncryptCFB(std::vector<unsigned char> in,
-                                           std::vector<unsigned char> key,
-                                           std::vector<unsigned char> iv) {
-  unsigned char *out = EncryptCFB(VectorToArray(in), (unsigned int)in.size(),
-                                  VectorToArray(key), VectorToArray(iv));
-  std::vector<unsigned char> v = ArrayToVector(out, in.size());
-  delete[] out;
-  return v;
+std::vector<unsigned char> AES::EncryptCFB(const std::vector<unsigned char> &in,
+                                           const std::vector<unsigned char> &key,
+                                           const std::vector<unsigned char> &iv) {
+  CheckLength((unsigned int)in.size());
+  std::vector<unsigned char> out(in.size());
+  UseKey(key.data());
+  EncryptCFB(in.data(), out.data(), (unsigned int)in.size(), iv.data());
+  return out;
 }
 
-std::vector<unsigned char> AES::DecryptCFB(std::vector<unsigned char> in,
-                                           std::vector<unsigned char> key,
-                                           std::vector<unsigned char> iv) {
-  unsigned char *out = DecryptCFB(VectorToArray(in), (unsigned int)in.size(),
-                                  VectorToArray(key), VectorToArray(iv));
-  std::vector<unsigned char> v = ArrayToVector(out, (unsigned int)in.size());
-  delete[] out;
-  return v;
+std::vector<unsigned char> AES::DecryptCFB(const std::vector<unsigned char> &in,
+                                           const std::vector<unsigned char> &key,
+                                           const std::vector<unsigned char> &iv) {
+  CheckLength((unsigned int)in.size());
+  std::vector<unsigned char> out(in.size());
+  UseKey(key.data());
+  DecryptCFB(in.data(), out.data(), (unsigned int)in.size(), iv.data());
+  return out;
 }
@@ -9,16 +9,57 @@
 #include <string>
 #include <vector>
 
+#include "AESHost.h"
+
 enum class AESKeyLength { AES_128, AES_192, AES_256 };
 
+// Block cipher implementations.
+// Reference is the original code and the only one on Arduino boards.
+// PC builds also have T-tables and, on CPUs that support it, AES-NI.
+enum class AESBackend { Reference, TTable, AESNI };
+
+// One frame of a batch call.
+struct AESFrame {
+  const unsigned char *in;
+  unsigned char *out;       // may equal in
+  unsigned int len;         // multiple of 16
+  const unsigned char *iv;  // CBC and CFB only
+};
+
 class AES {
  private:
   static constexpr unsigned int Nb = 4;
   static constexpr unsigned int blockBytesLen = 4 * Nb * sizeof(unsigned char);
 
+  static constexpr unsigned int maxRoundKeysLen = 4 * Nb * (14 + 1);
+  static constexpr unsigned int chunkBlocks = 8;  // blocks per backend call
+
   unsigned int Nk;
   unsigned int Nr;
 
+  // Expanded key, kept between calls.
+  unsigned char roundKeys[maxRoundKeysLen];
+  bool keyExpanded;
+
+  void UseKey(const unsigned char key[]);  // expand unless already expanded
+
+  AESBackend backend;
+#ifdef AES_HOST_BACKEND
+  unsigned char decRoundKeys[maxRoundKeysLen];  // equivalent inverse cipher
+#endif
+
+  // n independent blocks through the selected backend
+  void EncryptBlocks(const unsigned char in[], unsigned char out[],
+                     unsigned int n);
+
+  void DecryptBlocks(const unsigned char in[], unsigned char out[],
+                     unsigned int n);
+
+  bool CheckFrames(const AESFrame frames[], unsigned int count);
+
+  // CBC or CFB encryption of up to chunkBlocks frames side by side
+  void EncryptChained(AESFrame frames[], unsigned int count, bool cfb);
+
   void SubBytes(unsigned char state[4][Nb]);
 
   void ShiftRow(unsigned char state[4][Nb], unsigned int i,
@@ -59,13 +100,59 @@ class AES {
   void XorBlocks(const unsigned char *a, const unsigned char *b,
                  unsigned char *c, unsigned int len);
 
-  std::vector<unsigned char> ArrayToVector(unsigned char *a, unsigned int len);
-
-  unsigned char *VectorToArray(std::vector<unsigned char> &a);
-
  public:
   explicit AES(const AESKeyLength keyLength = AESKeyLength::AES_256);
 
+  // Expands the key once for the calls below that take no key.
+  void SetKey(const unsigned char key[]);
+
+  // Use the key given to SetKey(). Output goes to the caller's buffer,
+  // which may be the input buffer. No heap is used.
+  // inLen must be a multiple of 16. Returns false, doing nothing, if not.
+  bool EncryptECB(const unsigned char in[], unsigned char out[],
+                  unsigned int inLen);
+
+  bool DecryptECB(const unsigned char in[], unsigned char out[],
+                  unsigned int inLen);
+
+  bool EncryptCBC(const unsigned char in[], unsigned char out[],
+                  unsigned int inLen, const unsigned char *iv);
+
+  bool DecryptCBC(const unsigned char in[], unsigned char out[],
+                  unsigned int inLen, const unsigned char *iv);
+
+  bool EncryptCFB(const unsigned char in[], unsigned char out[],
+                  unsigned int inLen, const unsigned char *iv);
+
+  bool DecryptCFB(const unsigned char in[], unsigned char out[],
+                  unsigned int inLen, const unsigned char *iv);
+
+  // Batches of independent frames under the key given to SetKey().
+  // Chained modes interleave the frames so that the backend sees several
+  // blocks per call. Returns false, doing nothing, if a length is bad.
+  bool EncryptECB(AESFrame frames[], unsigned int count);
+
+  bool DecryptECB(AESFrame frames[], unsigned int count);
+
+  bool EncryptCBC(AESFrame frames[], unsigned int count);
+
+  bool DecryptCBC(AESFrame frames[], unsigned int count);
+
+  bool EncryptCFB(AESFrame frames[], unsigned int count);
+
+  bool DecryptCFB(AESFrame frames[], unsigned int count);
+
+  // Selects the block cipher implementation. PC builds start with the
+  // fastest available. Returns false if the backend is not available.
+  bool SetBackend(AESBackend backend);
+
+  AESBackend GetBackend() const;
+
+  static bool BackendAvailable(AESBackend backend);
+
+  // Original interface. The result is allocated with new[] and must be
+  // deleted by the caller. The key is expanded only when it changes.
+
   unsigned char *EncryptECB(const unsigned char in[], unsigned int inLen,
                             const unsigned char key[]);
 
@@ -84,27 +171,27 @@ class AES {
   unsigned char *DecryptCFB(const unsigned char in[], unsigned int inLen,
                             const unsigned char key[], const unsigned char *iv);
 
-  std::vector<unsigned char> EncryptECB(std::vector<unsigned char> in,
-                                        std::vector<unsigned char> key);
+  std::vector<unsigned char> EncryptECB(const std::vector<unsigned char> &in,
+                                        const std::vector<unsigned char> &key);
 
-  std::vector<unsigned char> DecryptECB(std::vector<unsigned char> in,
-                                        std::vector<unsigned char> key);
+  std::vector<unsigned char> DecryptECB(const std::vector<unsigned char> &in,
+                                        const std::vector<unsigned char> &key);
 
-  std::vector<unsigned char> EncryptCBC(std::vector<unsigned char> in,
-                                        std::vector<unsigned char> key,
-                                        std::vector<unsigned char> iv);
+  std::vector<unsigned char> EncryptCBC(const std::vector<unsigned char> &in,
+                                        const std::vector<unsigned char> &key,
+                                        const std::vector<unsigned char> &iv);
 
-  std::vector<unsigned char> DecryptCBC(std::vector<unsigned char> in,
-                                        std::vector<unsigned char> key,
-                                        std::vector<unsigned char> iv);
+  std::vector<unsigned char> DecryptCBC(const std::vector<unsigned char> &in,
+                                        const std::vector<unsigned char> &key,
+                                        const std::vector<unsigned char> &iv);
 
-  std::vector<unsigned char> EncryptCFB(std::vector<unsigned char> in,
-                                        std::vector<unsigned char> key,
-                                        std::vector<unsigned char> iv);
+  std::vector<unsigned char> EncryptCFB(const std::vector<unsigned char> &in,
+                                        const std::vector<unsigned char> &key,
+                                        const std::vector<unsigned char> &iv);
 
-  std::vector<unsigned char> DecryptCFB(std::vector<unsigned char> in,
-                                        std::vector<unsigned char> key,
-                                        std::vector<unsigned char> iv);
+  std::vector<unsigned char> DecryptCFB(const std::vector<unsigned char> &in,
+                                        const std::vector<unsigned char> &key,
+                                        const std::vector<unsigned char> &iv);
 
   void printHexArray(unsigned char a[], unsigned int n);
 
@@ -0,0 +1,248 @@
+#include "AESHost.h"
+
+#ifdef AES_HOST_BACKEND
+
+#include "AES.h"
+
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__)
+#include <immintrin.h>
+#define AES_HOST_AESNI
+#endif
+
+namespace AESHost {
+
+namespace {
+
+unsigned char Mul(unsigned char a, unsigned char b) {
+  unsigned char p = 0;
+  while (b) {
+    if (b & 1) p ^= a;
+    a = (unsigned char)((a << 1) ^ ((a & 0x80) ? 0x1b : 0));
+    b >>= 1;
+  }
+  return p;
+}
+
+uint32_t Ror8(uint32_t x) { return (x >> 8) | (x << 24); }
+
+uint32_t Load(const unsigned char *p) {
+  return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) |
+         ((uint32_t)p[2] << 8) | (uint32_t)p[3];
+}
+
+void Store(unsigned char *p, uint32_t x) {
+  p[0] = (unsigned char)(x >> 24);
+  p[1] = (unsigned char)(x >> 16);
+  p[2] = (unsigned char)(x >> 8);
+  p[3] = (unsigned char)x;
+}
+
+// Round tables, built from the S-boxes in AES.h on first use.
+struct Tables {
+  uint32_t Te[4][256];
+  uint32_t Td[4][256];
+  unsigned char S[256];
+  unsigned char Si[256];
+
+  Tables() {
+    for (unsigned int x = 0; x < 256; x++) {
+      unsigned char s = sbox[x / 16][x % 16];
+      unsigned char si = inv_sbox[x / 16][x % 16];
+      S[x] = s;
+      Si[x] = si;
+      Te[0][x] = ((uint32_t)Mul(s, 2) << 24) | ((uint32_t)s << 16) |
+                 ((uint32_t)s << 8) | Mul(s, 3);
+      Td[0][x] = ((uint32_t)Mul(si, 14) << 24) | ((uint32_t)Mul(si, 9) << 16) |
+                 ((uint32_t)Mul(si, 13) << 8) | Mul(si, 11);
+      for (unsigned int t = 1; t < 4; t++) {
+        Te[t][x] = Ror8(Te[t - 1][x]);
+        Td[t][x] = Ror8(Td[t - 1][x]);
+      }
+    }
+  }
+};
+
+const Tables &GetTables() {
+  static const Tables tables;
+  return tables;
+}
+
+}  // namespace
+
+void ExpandDecryptionKeys(const unsigned char *roundKeys,
+                          unsigned char *decRoundKeys, unsigned int Nr) {
+  memcpy(decRoundKeys, roundKeys + 16 * Nr, 16);
+  for (unsigned int r = 1; r < Nr; r++) {
+    const unsigned char *k = roundKeys + 16 * (Nr - r);
+    unsigned char *d = decRoundKeys + 16 * r;
+    for (unsigned int c = 0; c < 4; c++) {
+      const unsigned char *a = k + 4 * c;
+      for (unsigned int i = 0; i < 4; i++) {
+        d[4 * c + i] = GF_MUL_TABLE[INV_CMDS[i][0]][a[0]] ^
+                       GF_MUL_TABLE[INV_CMDS[i][1]][a[1]] ^
+                       GF_MUL_TABLE[INV_CMDS[i][2]][a[2]] ^
+                       GF_MUL_TABLE[INV_CMDS[i][3]][a[3]];
+      }
+    }
+  }
+  memcpy(decRoundKeys + 16 * Nr, roundKeys, 16);
+}
+
+void EncryptTTable(const unsigned char *roundKeys, unsigned int Nr,
+                   const unsigned char *in, unsigned char *out, unsigned int n) {
+  const Tables &T = GetTables();
+  uint32_t rk[4 * 15];
+  for (unsigned int i = 0; i < 4 * (Nr + 1); i++) rk[i] = Load(roundKeys + 4 * i);
+
+  for (unsigned int b = 0; b < n; b++, in += 16, out += 16) {
+    uint32_t s0 = Load(in) ^ rk[0];
+    uint32_t s1 = Load(in + 4) ^ rk[1];
+    uint32_t s2 = Load(in + 8) ^ rk[2];
+    uint32_t s3 = Load(in + 12) ^ rk[3];
+    const uint32_t *k = rk + 4;
+    for (unsigned int r = 1; r < Nr; r++, k += 4) {
+      uint32_t t0 = T.Te[0][s0 >> 24] ^ T.Te[1][(s1 >> 16) & 0xff] ^
+                    T.Te[2][(s2 >> 8) & 0xff] ^ T.Te[3][s3 & 0xff] ^ k[0];
+      uint32_t t1 = T.Te[0][s1 >> 24] ^ T.Te[1][(s2 >> 16) & 0xff] ^
+                    T.Te[2][(s3 >> 8) & 0xff] ^ T.Te[3][s0 & 0xff] ^ k[1];
+      uint32_t t2 = T.Te[0][s2 >> 24] ^ T.Te[1][(s3 >> 16) & 0xff] ^
+                    T.Te[2][(s0 >> 8) & 0xff] ^ T.Te[3][s1 & 0xff] ^ k[2];
+      uint32_t t3 = T.Te[0][s3 >> 24] ^ T.Te[1][(s0 >> 16) & 0xff] ^
+                    T.Te[2][(s1 >> 8) & 0xff] ^ T.Te[3][s2 & 0xff] ^ k[3];
+      s0 = t0;
+      s1 = t1;
+      s2 = t2;
+      s3 = t3;
+    }
+    uint32_t s[4] = {s0, s1, s2, s3};
+    for (unsigned int c = 0; c < 4; c++) {
+      uint32_t t = ((uint32_t)T.S[s[c] >> 24] << 24) |
+                   ((uint32_t)T.S[(s[(c + 1) % 4] >> 16) & 0xff] << 16) |
+                   ((uint32_t)T.S[(s[(c + 2) % 4] >> 8) & 0xff] << 8) |
+                   (uint32_t)T.S[s[(c + 3) % 4] & 0xff];
+      Store(out + 4 * c, t ^ k[c]);
+    }
+  }
+}
+
+void DecryptTTable(const unsigned char *decRoundKeys, unsigned int Nr,
+                   const unsigned char *in, unsigned char *out, unsigned int n) {
+  const Tables &T = GetTables();
+  uint32_t rk[4 * 15];
+  for (unsigned int i = 0; i < 4 * (Nr + 1); i++) rk[i] = Load(decRoundKeys + 4 * i);
+
+  for (unsigned int b = 0; b < n; b++, in += 16, out += 16) {
+    uint32_t s0 = Load(in) ^ rk[0];
+    uint32_t s1 = Load(in + 4) ^ rk[1];
+    uint32_t s2 = Load(in + 8) ^ rk[2];
+    uint32_t s3 = Load(in + 12) ^ rk[3];
+    const uint32_t *k = rk + 4;
+    for (unsigned int r = 1; r < Nr; r++, k += 4) {
+      uint32_t t0 = T.Td[0][s0 >> 24] ^ T.Td[1][(s3 >> 16) & 0xff] ^
+                    T.Td[2][(s2 >> 8) & 0xff] ^ T.Td[3][s1 & 0xff] ^ k[0];
+      uint32_t t1 = T.Td[0][s1 >> 24] ^ T.Td[1][(s0 >> 16) & 0xff] ^
+                    T.Td[2][(s3 >> 8) & 0xff] ^ T.Td[3][s2 & 0xff] ^ k[1];
+      uint32_t t2 = T.Td[0][s2 >> 24] ^ T.Td[1][(s1 >> 16) & 0xff] ^
+                    T.Td[2][(s0 >> 8) & 0xff] ^ T.Td[3][s3 & 0xff] ^ k[2];
+      uint32_t t3 = T.Td[0][s3 >> 24] ^ T.Td[1][(s2 >> 16) & 0xff] ^
+                    T.Td[2][(s1 >> 8) & 0xff] ^ T.Td[3][s0 & 0xff] ^ k[3];
+      s0 = t0;
+      s1 = t1;
+      s2 = t2;
+      s3 = t3;
+    }
+    uint32_t s[4] = {s0, s1, s2, s3};
+    for (unsigned int c = 0; c < 4; c++) {
+      uint32_t t = ((uint32_t)T.Si[s[c] >> 24] << 24) |
+                   ((uint32_t)T.Si[(s[(c + 3) % 4] >> 16) & 0xff] << 16) |
+                   ((uint32_t)T.Si[(s[(c + 2) % 4] >> 8) & 0xff] << 8) |
+                   (uint32_t)T.Si[s[(c + 1) % 4] & 0xff];
+      Store(out + 4 * c, t ^ k[c]);
+    }
+  }
+}
+
+#ifdef AES_HOST_AESNI
+
+bool HasAESNI() {
+  __builtin_cpu_init();
+  return __builtin_cpu_supports("aes");
+}
+
+namespace {
+
+template <bool DECRYPT>
+__attribute__((target("aes,sse2"))) inline __m128i Round(__m128i b, __m128i k) {
+  return DECRYPT ? _mm_aesdec_si128(b, k) : _mm_aesenc_si128(b, k);
+}
+
+template <bool DECRYPT>
+__attribute__((target("aes,sse2"))) inline __m128i LastRound(__m128i b, __m128i k) {
+  return DECRYPT ? _mm_aesdeclast_si128(b, k) : _mm_aesenclast_si128(b, k);
+}
+
+// Eight blocks are kept in flight to cover the instruction latency.
+// The inner loops must be unrolled so that the blocks stay in registers.
+template <bool DECRYPT>
+__attribute__((target("aes,sse2")))
+void CryptAESNI(const unsigned char *roundKeys, unsigned int Nr,
+                const unsigned char *in, unsigned char *out, unsigned int n) {
+  __m128i k[15];
+  for (unsigned int r = 0; r <= Nr; r++) {
+    k[r] = _mm_loadu_si128((const __m128i *)(roundKeys + 16 * r));
+  }
+
+  for (; n >= 8; n -= 8, in += 128, out += 128) {
+    __m128i b[8];
+#pragma GCC unroll 8
+    for (int j = 0; j < 8; j++) {
+      b[j] = _mm_xor_si128(_mm_loadu_si128((const __m128i *)(in + 16 * j)), k[0]);
+    }
+    for (unsigned int r = 1; r < Nr; r++) {
+#pragma GCC unroll 8
+      for (int j = 0; j < 8; j++) b[j] = Round<DECRYPT>(b[j], k[r]);
+    }
+#pragma GCC unroll 8
+    for (int j = 0; j < 8; j++) {
+      _mm_storeu_si128((__m128i *)(out + 16 * j), LastRound<DECRYPT>(b[j], k[Nr]));
+    }
+  }
+
+  for (; n > 0; n--, in += 16, out += 16) {
+    __m128i b = _mm_xor_si128(_mm_loadu_si128((const __m128i *)in), k[0]);
+    for (unsigned int r = 1; r < Nr; r++) b = Round<DECRYPT>(b, k[r]);
+    _mm_storeu_si128((__m128i *)out, LastRound<DECRYPT>(b, k[Nr]));
+  }
+}
+
+}  // namespace
+
+void EncryptAESNI(const unsigned char *roundKeys, unsigned int Nr,
+                  const unsigned char *in, unsigned char *out, unsigned int n) {
+  CryptAESNI<false>(roundKeys, Nr, in, out, n);
+}
+
+void DecryptAESNI(const unsigned char *roundKeys, unsigned int Nr,
+                  const unsigned char *in, unsigned char *out, unsigned int n) {
+  CryptAESNI<true>(roundKeys, Nr, in, out, n);
+}
+
+#else
+
+bool HasAESNI() { return false; }
+
+void EncryptAESNI(const unsigned char *roundKeys, unsigned int Nr,
+                  const unsigned char *in, unsigned char *out, unsigned int n) {
+  EncryptTTable(roundKeys, Nr, in, out, n);
+}
+
+void DecryptAESNI(const unsigned char *roundKeys, unsigned int Nr,
+                  const unsigned char *in, unsigned char *out, unsigned int n) {
+  DecryptTTable(roundKeys, Nr, in, out, n);
+}
+
+#endif
+
+}  // namespace AESHost
+
+#endif
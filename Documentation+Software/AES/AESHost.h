@@ -0,0 +1,39 @@
+#ifndef _AES_HOST_H_
+#define _AES_HOST_H_
+
+// Fast block functions for PC builds of the AES class.
+// T-tables in portable C++, and AES-NI when the CPU has it.
+// Not used on Arduino boards, where the reference code in AES.cpp runs.
+// Round keys are in the byte order produced by AES::KeyExpansion().
+
+#if !defined(ARDUINO) && !defined(AES_NO_HOST_BACKEND)
+#define AES_HOST_BACKEND
+#endif
+
+#ifdef AES_HOST_BACKEND
+
+namespace AESHost {
+
+// True if the CPU reports the AES instructions.
+bool HasAESNI();
+
+// Round keys for the equivalent inverse cipher, used by both decryptors.
+// Reverse order, with InvMixColumns applied to the inner rounds.
+void ExpandDecryptionKeys(const unsigned char *roundKeys,
+                          unsigned char *decRoundKeys, unsigned int Nr);
+
+// n independent 16-byte blocks. out may equal in.
+void EncryptTTable(const unsigned char *roundKeys, unsigned int Nr,
+                   const unsigned char *in, unsigned char *out, unsigned int n);
+void DecryptTTable(const unsigned char *decRoundKeys, unsigned int Nr,
+                   const unsigned char *in, unsigned char *out, unsigned int n);
+void EncryptAESNI(const unsigned char *roundKeys, unsigned int Nr,
+                  const unsigned char *in, unsigned char *out, unsigned int n);
+void DecryptAESNI(const unsigned char *decRoundKeys, unsigned int Nr,
+                  const unsigned char *in, unsigned char *out, unsigned int n);
+
+}  // namespace AESHost
+
+#endif
+
+#endif
@@ -0,0 +1,114 @@
+#include "CCM.h"
+
+CCM::CCM(AES &cipher) : aes(cipher) {}
+
+bool CCM::ValidTagLength(unsigned int tagLen) {
+  return tagLen >= 4 && tagLen <= maxTagLen && tagLen % 2 == 0;
+}
+
+bool CCM::Encrypt(const unsigned char nonce[], const unsigned char *aad,
+                  unsigned int aadLen, unsigned char *data, unsigned int len,
+                  unsigned char *tag, unsigned int tagLen) {
+  if (!ValidTagLength(tagLen) || len > 0xffff || aadLen >= 0xff00) return false;
+
+  unsigned char mac[blockLen];
+  unsigned char s0[blockLen];
+  Mac(nonce, aad, aadLen, data, len, tagLen, mac);
+  Ctr(nonce, data, len, s0);
+  for (unsigned int i = 0; i < tagLen; i++) {
+    tag[i] = mac[i] ^ s0[i];
+  }
+
+  return true;
+}
+
+bool CCM::Decrypt(const unsigned char nonce[], const unsigned char *aad,
+                  unsigned int aadLen, unsigned char *data, unsigned int len,
+                  const unsigned char *tag, unsigned int tagLen) {
+  if (!ValidTagLength(tagLen) || len > 0xffff || aadLen >= 0xff00) return false;
+
+  unsigned char mac[blockLen];
+  unsigned char s0[blockLen];
+  Ctr(nonce, data, len, s0);
+  Mac(nonce, aad, aadLen, data, len, tagLen, mac);
+
+  // Compare every byte so that timing does not reveal the mismatch.
+  unsigned char diff = 0;
+  for (unsigned int i = 0; i < tagLen; i++) {
+    diff |= (unsigned char)(mac[i] ^ s0[i] ^ tag[i]);
+  }
+
+  if (diff != 0) {
+    memset(data, 0, len);
+    return false;
+  }
+
+  return true;
+}
+
+// CBC-MAC over B0, the encoded associated data and the payload.
+void CCM::Mac(const unsigned char nonce[], const unsigned char *aad,
+              unsigned int aadLen, const unsigned char *data, unsigned int len,
+              unsigned int tagLen, unsigned char mac[]) {
+  unsigned char b0[blockLen];
+  b0[0] = (aadLen ? 0x40 : 0x00) | (((tagLen - 2) / 2) << 3) | (15 - nonceLen - 1);
+  memcpy(b0 + 1, nonce, nonceLen);
+  b0[14] = (unsigned char)(len >> 8);
+  b0[15] = (unsigned char)len;
+  aes.EncryptECB(b0, mac, blockLen);
+
+  unsigned int used = 0;
+  if (aadLen) {
+    unsigned char encodedLen[2] = {(unsigned char)(aadLen >> 8),
+                                   (unsigned char)aadLen};
+    MacBytes(mac, used, encodedLen, 2);
+    MacBytes(mac, used, aad, aadLen);
+    MacPad(mac, used);
+  }
+
+  MacBytes(mac, used, data, len);
+  MacPad(mac, used);
+}
+
+// Counter mode. Block 0 of the key stream is returned in s0 for the tag,
+// blocks 1 onwards are applied to the data.
+void CCM::Ctr(const unsigned char nonce[], unsigned char *data,
+              unsigned int len, unsigned char s0[]) {
+  unsigned char counter[blockLen];
+  unsigned char stream[blockLen];
+  counter[0] = 15 - nonceLen - 1;
+  memcpy(counter + 1, nonce, nonceLen);
+  counter[14] = 0;
+  counter[15] = 0;
+  aes.EncryptECB(counter, s0, blockLen);
+
+  for (unsigned int i = 0, n = 1; i < len; i += blockLen, n++) {
+    counter[14] = (unsigned char)(n >> 8);
+    counter[15] = (unsigned char)n;
+    aes.EncryptECB(counter, stream, blockLen);
+    unsigned int count = len - i < blockLen ? len - i : blockLen;
+    for (unsigned int j = 0; j < count; j++) {
+      data[i + j] ^= stream[j];
+    }
+  }
+}
+
+// Feeds bytes into the CBC-MAC. used counts bytes in the current block.
+void CCM::MacBytes(unsigned char x[], unsigned int &used,
+                   const unsigned char *in, unsigned int len) {
+  for (unsigned int i = 0; i < len; i++) {
+    x[used++] ^= in[i];
+    if (used == blockLen) {
+      aes.EncryptECB(x, x, blockLen);
+      used = 0;
+    }
+  }
+}
+
+// Completes a partial block with zeros.
+void CCM::MacPad(unsigned char x[], unsigned int &used) {
+  if (used) {
+    aes.EncryptECB(x, x, blockLen);
+    used = 0;
+  }
+}
@@ -0,0 +1,54 @@
+#ifndef _CCM_H_
+#define _CCM_H_
+
+#include "AES.h"
+
+// AES-CCM authenticated encryption (NIST SP 800-38C, RFC 3610).
+// Uses an AES object whose key has been set with SetKey().
+// Encrypts in place. The output is the same size as the input,
+// plus a tag of 4 to 16 bytes (even) kept by the caller.
+// Messages are limited to 65535 bytes (two-byte length field),
+// which leaves a 13-byte nonce.
+// A nonce must never be used twice with the same key.
+
+class CCM {
+ public:
+  static constexpr unsigned int nonceLen = 13;
+  static constexpr unsigned int maxTagLen = 16;
+
+  explicit CCM(AES &cipher);
+
+  // True for the tag lengths CCM allows: 4, 6, 8, 10, 12, 14, 16.
+  static bool ValidTagLength(unsigned int tagLen);
+
+  // Encrypts data in place and writes the tag.
+  // aad is authenticated but not encrypted.
+  bool Encrypt(const unsigned char nonce[], const unsigned char *aad,
+               unsigned int aadLen, unsigned char *data, unsigned int len,
+               unsigned char *tag, unsigned int tagLen);
+
+  // Decrypts data in place and checks the tag.
+  // Returns false, with data zeroed, if the tag does not match.
+  bool Decrypt(const unsigned char nonce[], const unsigned char *aad,
+               unsigned int aadLen, unsigned char *data, unsigned int len,
+               const unsigned char *tag, unsigned int tagLen);
+
+ private:
+  static constexpr unsigned int blockLen = 16;
+
+  AES &aes;
+
+  void Mac(const unsigned char nonce[], const unsigned char *aad,
+           unsigned int aadLen, const unsigned char *data, unsigned int len,
+           unsigned int tagLen, unsigned char mac[]);
+
+  void Ctr(const unsigned char nonce[], unsigned char *data, unsigned int len,
+           unsigned char s0[]);
+
+  void MacBytes(unsigned char x[], unsigned int &used, const unsigned char *in,
+                unsigned int len);
+
+  void MacPad(unsigned char x[], unsigned int &used);
+};
+
+#endif
@@ -0,0 +1,85 @@
+#include "Acquisition.h" // class declaration
+
+#if defined(ARDUINO_ARCH_SAMD)
+#include "wiring_private.h" // pinPeripheral()
+
+// Waits for register writes to reach the ADC's clock domain.
+static inline void SyncADC()
+{
+  while (ADC->STATUS.bit.SYNCBUSY);
+}
+#endif
+
+// Constructor
+Acquisition::Acquisition(const uint8_t* pins, uint8_t count, uint8_t oversampling) :
+  pins(pins),
+  count(count < ACQUISITION_MAX_CHANNELS ? count : ACQUISITION_MAX_CHANNELS),
+  oversampling(oversampling < 10 ? oversampling : 10)
+{
+  memset(readings, 0, sizeof(readings));
+}
+
+void Acquisition::begin()
+{
+  // Configure analog digital conversion (ADC).
+  // MKR WAN 1310 is a SAMD board. Default reference is 3.3v.
+  // https://docs.arduino.cc/language-reference/en/functions/analog-io/analogReference
+  // Capable of 12-bit ADC resolution.
+  // https://docs.arduino.cc/language-reference/en/functions/analog-io/analogReadResolution
+  analogReference(AR_DEFAULT);
+  analogReadResolution(12);
+  for (uint8_t c = 0; c < count; c++)
+    pinMode(pins[c], INPUT);
+
+#if defined(ARDUINO_ARCH_SAMD)
+  for (uint8_t c = 0; c < count; c++)
+    pinPeripheral(pins[c], PIO_ANALOG);
+
+  // Hardware averaging. Results are 16 bits: the sum of the
+  // conversions, shifted right automatically past 16 conversions.
+  SyncADC();
+  ADC->CTRLB.bit.RESSEL = ADC_CTRLB_RESSEL_16BIT_Val;
+  SyncADC();
+  ADC->AVGCTRL.reg = ADC_AVGCTRL_SAMPLENUM(oversampling) | ADC_AVGCTRL_ADJRES(0);
+  SyncADC();
+  ADC->CTRLA.bit.ENABLE = 1;
+  SyncADC();
+
+  // The first conversion after enabling is not to be trusted.
+  if (count > 0) Convert(pins[0]);
+#endif
+}
+
+const uint16_t* Acquisition::Sample(unsigned long maxAge)
+{
+  if (sampled && millis() - sampleTime < maxAge) return readings;
+
+  // A sum of fewer than 16 conversions is scaled up to 1/16 of a code.
+  uint8_t scale = oversampling < ACQUISITION_FRACTION_BITS ? ACQUISITION_FRACTION_BITS - oversampling : 0;
+  for (uint8_t c = 0; c < count; c++)
+    readings[c] = Convert(pins[c]) << scale;
+
+  sampled = true;
+  sampleTime = millis();
+  return readings;
+}
+
+// One reading of a pin, before scaling.
+// The sum of 2^oversampling conversions, at most 16 bits.
+uint16_t Acquisition::Convert(uint8_t pin)
+{
+#if defined(ARDUINO_ARCH_SAMD)
+  SyncADC();
+  ADC->INPUTCTRL.bit.MUXPOS = g_APinDescription[pin].ulADCChannelNumber;
+  SyncADC();
+  ADC->SWTRIG.bit.START = 1;
+  while (!ADC->INTFLAG.bit.RESRDY);
+  return ADC->RESULT.reg; // reading the result clears RESRDY
+#else
+  uint32_t sum = 0;
+  for (uint16_t n = 0; n < (1U << oversampling); n++)
+    sum += analogRead(pin);
+  uint8_t shift = oversampling > ACQUISITION_FRACTION_BITS ? oversampling - ACQUISITION_FRACTION_BITS : 0;
+  return (uint16_t)(sum >> shift);
+#endif
+}
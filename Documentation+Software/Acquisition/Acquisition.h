@@ -0,0 +1,65 @@
+#pragma once
+
+// Oversampled acquisition of a set of analog inputs.
+//
+// The ADC is configured once, in begin(). Each call to Sample() then
+// reads every channel in one pass. Each reading is the average of
+// 2^oversampling conversions, done by the SAMD21's hardware averaging.
+// Readings are fixed point, in 1/16 of a 12-bit ADC code, and can be
+// given straight to a calibration (see Calibration.h):
+//
+//   soilVWC.Convert(sensors.Reading(0), VWC, ACQUISITION_FRACTION_BITS);
+//
+// On the SAMD21 the ADC is left set up for this class.
+// Use Sample() rather than analogRead() on any pin once begun.
+// On other boards, and on the host, conversions go through analogRead().
+
+#include <Arduino.h>
+
+// Fraction bits of a reading
+#define ACQUISITION_FRACTION_BITS 4
+
+// log2 of the conversions averaged per reading, 0 .. 10.
+// Define before including this file to change the default.
+#ifndef ACQUISITION_OVERSAMPLING
+#define ACQUISITION_OVERSAMPLING 4
+#endif
+
+// Most channels sampled by one Acquisition
+#ifndef ACQUISITION_MAX_CHANNELS
+#define ACQUISITION_MAX_CHANNELS 8
+#endif
+
+class Acquisition
+{
+
+public:
+
+  // pins are the analog input pins, in channel order.
+  // The array is not copied, so it has to outlive the Acquisition.
+  Acquisition(const uint8_t* pins, uint8_t count, uint8_t oversampling = ACQUISITION_OVERSAMPLING);
+
+  // Configures the ADC and the pins. Call from setup().
+  void begin();
+
+  // Samples every channel and returns the readings, one per channel.
+  // Readings taken less than maxAge milliseconds ago are returned
+  // again without sampling, so that several users can share one pass.
+  const uint16_t* Sample(unsigned long maxAge = 0);
+
+  // Latest reading of a channel, in 1/16 of an ADC code.
+  uint16_t Reading(uint8_t channel) const { return channel < count ? readings[channel] : 0; }
+
+  uint8_t Count() const { return count; }
+
+private:
+
+  const uint8_t* pins;
+  uint8_t count;
+  uint8_t oversampling;
+  bool sampled = false;
+  unsigned long sampleTime = 0; // millis() of the latest Sample()
+  uint16_t readings[ACQUISITION_MAX_CHANNELS];
+
+  uint16_t Convert(uint8_t pin);
+};
@@ -11,7 +11,14 @@
   Sends response to requests.
 
   Ensures only one request is made at a time of a
-  given apparatus at a given destination.
+  given apparatus at a given destination, unless
+  PIPELINED is defined. Then all apparatus at the
+  destination are polled back to back, and responses
+  are matched to requests by request ID.
+
+  With BATCHED defined, all apparatus at the destination
+  are polled with one batch request instead, and answered
+  with one batch response.
 
   This application of the RequestResponse_Framework
   sends and responds to requests for battery voltage. 
@@ -25,6 +32,12 @@
 // How long to wait for a response (milliseconds)
 #define waitTime 60000
 
+// Allow several requests in flight per destination/apparatus.
+//#define PIPELINED
+
+// Poll all apparatus with one batch request.
+//#define BATCHED
+
 // Get the local and destination addresses for this node.
 // Destination can be made variable.
 #include "Addresses.h"
@@ -34,47 +47,44 @@
 #include "LoRaMessageHandler.h"
 LoRaMessageHandler *messagingLibrary = NULL;
 
-// Library for implementing Lists on Arduino
-// https://nkaaf.github.io/Arduino-List/html/index.html
-#include <SingleLinkedList.hpp>
+// Table of outstanding requests, part of the message-handling library.
+#include "RequestTable.h"
+
+// Registry of apparatus, part of the message-handling library.
+#include "ApparatusRegistry.h"
+
+// Sensor calibrations, converted in fixed point.
+#include "SensorCalibration.h"
+
+// Oversampled reading of the analog inputs.
+#include "Acquisition.h"
+
+// Handlers that serve requests for each apparatus.
+bool ReadBattery(uint32_t request, uint32_t& response);
+bool ReadSoil(uint32_t request, uint32_t& response);
+bool ToggleLED(uint32_t request, uint32_t& response);
 
 // Sensor/Actuator (Apparatus) List.
 // apparatusID is the position in the list.
 // All request/response nodes need to
 // have the same ID associations.
-// To find the number of strings in such
-// a list within the scope of the declaration,
-// use, for example:
-// numApparatus = sizeof(apparatusList) / sizeof(apparatusList[0]).
-String apparatusList[] =
+// Received apparatus IDs are looked up in the
+// registry, which rejects IDs not in the list.
+constexpr Apparatus apparatusList[] =
 {
-  "Sensor BATTV",
-  "Sensor SOIL",
-  "Actuator LED"
+  {0, ApparatusKind::Sensor,   "Sensor BATTV", ReadBattery, PayloadEncoding::Hundredths},
+  {1, ApparatusKind::Sensor,   "Sensor SOIL",  ReadSoil,    PayloadEncoding::Hundredths},
+  {2, ApparatusKind::Actuator, "Actuator LED", ToggleLED,   PayloadEncoding::OnOff}
 };
-static long numApparatus = sizeof(apparatusList) / sizeof(apparatusList[0]);
-// Two types of apparatus for this demo
-#define unknown 255
-#define sensor 1
-#define actuator 0
-
-// List of outstanding requests
-struct CurrentRequest
-{
-  uint8_t apparatusID;
-  uint32_t associatedValue;
-  uint8_t destination;
-  long timeSent;
-};
-SingleLinkedList<CurrentRequest> outstandingRequests;
+constexpr ApparatusRegistry apparatus(apparatusList);
+static_assert(apparatus.Valid(), "apparatus IDs must match their position in apparatusList");
+
+// Outstanding requests, keyed by destination, apparatus and request ID.
+RequestTable outstandingRequests;
 
 // Timing variables
-long lastSendTime = 0;          // last send time
 const long maxInterval = 5000;  // maximum millisecond interval between sends
-long interval = 0;              // current interval between sends
-
-// External subroutines for responding to requests
-extern float ReadVoltage(uint8_t voltagePin);
+#define receivePollInterval 5   // milliseconds between checks for incoming packets
 
 // Output pins for controlling actuators
 #define ledPin LED_BUILTIN
@@ -89,13 +99,21 @@ extern float ReadVoltage(uint8_t voltagePin);
 #define batteryPin A2
 #define soilPin A1
 
+// Analog inputs, sampled together in one pass.
+// Readings are shared for sampleReuse milliseconds,
+// so a batch request samples them once.
+const uint8_t analogPins[] = { batteryPin, soilPin };
+enum { batteryChannel, soilChannel };
+Acquisition sensors(analogPins, sizeof(analogPins));
+#define sampleReuse 100
+
 void setup()
 {
   // ============ Standard MKR WAN 1310 Setup Code =============
   
   // Initialize serial port
   Serial.begin(9600);
-  while (!Serial) wait(100); // wait for serial port to be ready
+  while (!Serial) Tasks.Wait(100); // wait for serial port to be ready
   #ifdef DEBUG
     Serial.println("Node is active");
   #endif
@@ -110,13 +128,21 @@ void setup()
 
   // Initialize program-specific variables.
   randomSeed(localAddress);
-  interval = random(maxInterval);
-  lastSendTime = millis();
 
   // Initialize actuator control pins.
   // Actuators initialize to LOW, OFF.
   pinMode(ledPin, OUTPUT); digitalWrite(ledPin, LOW);
 
+  // Configure the ADC and the sensor input pins.
+  sensors.begin();
+
+  // The node's work is done by tasks, run from loop().
+  // Requests go out at random intervals. Incoming packets
+  // and unanswered requests are checked periodically.
+  Tasks.After(random(maxInterval), SendRequests);
+  Tasks.Every(receivePollInterval, CheckForMessages);
+  Tasks.Every(REQUEST_TABLE_TICK_MS, ExpireRequests);
+
   // Ready
   #ifdef DEBUG
     Serial.println("========================================================");
@@ -127,78 +153,36 @@ void setup()
 
 void loop()
 {
-  // This variable allows for selecting an apparatus.
-  // A request is then generated for that apparatus.
-  static uint8_t apparatusSelector = 0;
-  
-  // Check if it is time to send another request
-  if (millis() - lastSendTime > interval)
-  {
-    // Compose message
-    CurrentRequest thisRequest;
-    thisRequest.destination = destinationAddress;
-    bool broadcast = true;
+  // Run whichever tasks are due. Idle until the next one otherwise.
+  Tasks.Run();
+}
+
+// ============= Function Definitions =================
 
-    // Select an apparatus to make a request about
+// Task. Sends the next request, then picks when to send another.
+void SendRequests()
+{
+  // Select an apparatus to make a request about.
+  // Sensors are asked for a reading, actuators to toggle.
+  #if defined(BATCHED)
+    RequestAllFrom(destinationAddress);
+  #elif defined(PIPELINED)
+    for(uint8_t a = 0; a < apparatus.Count(); a++) RequestFrom(destinationAddress, a, 0);
+  #else
+    // This variable allows for selecting an apparatus.
+    // A request is then generated for that apparatus.
+    static uint8_t apparatusSelector = 0;
     apparatusSelector++;
-    uint8_t thisApparatus = apparatusSelector % numApparatus;
-    thisRequest.apparatusID = thisApparatus;
-    uint8_t apparatusType = 0; // only sensors and actuators for now
-    if(apparatusList[thisApparatus].indexOf("Sensor") >= 0) apparatusType = sensor;
-    else if(apparatusList[thisApparatus].indexOf("Actuator") >= 0) apparatusType = actuator;
-    else apparatusType = unknown;
-    switch(apparatusType)
-    {
-      case sensor: // send request for sensor reading
-        thisRequest.associatedValue = 0; // request for reading
-        break;
-      case actuator: // send request for actuator
-        thisRequest.associatedValue = 0; // request to toggle
-        break;
-      default: // apparatus nomentclature not understood
-        #ifdef DEBUG
-          Serial.println("Error: Apparatus nomenclature not understood");
-          Serial.println("Apparatus # " + String(thisApparatus) +
-                         ". Nomenclature: " + apparatusList[thisApparatus]);
-        #endif
-        broadcast = false;
-    }
+    RequestFrom(destinationAddress, apparatusSelector % apparatus.Count(), 0);
+  #endif
 
-    // Broadcast the request
-    if(broadcast)
-    {
-      #ifdef DEBUG
-        Serial.println("\nSending Request to Node " + String(thisRequest.destination));
-        Serial.println("Apparatus: " + apparatusList[thisRequest.apparatusID]);
-        Serial.print("Associated Value: ");
-        Serial.println(thisRequest.associatedValue);
-      #endif
-  
-      // Send request and add to list of outstanding requests.
-      // Reject request if destination/apparatus already occupied.
-      float r = FindRequest(thisRequest.apparatusID, thisRequest.destination);
-      if(r < 0.0f)
-      {
-        messagingLibrary->SendRequest(thisRequest.apparatusID, thisRequest.associatedValue, thisRequest.destination);
-        #ifdef DEBUG
-          Serial.println("Sent Request");
-        #endif
-        thisRequest.timeSent = millis();
-        outstandingRequests.add(thisRequest);
-        #ifdef DEBUG
-          Serial.println("Outstanding Requests: " + String(outstandingRequests.getSize()));
-        #endif
-      }
-      #ifdef DEBUG
-        else Serial.println("*** Apparatus already engaged");
-      #endif
-    }
-      
-    // Select the next time to send a request
-    lastSendTime = millis();
-    interval = random(maxInterval);
-  }
+  // Select the next time to send a request
+  Tasks.After(random(maxInterval), SendRequests);
+}
 
+// Task. Serves or accepts any incoming packet for this node.
+void CheckForMessages()
+{
   // Check for an incoming packet for this node
   if(messagingLibrary->CheckForIncomingPacket() > 0)
   {
@@ -209,249 +193,259 @@ void loop()
     if((thisMessage[LOCATION_MESSAGE_TYPE] == 1) ||
        (thisMessage[LOCATION_MESSAGE_TYPE] == 2))
     {
-      // Need to check thisMessage[LOCATION_APPARATUS_ID] for valid ID.
-      // Ok this way for this demo.
-      bool broadcast = true;
-      uint8_t apparatusType = 0; // only sensors and actuators for now
-      if(apparatusList[thisMessage[LOCATION_APPARATUS_ID]].indexOf("Sensor") >= 0) apparatusType = sensor;
-      else if(apparatusList[thisMessage[LOCATION_APPARATUS_ID]].indexOf("Actuator") >= 0) apparatusType = actuator;
-      else apparatusType = unknown;
-
-      // Deduce the type of message. React as appropriate.
-      if(thisMessage[LOCATION_MESSAGE_TYPE] == 1) // received a request message
+      // One table lookup. NULL for an apparatus ID not in the list.
+      const Apparatus* thisApparatus = apparatus.Find(thisMessage[LOCATION_APPARATUS_ID]);
+      bool isSensor = thisApparatus != NULL && thisApparatus->kind == ApparatusKind::Sensor;
+      uint32_t associatedValue = messagingLibrary->getAssociatedValue();
+
+      // Printed piece by piece to avoid String temporaries on the receive path.
+      if(thisApparatus == NULL)
       {
-        bool sendPacket = true;
-        uint32_t associatedValue = 0;
-        switch(apparatusType) // sensor request
-        {
-          case sensor: // request regarding a sensor
-            Serial.println("\nReceived sensor request.");
-            Serial.println("Node " + String(thisMessage[LOCATION_SOURCE_ID]) +
-                           ". Regarding '" + apparatusList[thisMessage[LOCATION_APPARATUS_ID]] + "'");
-            memcpy(&associatedValue, thisMessage + MESSAGE_HEADER_LENGTH, sizeof(associatedValue));
-            if(apparatusList[thisMessage[LOCATION_APPARATUS_ID]].indexOf("BATTV") >= 0)
-            {
-              if(associatedValue == 0) // only dealing with requests for readings for now
-              {
-                float voltage = ReadVoltage(batteryPin);
-                voltage *= 2.0f;
-                memcpy(&associatedValue, &voltage, sizeof(associatedValue));
-              }
-              else
-              {
-                #ifdef DEBUG
-                  Serial.println("*** invalide sensor request");
-                #endif
-                broadcast = false;
-              }
-            }
-            else if(apparatusList[thisMessage[LOCATION_APPARATUS_ID]].indexOf("SOIL") >= 0)
-            {
-              if(associatedValue == 0) // only dealing with requests for readings for now
-              {
-                float voltage = ReadVoltage(soilPin);
-                float VWC = GetVWC(voltage);
-                memcpy(&associatedValue, &VWC, sizeof(associatedValue));
-              }
-              else
-              {
-                #ifdef DEBUG
-                  Serial.println("*** invalid sensor request");
-                #endif
-                broadcast = false;
-              }
-            }
-            else
-            {
-              #ifdef DEBUG
-                Serial.println("*** unrecognized sensor");
-              #endif
-              broadcast = false;
-            }
-  
-            break;
-  
-          case actuator: // actuator request
-            Serial.println("\nReceived actuator request");
-            Serial.print("Node: " + String(thisMessage[LOCATION_SOURCE_ID]) +
-                         "; Actuator: " + String(thisMessage[LOCATION_APPARATUS_ID]));
-            if(digitalRead(ledPin) == HIGH)
-            {
-              digitalWrite(ledPin, LOW);
-              associatedValue = 0;
-              Serial.println(". New Status: OFF");
-            }
-            else
-            {
-              digitalWrite(ledPin, HIGH);
-              associatedValue = 1;
-              Serial.println(". New Status: ON");
-            }
-            break;
-  
-          default: // apparatus nomentclature not understood
-            #ifdef DEBUG
-              Serial.println("Error: Requested apparatus nomenclature not understood");
-              Serial.println("Apparatus # " + String(thisMessage[LOCATION_APPARATUS_ID]) +
-                             ". Nomenclature: " + apparatusList[thisMessage[LOCATION_APPARATUS_ID]]);
-            #endif
-            broadcast = false;
-        }
-  
-        // Send response
-        if(broadcast)
-          messagingLibrary->SendResponse(thisMessage[LOCATION_APPARATUS_ID], associatedValue,
-                                         thisMessage[LOCATION_SOURCE_ID]);
+        Serial.print("*** Unrecognized apparatus: ");
+        Serial.println(thisMessage[LOCATION_APPARATUS_ID]);
       }
-      else if(thisMessage[LOCATION_MESSAGE_TYPE] == 2) // received a response message
+      else if(thisMessage[LOCATION_MESSAGE_TYPE] == 1) // received a request message
       {
-        boolean remove = true;
-        switch(apparatusType)
-        {
-          case sensor:
-            if(apparatusList[thisMessage[LOCATION_APPARATUS_ID]].indexOf("BATTV") >= 0)
-            {
-              float voltage = 0.0f;
-              memcpy(&voltage, thisMessage + MESSAGE_HEADER_LENGTH, sizeof(voltage));
-              Serial.println("\nReceived sensor response.");
-              Serial.println("Node: " + String(thisMessage[LOCATION_SOURCE_ID]) +
-                             ". Battery Volts: " + String(voltage));
-            }
-            else if(apparatusList[thisMessage[LOCATION_APPARATUS_ID]].indexOf("SOIL") >= 0)
-            {
-              float VWC = 0.0f;
-              memcpy(&VWC, thisMessage + MESSAGE_HEADER_LENGTH, sizeof(VWC));
-              Serial.println("\nReceived sensor response.");
-              Serial.println("Node: " + String(thisMessage[LOCATION_SOURCE_ID]) +
-                             ". VWC: " + String(VWC));
-            }
-            #ifdef DEBUG
-              else Serial.println("*** Unknown sensor");
-            #endif
-            
-            break;
-  
-          case actuator:
-            if(apparatusList[thisMessage[LOCATION_APPARATUS_ID]].indexOf("LED") >= 0)
-            {
-              uint32_t actuatorStatus;
-              memcpy(&actuatorStatus, thisMessage + MESSAGE_HEADER_LENGTH, sizeof(actuatorStatus));
-              Serial.println("\nReceived actuator response");
-              Serial.print("Node: " + String(thisMessage[LOCATION_SOURCE_ID]) +
-                           "; Actuator: " + String(thisMessage[LOCATION_APPARATUS_ID]));
-              if(actuatorStatus == 1) Serial.println("; Status: ON");
-              else if(actuatorStatus == 0) Serial.println("; Status: OFF");
-              else Serial.println(". Status: Unknown");
-            }
-            else Serial.println("*** Unknown actuator");
-            break;
-  
-          default:
-            Serial.println("*** Unrecognized apparatus: " + String(thisMessage[LOCATION_APPARATUS_ID]));
-            remove = false;
-        }
-        
+        Serial.println(isSensor ? "\nReceived sensor request." : "\nReceived actuator request.");
+        Serial.print("Node "); Serial.print(thisMessage[LOCATION_SOURCE_ID]);
+        Serial.print(". Regarding '"); Serial.print(thisApparatus->name); Serial.println("'");
+
+        // Serve the request and send response
+        uint32_t response = 0;
+        if(thisApparatus->handler != NULL && thisApparatus->handler(associatedValue, response))
+          messagingLibrary->SendResponse(thisApparatus->id, response, thisMessage[LOCATION_SOURCE_ID],
+                                         messagingLibrary->getRequestID());
+        #ifdef DEBUG
+          else Serial.println("*** invalid request");
+        #endif
+      }
+      else // received a response message
+      {
+        Serial.println(isSensor ? "\nReceived sensor response." : "\nReceived actuator response.");
+        Serial.print("Node: "); Serial.print(thisMessage[LOCATION_SOURCE_ID]);
+        Serial.print(". "); Serial.print(thisApparatus->name); Serial.print(": ");
+        PrintValue(thisApparatus->encoding, associatedValue);
+
         // Remove request from list of outstanding requests after a response has been received and acted upon.
-        if(remove)
-        {
-          float r = FindRequest(thisMessage[LOCATION_APPARATUS_ID], thisMessage[LOCATION_SOURCE_ID]);
-          if(r >= 0.0f)
-          {
-              outstandingRequests.remove((int)r);
-              Serial.println("*** Removed satisfied outstanding request");
-          }
-          else Serial.println("*** Could not find associated request");
-        }
+        // A late response to a request that has already expired is not matched.
+        if(outstandingRequests.Remove(thisMessage[LOCATION_SOURCE_ID], thisApparatus->id,
+                                      messagingLibrary->getRequestID()))
+          Serial.println("*** Removed satisfied outstanding request");
+        else Serial.println("*** Could not find associated request");
       }
-      else Serial.println("*** Not equipped to deal with this message type");
     }
+    else if(thisMessage[LOCATION_MESSAGE_TYPE] == 4) ServeBatch();
+    else if(thisMessage[LOCATION_MESSAGE_TYPE] == 5) ReceiveBatch();
   }
-  
-  // Check for outstanding requests that are not satisfied.
-  while(outstandingRequests.getSize() > 0)
-  {
-    // Identify oldest outstanding request
-    CurrentRequest oldestRequest = outstandingRequests.get(0);
+}
 
-    // Delete if wait time is exceeded
-    if(millis() - oldestRequest.timeSent > waitTime)
-    {
-      Serial.println("\n*** Old unanswered request. Deleting.");
-      outstandingRequests.remove(0);
-    }
-    else break;
-  }
+// Task. Deletes outstanding requests whose wait time is exceeded.
+void ExpireRequests()
+{
+  outstandingRequests.Expire(RequestExpired);
 }
 
-// ============= Function Definitions =================
+// Send a request and add it to the table of outstanding requests.
+// Unless PIPELINED, reject it if destination/apparatus is already engaged.
+void RequestFrom(uint8_t destination, uint8_t apparatusID, uint32_t associatedValue)
+{
+  #ifdef DEBUG
+    Serial.println("\nSending Request to Node " + String(destination));
+    Serial.println("Apparatus: " + String(apparatusList[apparatusID].name));
+    Serial.print("Associated Value: ");
+    Serial.println(associatedValue);
+  #endif
 
-// Wait for a specific number of milliseconds.
-// delay() is blocking so we do not use that.
-// This approach does not use hardware-specific timers.
-void wait(long milliseconds)
+  if(!CanRequest(destination, apparatusID)) return;
+
+  // Not sent if the transmit queue is full, while the channel is busy.
+  uint16_t requestID = 0;
+  if(!messagingLibrary->SendRequest(apparatusID, associatedValue, destination, &requestID)) return;
+  outstandingRequests.Add(destination, apparatusID, requestID, associatedValue, waitTime);
+  #ifdef DEBUG
+    Serial.println("Sent Request " + String(requestID));
+    Serial.println("Outstanding Requests: " + String(outstandingRequests.Count()));
+  #endif
+}
+
+// Send one batch request for every apparatus in the list.
+// It is tracked as a single request for BATCH_APPARATUS.
+void RequestAllFrom(uint8_t destination)
 {
-  long beginTime = millis();
-  byte doSomething = 0;
-  while ((millis() - beginTime) <= milliseconds) doSomething++;
+  #ifdef DEBUG
+    Serial.println("\nSending Batch Request to Node " + String(destination));
+  #endif
+
+  if(!CanRequest(destination, BATCH_APPARATUS)) return;
+
+  uint8_t apparatusIDs[apparatus.Count()];
+  for(uint8_t a = 0; a < apparatus.Count(); a++) apparatusIDs[a] = a;
+
+  uint16_t requestID = 0;
+  if(!messagingLibrary->SendBatchRequest(apparatusIDs, apparatus.Count(), destination, &requestID)) return;
+  outstandingRequests.Add(destination, BATCH_APPARATUS, requestID, 0, waitTime);
+  #ifdef DEBUG
+    Serial.println("Sent Batch Request " + String(requestID));
+    Serial.println("Outstanding Requests: " + String(outstandingRequests.Count()));
+  #endif
 }
 
-// Find a destination/apparatus pair in the list of outstanding requests.
-float FindRequest(uint8_t apparatus, uint8_t sourceID)
+// Whether another request can be added to the table.
+// Unless PIPELINED, not if destination/apparatus is already engaged.
+bool CanRequest(uint8_t destination, uint8_t apparatusID)
 {
-  int r;
-  for(r = 0; r < outstandingRequests.getSize(); r++)
-  {
-    CurrentRequest thisRequest = outstandingRequests.get(r);
-    if( (thisRequest.apparatusID == apparatus) &&
-        (thisRequest.destination == sourceID) )
+  #ifndef PIPELINED
+    if(outstandingRequests.Engaged(destination, apparatusID))
     {
-      break;
+      #ifdef DEBUG
+        Serial.println("*** Apparatus already engaged");
+      #endif
+      return false;
     }
+  #endif
+
+  if(outstandingRequests.Full())
+  {
+    #ifdef DEBUG
+      Serial.println("*** Too many outstanding requests");
+    #endif
+    return false;
   }
 
-  //Serial.println("FindRequest: " + String(r) + " / " + String(outstandingRequests.getSize()));
-  if(r == outstandingRequests.getSize()) return -1.0f;
-  else return (float)r;
+  return true;
 }
 
-// Takes voltage as input, locates it in the table, applies the equation of a line, and delivers VWC.
-// Calibrated for a specific soil type.
-float GetVWC(float volts)
+// Serve a batch request with one batch response.
+// Each apparatus is asked as by a request with associated value zero.
+// Apparatus that cannot be served are left out of the response.
+void ServeBatch()
 {
-  const long numRows = 13;
-  float table[numRows][2] =
-  { // (x_volts, y_VWC)
-    {0.0f,  0.0f},
-    {0.1f,  0.1f},
-    {0.6f,  5.0f},
-    {1.1f, 10.0f},
-    {1.3f, 15.0f},
-    {1.4f, 20.0f},
-    {1.5f, 25.0f},
-    {1.6f, 30.0f},
-    {1.7f, 35.0f},
-    {1.8f, 40.0f},
-    {2.0f, 45.0f},
-    {2.3f, 50.0f},
-    {3.0f, 60.0f}
-  };
-
-  long r;
-  for (r = 1; r < numRows; r++)
+  const uint8_t* thisMessage = messagingLibrary->getMESSAGE();
+  uint8_t source = thisMessage[LOCATION_SOURCE_ID];
+  uint16_t requestID = messagingLibrary->getRequestID();
+  uint8_t count = messagingLibrary->getBatchCount();
+
+  Serial.print("\nReceived batch request. Node "); Serial.print(source);
+  Serial.print(". Apparatus: "); Serial.println(count);
+
+  // Gathered apart from the message, whose buffer the response reuses.
+  uint8_t served[MAX_BATCH_COUNT];
+  uint32_t values[MAX_BATCH_COUNT];
+  uint8_t numServed = 0;
+  for(uint8_t i = 0; i < count; i++)
   {
-    if ((volts >= table[r - 1][0]) &&
-      (volts <= table[r][0]))
-      break;
+    const Apparatus* thisApparatus = apparatus.Find(messagingLibrary->getBatchApparatus(i));
+    if(thisApparatus != NULL && thisApparatus->handler != NULL &&
+       thisApparatus->handler(0, values[numServed]))
+      served[numServed++] = thisApparatus->id;
   }
 
-  if (r == numRows) return (float)NULL;
-  else
+  if(numServed > 0)
+    messagingLibrary->SendBatchResponse(served, values, numServed, source, requestID);
+  #ifdef DEBUG
+    else Serial.println("*** no apparatus could be served");
+  #endif
+}
+
+// Print every value in a batch response, then retire its request.
+void ReceiveBatch()
+{
+  const uint8_t* thisMessage = messagingLibrary->getMESSAGE();
+  uint8_t source = thisMessage[LOCATION_SOURCE_ID];
+  uint8_t count = messagingLibrary->getBatchCount();
+
+  Serial.print("\nReceived batch response. Node: "); Serial.println(source);
+  for(uint8_t i = 0; i < count; i++)
   {
-    float slope =
-      (table[r][1] - table[r - 1][1]) / (table[r][0] - table[r - 1][0]);
+    const Apparatus* thisApparatus = apparatus.Find(messagingLibrary->getBatchApparatus(i));
+    if(thisApparatus == NULL) continue;
+    Serial.print(thisApparatus->name); Serial.print(": ");
+    PrintValue(thisApparatus->encoding, messagingLibrary->getBatchValue(i));
+  }
+
+  if(outstandingRequests.Remove(source, BATCH_APPARATUS, messagingLibrary->getRequestID()))
+    Serial.println("*** Removed satisfied outstanding request");
+  else Serial.println("*** Could not find associated request");
+}
 
-    float VWC = slope * (volts - table[r - 1][0]) + table[r - 1][1];
+// Battery voltage, in hundredths of a volt.
+// The battery is read through a divide-by-two. See BATTERY_POINTS.
+bool ReadBattery(uint32_t request, uint32_t& response)
+{
+  if(request != 0) return false; // only dealing with requests for readings for now
+  int32_t voltage;
+  sensors.Sample(sampleReuse);
+  batteryVolts.Convert(sensors.Reading(batteryChannel), voltage, ACQUISITION_FRACTION_BITS);
+  response = (uint32_t)voltage;
+  return true;
+}
 
-    return VWC;
+// Soil volumetric water content (VWC), in hundredths of a percent.
+// Not served when the voltage is outside the calibration.
+bool ReadSoil(uint32_t request, uint32_t& response)
+{
+  if(request != 0) return false; // only dealing with requests for readings for now
+  int32_t VWC;
+  sensors.Sample(sampleReuse);
+  if(soilVWC.Convert(sensors.Reading(soilChannel), VWC, ACQUISITION_FRACTION_BITS) != CalibrationStatus::InRange)
+    return false;
+  response = (uint32_t)VWC;
+  return true;
+}
+
+// Any request toggles the LED. Responds with the new status.
+bool ToggleLED(uint32_t request, uint32_t& response)
+{
+  (void)request;
+  if(digitalRead(ledPin) == HIGH)
+  {
+    digitalWrite(ledPin, LOW);
+    response = 0;
   }
+  else
+  {
+    digitalWrite(ledPin, HIGH);
+    response = 1;
+  }
+  return true;
+}
+
+// Prints a response value as its apparatus encodes it.
+void PrintValue(PayloadEncoding encoding, uint32_t value)
+{
+  switch(encoding)
+  {
+    case PayloadEncoding::Float:
+    {
+      float number = 0.0f;
+      memcpy(&number, &value, sizeof(number));
+      Serial.println(number);
+      break;
+    }
+    case PayloadEncoding::Hundredths:
+    {
+      char text[16];
+      FormatHundredths(text, sizeof(text), (int32_t)value, 0, 2);
+      Serial.println(text);
+      break;
+    }
+    case PayloadEncoding::OnOff:
+      if(value == 1) Serial.println("ON");
+      else if(value == 0) Serial.println("OFF");
+      else Serial.println("Unknown");
+      break;
+    default:
+      Serial.println(value);
+  }
+}
+
+// Called for each outstanding request that has gone unanswered for waitTime.
+// The request has already been removed from the table.
+void RequestExpired(const RequestTable::Request& request)
+{
+  Serial.println("\n*** Old unanswered request. Deleting.");
+  const Apparatus* thisApparatus = apparatus.Find(request.apparatus);
+  Serial.println("Node " + String(request.destination) +
+                 ". Apparatus: " + String(thisApparatus != NULL ? thisApparatus->name : "all") +
+                 ". Request ID: " + String(request.requestID));
 }
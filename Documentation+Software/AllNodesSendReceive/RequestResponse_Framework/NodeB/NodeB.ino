@@ -10,9 +10,8 @@
   Checks for requests.
   Sends response to requests.
 
-  This program's concept works best if only one
-  request is made at a time of a given apparatus
-  at a given destination.
+  Only one request is made at a time of a given
+  apparatus at a given destination.
 
   Nothing actually happens to satisfy requests
   in this basic example. However, a response
@@ -34,9 +33,8 @@
 #include "LoRaMessageHandler.h"
 LoRaMessageHandler *MessagingLibrary = NULL;
 
-// Library for implementing Lists on Arduino
-// https://nkaaf.github.io/Arduino-List/html/index.html
-#include <SingleLinkedList.hpp>
+// Table of outstanding requests, part of the message-handling library.
+#include "RequestTable.h"
 
 // Sensor/Actuator (Apparatus) List.
 // apparatusID is the position in the list.
@@ -53,20 +51,20 @@ String apparatusList[] =
   "Actuator <name>"
 };
 
-// List of outstanding requests
+// Request being composed
 struct CurrentRequest
 {
   uint8_t apparatusID;
   uint32_t associatedValue;
   uint8_t destination;
-  long timeSent;
 };
-SingleLinkedList<CurrentRequest> outstandingRequests;
+
+// Outstanding requests, keyed by destination, apparatus and request ID.
+RequestTable outstandingRequests;
 
 byte msgCount = 0;              // count of outgoing messages
-long lastSendTime = 0;          // last send time
 const long maxInterval = 5000;  // maximum millisecond interval between sends
-long interval = 0;              // current interval between sends
+#define receivePollInterval 5   // milliseconds between checks for incoming packets
 
 void setup()
 {
@@ -74,7 +72,7 @@ void setup()
   
   // Initialize serial port
   Serial.begin(9600);
-  while (!Serial) wait(100); // wait for serial port to be ready
+  while (!Serial) Tasks.Wait(100); // wait for serial port to be ready
   #ifdef DEBUG
     Serial.println("Node is active");
   #endif
@@ -89,8 +87,13 @@ void setup()
 
   // Initialize program-specific variables.
   randomSeed(localAddress);
-  interval = random(maxInterval);
-  lastSendTime = millis();
+
+  // The node's work is done by tasks, run from loop().
+  // Requests go out at random intervals. Incoming packets
+  // and unanswered requests are checked periodically.
+  Tasks.After(random(maxInterval), SendRequests);
+  Tasks.Every(receivePollInterval, CheckForMessages);
+  Tasks.Every(REQUEST_TABLE_TICK_MS, ExpireRequests);
 
   // Ready
   #ifdef DEBUG
@@ -101,64 +104,80 @@ void setup()
 }
 
 void loop()
+{
+  // Run whichever tasks are due. Idle until the next one otherwise.
+  Tasks.Run();
+}
+
+// ============= Function Definitions =================
+
+// Task. Sends the next request, then picks when to send another.
+void SendRequests()
 {
   // There are two types of apparatus,
   // sensor and actuator. This variable
   // allows for selecting one or the other
   // for generating a request.
   static uint16_t apparatusSelector = 0;
-  
-  // Check if it is time to send another request
-  if (millis() - lastSendTime > interval)
-  {
-    // Compose message
-    CurrentRequest thisRequest;
-    thisRequest.destination = destinationAddress;
-    apparatusSelector++;
-
-    // Select an apparatus to make a request about.
-    // (Flip/Flops between two.)
-    if(apparatusSelector % 2 == 0) // apparatusSelector is an even number
-    {
-      // Send request for sensor reading
-      // (sensor ID, dummy value, destination)
-      thisRequest.apparatusID = 0;
-      thisRequest.associatedValue = 5; // interpret for type of request
-    }
-    else // apparatusSelector is an odd number
-    {
-      // Send request for activation
-      // (actuator ID, length of activation, destination)
-      thisRequest.apparatusID = 1;
-      thisRequest.associatedValue = 10; // interpret for type of request
-    }
 
-    // Broadcast the request
+  // Compose message
+  CurrentRequest thisRequest;
+  thisRequest.destination = destinationAddress;
+  apparatusSelector++;
 
-    #ifdef DEBUG
-      Serial.println("\nSending Request. Node " + String(thisRequest.destination) +
-                     ". Apparatus: " + apparatusList[thisRequest.apparatusID] +
-                     ". Associated Value: " + String(thisRequest.associatedValue) + ".");
-    #endif
+  // Select an apparatus to make a request about.
+  // (Flip/Flops between two.)
+  if(apparatusSelector % 2 == 0) // apparatusSelector is an even number
+  {
+    // Send request for sensor reading
+    // (sensor ID, dummy value, destination)
+    thisRequest.apparatusID = 0;
+    thisRequest.associatedValue = 5; // interpret for type of request
+  }
+  else // apparatusSelector is an odd number
+  {
+    // Send request for activation
+    // (actuator ID, length of activation, destination)
+    thisRequest.apparatusID = 1;
+    thisRequest.associatedValue = 10; // interpret for type of request
+  }
 
-    MessagingLibrary->SendRequest(thisRequest.apparatusID, thisRequest.associatedValue, thisRequest.destination);
-    
-    #ifdef DEBUG
-      Serial.println("Sent Request");
-    #endif
+  // Broadcast the request
 
-    // Add to list of outstanding requests
-    thisRequest.timeSent = millis();
-    outstandingRequests.add(thisRequest);
+  #ifdef DEBUG
+    Serial.println("\nSending Request. Node " + String(thisRequest.destination) +
+                   ". Apparatus: " + apparatusList[thisRequest.apparatusID] +
+                   ". Associated Value: " + String(thisRequest.associatedValue) + ".");
+  #endif
+
+  // Send and add to table of outstanding requests.
+  // Skip if destination/apparatus is already engaged.
+  if( ! outstandingRequests.Engaged(thisRequest.destination, thisRequest.apparatusID) &&
+      ! outstandingRequests.Full())
+  {
+    // Not sent if the transmit queue is full, while the channel is busy.
+    uint16_t requestID = 0;
+    if(MessagingLibrary->SendRequest(thisRequest.apparatusID, thisRequest.associatedValue, thisRequest.destination,
+                                     &requestID))
+      outstandingRequests.Add(thisRequest.destination, thisRequest.apparatusID, requestID,
+                              thisRequest.associatedValue, waitTime);
+  
     #ifdef DEBUG
-      Serial.println("Number Outstanding Requests: " + String(outstandingRequests.getSize()));
+      Serial.println("Sent Request " + String(requestID));
+      Serial.println("Number Outstanding Requests: " + String(outstandingRequests.Count()));
     #endif
-
-    // Select the next time to send a request
-    lastSendTime = millis();
-    interval = random(maxInterval);
   }
+  #ifdef DEBUG
+    else Serial.println("*** Apparatus already engaged");
+  #endif
 
+  // Select the next time to send a request
+  Tasks.After(random(maxInterval), SendRequests);
+}
+
+// Task. Responds to or accepts any incoming packet for this node.
+void CheckForMessages()
+{
   // Check for an incoming packet for this node
   if(MessagingLibrary->CheckForIncomingPacket() > 0)
   {
@@ -170,8 +189,7 @@ void loop()
     // Requests, Responses, Unknowns
     if(thisMessage[LOCATION_MESSAGE_TYPE] == 1) // received a request message
     {
-      uint32_t associatedValue = 0; // determine a request-appropriate value
-      memcpy(&associatedValue, thisMessage + MESSAGE_HEADER_LENGTH, sizeof(uint32_t));
+      uint32_t associatedValue = MessagingLibrary->getAssociatedValue(); // determine a request-appropriate value
       
       #ifdef DEBUG
         Serial.println("\nReceived Request From Node " + 
@@ -181,66 +199,41 @@ void loop()
       #endif
       // Just echoing associatedValue for now
       MessagingLibrary->SendResponse(thisMessage[LOCATION_APPARATUS_ID], associatedValue,
-                                     thisMessage[LOCATION_SOURCE_ID]);
+                                     thisMessage[LOCATION_SOURCE_ID], MessagingLibrary->getRequestID());
     }
     else if(thisMessage[LOCATION_MESSAGE_TYPE] == 2) // received a response message
     {
-      uint32_t associatedValue = 0; // determine a request-appropriate value
-      memcpy(&associatedValue, thisMessage + MESSAGE_HEADER_LENGTH, sizeof(uint32_t));
-      
       #ifdef DEBUG
         Serial.println("\nReceived Response From Node " + 
                        String(thisMessage[LOCATION_SOURCE_ID]));
         Serial.println("Regarding " + apparatusList[thisMessage[LOCATION_APPARATUS_ID]]);
-        Serial.println("Associated Value: " + String(associatedValue));
+        Serial.println("Associated Value: " + String(MessagingLibrary->getAssociatedValue()));
       #endif
       
-      // Remove requests from list of outstanding requests after a response has been received.
-      bool found = false;
-      for(int r = 0; r < outstandingRequests.getSize(); r++)
-      {
-        CurrentRequest thisRequest = outstandingRequests.get(r);
-        if( (thisRequest.apparatusID == thisMessage[LOCATION_APPARATUS_ID]) &&
-            (thisRequest.destination == thisMessage[LOCATION_SOURCE_ID]) )
-        {
-          found = true;
-          outstandingRequests.remove(r);
-          Serial.println("*** Removed satisfied outstanding request");
-          break;
-        }
-      }
-      if( ! found) Serial.println("*** Could not find associated request");
+      // Remove request from table of outstanding requests after a response has been received.
+      if(outstandingRequests.Remove(thisMessage[LOCATION_SOURCE_ID], thisMessage[LOCATION_APPARATUS_ID],
+                                    MessagingLibrary->getRequestID()))
+        Serial.println("*** Removed satisfied outstanding request");
+      else Serial.println("*** Could not find associated request");
     }
     else Serial.println("*** Not equipped to deal with this message type");
   }
-  
-  // Check for outstanding requests that are not satisfied.
-  while(outstandingRequests.getSize() > 0)
-  {
-    // Identify oldest outstanding request
-    CurrentRequest oldestRequest = outstandingRequests.get(0);
-
-    // React to outstanding requests if wait time is exceeded.
-    // oldestRequest contains sufficient information for
-    // making new request or sending a notification of a
-    // non-responsive node. Delete old outstanding requests.
-    if(millis() - oldestRequest.timeSent > waitTime)
-    {
-      Serial.println("\n*** Old unanswered request. Deleting.");
-      outstandingRequests.remove(0);
-    }
-    else break;
-  }
 }
 
-// ============= Function Definitions =================
+// Task. Checks for outstanding requests that are not satisfied.
+void ExpireRequests()
+{
+  outstandingRequests.Expire(RequestExpired);
+}
 
-// Wait for a specific number of milliseconds.
-// delay() is blocking so we do not use that.
-// This approach does not use hardware-specific timers.
-void wait(long milliseconds)
+// React to an outstanding request whose wait time is exceeded.
+// request contains sufficient information for
+// making new request or sending a notification of a
+// non-responsive node. It has already been deleted.
+void RequestExpired(const RequestTable::Request& request)
 {
-  long beginTime = millis();
-  byte doSomething = 0;
-  while ((millis() - beginTime) <= milliseconds) doSomething++;
+  Serial.println("\n*** Old unanswered request. Deleting.");
+  Serial.println("Node " + String(request.destination) +
+                 ". Apparatus ID: " + String(request.apparatus) +
+                 ". Request ID: " + String(request.requestID));
 }
@@ -0,0 +1,180 @@
+
+// Piecewise-linear calibration of ADC readings.
+//
+// A calibration is a table of (millivolts, value) points, in ascending
+// order of millivolts. Values are fixed point, in whatever unit the table
+// states, for example hundredths of a percent.
+// The table is turned into segments at compile time and kept in flash.
+// Converting an ADC code is a binary search over the segments and one
+// integer multiply, so no floating point is used. The SAMD21 has no FPU.
+//
+// Readings outside the table are reported as such, not silently zeroed.
+// The Basestation's PC decoder (calibration.py) reads the tables in
+// SensorCalibration.h and does the same integer arithmetic.
+
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdio.h>
+
+// ADC setup that codes are converted from.
+// Define before including this file to change them.
+#ifndef CALIBRATION_REFERENCE_MV
+#define CALIBRATION_REFERENCE_MV 3300 // AR_DEFAULT on the MKR WAN 1310
+#endif
+#ifndef CALIBRATION_ADC_BITS
+#define CALIBRATION_ADC_BITS 12       // analogReadResolution(12)
+#endif
+
+#define CALIBRATION_ADC_LEVELS (1UL << CALIBRATION_ADC_BITS)
+#define CALIBRATION_SLOPE_BITS 24     // fraction bits of a segment's slope
+
+struct CalibrationPoint
+{
+  uint16_t millivolts;
+  int32_t value;
+};
+
+enum class CalibrationStatus : uint8_t
+{
+  InRange,
+  BelowRange, // value is the table's first value
+  AboveRange  // value is the table's last value
+};
+
+// ADC code to millivolts, rounded to nearest.
+constexpr uint16_t CodeToMillivolts(uint16_t code)
+{
+  return (uint16_t)(((uint32_t)code * CALIBRATION_REFERENCE_MV + CALIBRATION_ADC_LEVELS / 2) / CALIBRATION_ADC_LEVELS);
+}
+
+// ====================== Table generation =============
+// Written for C++11 so that it builds with the Arduino toolchains.
+//
+// Segments are measured in units of 1/CALIBRATION_ADC_LEVELS millivolt.
+// An ADC code is code * CALIBRATION_REFERENCE_MV of those units, and a
+// point is millivolts * CALIBRATION_ADC_LEVELS, so both are exact integers.
+
+namespace CalibrationTables
+{
+  struct Segment
+  {
+    uint32_t start; // position of the segment's first point
+    int32_t value;  // value at start
+    int32_t slope;  // value per unit, CALIBRATION_SLOPE_BITS fraction bits
+  };
+
+  // Integer division rounded to nearest, halves away from zero.
+  constexpr int64_t Divide(int64_t numerator, int64_t denominator)
+  {
+    return (numerator < 0 ? numerator - denominator / 2 : numerator + denominator / 2) / denominator;
+  }
+
+  template <size_t N>
+  constexpr Segment MakeSegment(const CalibrationPoint (&points)[N], size_t i)
+  {
+    return Segment
+    {
+      (uint32_t)(points[i].millivolts * CALIBRATION_ADC_LEVELS),
+      points[i].value,
+      i + 1 == N || points[i + 1].millivolts <= points[i].millivolts ? 0 :
+        (int32_t)Divide((int64_t)(points[i + 1].value - points[i].value) << CALIBRATION_SLOPE_BITS,
+                        (int64_t)(points[i + 1].millivolts - points[i].millivolts) * CALIBRATION_ADC_LEVELS)
+    };
+  }
+
+  template <size_t... I> struct Indices {};
+  template <size_t N, size_t... I> struct MakeIndices : MakeIndices<N - 1, N - 1, I...> {};
+  template <size_t... I> struct MakeIndices<0, I...> { typedef Indices<I...> type; };
+}
+
+// ====================== Calibration table ============
+
+template <size_t N>
+class CalibrationTable
+{
+
+public:
+
+  template <size_t... I>
+  constexpr CalibrationTable(const CalibrationPoint (&points)[N], CalibrationTables::Indices<I...>) :
+    segment{ CalibrationTables::MakeSegment(points, I)... }
+  {
+    static_assert(N >= 2, "a calibration needs at least two points");
+  }
+
+  // Converts an ADC code. The value is clamped to the table's ends
+  // when the code is outside it.
+  // An oversampled code can be given with its fraction bits (up to 4).
+  CalibrationStatus Convert(uint16_t code, int32_t& value, uint8_t fractionBits = 0) const
+  {
+    uint32_t position = (uint32_t)code * CALIBRATION_REFERENCE_MV;
+    if (position < segment[0].start << fractionBits)
+    {
+      value = segment[0].value;
+      return CalibrationStatus::BelowRange;
+    }
+    if (position > segment[N - 1].start << fractionBits)
+    {
+      value = segment[N - 1].value;
+      return CalibrationStatus::AboveRange;
+    }
+
+    // Last segment starting at or before position.
+    size_t low = 0, high = N - 1;
+    while (low < high)
+    {
+      size_t middle = (low + high + 1) / 2;
+      if (segment[middle].start << fractionBits <= position) low = middle;
+      else high = middle - 1;
+    }
+
+    const CalibrationTables::Segment& s = segment[low];
+    uint8_t shift = CALIBRATION_SLOPE_BITS + fractionBits;
+    int64_t offset = (int64_t)(position - (s.start << fractionBits)) * s.slope;
+    value = s.value + (int32_t)((offset + ((int64_t)1 << (shift - 1))) >> shift);
+    return CalibrationStatus::InRange;
+  }
+
+  // True if the points are in ascending order of millivolts.
+  // For use in static_assert.
+  constexpr bool Valid(size_t position = 1) const
+  {
+    return position == N || (segment[position - 1].start < segment[position].start && Valid(position + 1));
+  }
+
+  constexpr size_t Count() const { return N; }
+
+private:
+
+  CalibrationTables::Segment segment[N];
+};
+
+template <size_t N>
+constexpr CalibrationTable<N> MakeCalibrationTable(const CalibrationPoint (&points)[N])
+{
+  return CalibrationTable<N>(points, typename CalibrationTables::MakeIndices<N>::type());
+}
+
+// ====================== Formatting ===================
+
+// Writes a value held in hundredths with the given number of decimals
+// (0 to 2), right-aligned in width characters, like sprintf("%*.*f").
+// Halves are rounded away from zero.
+inline int FormatHundredths(char* text, size_t size, int32_t value, uint8_t width, uint8_t decimals)
+{
+  static const uint8_t scale[3] = { 100, 10, 1 };
+  if (decimals > 2) decimals = 2;
+  uint32_t magnitude = value < 0 ? (uint32_t)(-(int64_t)value) : (uint32_t)value;
+  uint32_t rounded = (magnitude + scale[decimals] / 2) / scale[decimals];
+  uint32_t unit = 100 / scale[decimals];
+
+  char number[16];
+  if (decimals == 0)
+    snprintf(number, sizeof(number), "%s%lu", value < 0 && rounded ? "-" : "", (unsigned long)rounded);
+  else
+    snprintf(number, sizeof(number), "%s%lu.%0*lu", value < 0 && rounded ? "-" : "",
+             (unsigned long)(rounded / unit), (int)decimals, (unsigned long)(rounded % unit));
+  return snprintf(text, size, "%*s", (int)width, number);
+}
@@ -0,0 +1,41 @@
+
+// Calibrations of the project's sensors.
+// Points are (millivolts at the ADC pin, value), one per line.
+// The Basestation's PC decoder reads this file, so keep that layout.
+
+#pragma once
+
+#include "Calibration.h"
+
+// Soil volumetric water content (VWC), in hundredths of a percent.
+// Calibrated for a specific soil type.
+constexpr CalibrationPoint SOIL_VWC_POINTS[] =
+{
+  {   0,    0},
+  { 100,   10},
+  { 600,  500},
+  {1100, 1000},
+  {1300, 1500},
+  {1400, 2000},
+  {1500, 2500},
+  {1600, 3000},
+  {1700, 3500},
+  {1800, 4000},
+  {2000, 4500},
+  {2300, 5000},
+  {3000, 6000}
+};
+
+// Battery voltage, in hundredths of a volt.
+// The battery is read through a divide-by-two.
+constexpr CalibrationPoint BATTERY_POINTS[] =
+{
+  {   0,   0},
+  {3300, 660}
+};
+
+constexpr auto soilVWC = MakeCalibrationTable(SOIL_VWC_POINTS);
+constexpr auto batteryVolts = MakeCalibrationTable(BATTERY_POINTS);
+
+static_assert(soilVWC.Valid(), "SOIL_VWC_POINTS must ascend in millivolts");
+static_assert(batteryVolts.Valid(), "BATTERY_POINTS must ascend in millivolts");
@@ -37,6 +37,9 @@ void setup()
     exit(1);
   }
 
+  // Expand the decryption key once.
+  aes.SetKey(key);
+
   // Ready
   Serial.println("====================================================");
   Serial.println("Arduino MKR 1310 basic LoRa receiver decryption test");
@@ -54,18 +57,26 @@ void loop()
 
     // Get length of message
     unsigned char messageLength = LoRa.read();
-    unsigned int numMessageBits = (unsigned int)messageLength * sizeof(unsigned char);
     unsigned char encryption[50]; // do not exceed this length;
+    if (messageLength > sizeof(encryption))
+    {
+      Serial.println("Message of " + String(messageLength) + " bytes is too long. Ignored.");
+      return;
+    }
 
     // Read message
     for(int c = 0; c < messageLength; c++)
       encryption[c] = LoRa.read();
 
-    // Decrypt and display message
-    unsigned char* decryption = aes.DecryptECB(encryption, numMessageBits, key); // decrypted message
+    // Decrypt in place and display message.
+    // Encrypted messages are whole 16-byte blocks.
+    if (!aes.DecryptECB(encryption, encryption, messageLength))
+    {
+      Serial.println("Length " + String(messageLength) + " is not a multiple of 16. Not decrypted.");
+      return;
+    }
     Serial.print(F("Decrypted. "));
-    for(int c = 0; c < messageLength; c++) Serial.print((char)decryption[c]); Serial.println();
-    delete [] decryption; // have to delete this after no longer needed to prevent memory leak
+    for(int c = 0; c < messageLength; c++) Serial.print((char)encryption[c]); Serial.println();
 
     // print RSSI of packet
     Serial.print("'  RSSI: ");
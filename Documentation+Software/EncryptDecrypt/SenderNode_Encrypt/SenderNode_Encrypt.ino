@@ -85,6 +85,9 @@ void setup()
   // Configure analog input pin.
   pinMode(inputPin, INPUT);
 
+  // Expand the encryption key once.
+  aes.SetKey(key);
+
   // Ready
   Serial.println("==================================================");
   Serial.println("Arduino MKR 1310 basic LoRa sender encryption test");
@@ -119,16 +122,15 @@ void loop()
   Serial.print(message);
   Serial.println("(Length " + String(actualLength) + ")");
 
-  // Encrypt the message
+  // Encrypt the message in place
   unsigned int numMessageBits = actualLength * sizeof(unsigned char);
-  unsigned char* encryption = aes.EncryptECB((unsigned char*)message, numMessageBits, key);
+  aes.EncryptECB((unsigned char*)message, (unsigned char*)message, numMessageBits);
 
   // Send packet
   LoRa.beginPacket();
   LoRa.write((unsigned char)actualLength);
-  LoRa.write(encryption, actualLength);
+  LoRa.write((unsigned char*)message, actualLength);
   LoRa.endPacket();
-  delete [] encryption; // have to delete this after no longer needed to prevent memory leak
 
   // Wait a bit before repeating
   time_t beginTime = millis();
@@ -60,14 +60,16 @@ void loop()
 {
   // Check for incoming messages.
   // Rebroadcast messages as appropriate.
-  if(LoRaMessagingLibrary->CheckForIncomingPacket() > 0)
+  // Only the header is read. The rest is relayed from the radio.
+  if(LoRaMessagingLibrary->CheckForRelayPacket() > 0)
   {
     // Get a pointer to the received message
     const uint8_t* thisMessage = LoRaMessagingLibrary->getMESSAGE();
+    uint16_t source = LoRaMessagingLibrary->getSourceAddress(); // may not fit in a byte
 
     // Ignore messages with a source address outside the
     // message tracking table.
-    if(thisMessage[LOCATION_SOURCE_ID] > MAX_NUM_NODES)
+    if(source > MAX_NUM_NODES)
     {
       #ifdef DEBUG
         Serial.println("Source ID exceeds node address limit");
@@ -76,7 +78,7 @@ void loop()
     }
 
     // Ignore messages whose rebroadcast counter has expired.
-    if(thisMessage[LOCATION_REBROADCASTS] == 0)
+    if((thisMessage[LOCATION_REBROADCASTS] & REBROADCAST_MASK) == 0)
     {
       #ifdef DEBUG
         Serial.println("Rebroadcast counter is zero");
@@ -90,18 +92,19 @@ void loop()
 
     // Reset message tracking table as appropriate
     if(thisMessageID == 0) 
-      MessageTrackingTable[thisMessage[LOCATION_SOURCE_ID]] = 0;
+      MessageTrackingTable[source] = 0;
       
     // Ignore older messages.
     // Accept messages with the current message ID.
-    if(thisMessageID < MessageTrackingTable[thisMessage[LOCATION_SOURCE_ID]])
+    if(thisMessageID < MessageTrackingTable[source])
     {
       #ifdef DEBUG
         Serial.println("Old message");
       #endif
+      LoRaMessagingLibrary->CountDrop(TELEMETRY_DROP_DUPLICATE);
       return;
     }
-    else MessageTrackingTable[thisMessage[LOCATION_SOURCE_ID]] = thisMessageID;
+    else MessageTrackingTable[source] = thisMessageID;
     
     // Rebroadcast messages that pass muster.
     #ifdef DEBUG
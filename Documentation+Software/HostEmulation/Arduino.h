@@ -0,0 +1,207 @@
+// Minimal stand-in for the Arduino core.
+// Lets the project's libraries and sketches be compiled and run on a PC.
+// Only what the project actually uses is provided.
+// See ReadMe.txt in this directory for how to build.
+
+#pragma once
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <string>
+#include <algorithm>
+
+typedef bool boolean;
+typedef uint8_t byte;
+
+#define HIGH 0x1
+#define LOW  0x0
+
+#define INPUT  0x0
+#define OUTPUT 0x1
+
+#define RISING 3
+
+#define DEC 10
+#define HEX 16
+
+#define LED_BUILTIN 6
+#define A0 15
+#define A1 16
+#define A2 17
+#define A3 18
+#define A4 19
+#define A5 20
+#define A6 21
+#define NUM_HOST_PINS 32
+
+#define AR_DEFAULT 0
+
+// Processor clock assumed when converting host time to board cycles.
+// The MKR WAN 1310 runs its SAMD21 at 48 MHz.
+#ifndef F_CPU
+#define F_CPU 48000000UL
+#endif
+
+#define F(text) (text)
+#define bitWrite(value, bit, bitvalue) \
+  ((bitvalue) ? ((value) |= (1UL << (bit))) : ((value) &= ~(1UL << (bit))))
+
+using std::min;
+using std::max;
+
+// ====================== Time =========================
+
+// Host clock. Runs in real time unless made virtual.
+// A virtual clock only moves when advanced, or by delay().
+namespace HostClock
+{
+  void setVirtual(bool isVirtual);
+  bool isVirtual();
+  void advanceMicros(unsigned long microseconds);
+}
+
+unsigned long millis();
+unsigned long micros();
+void delay(unsigned long milliseconds);
+void delayMicroseconds(unsigned int microseconds);
+void yield();
+
+// ====================== Pins =========================
+
+void pinMode(uint8_t pin, uint8_t mode);
+void digitalWrite(uint8_t pin, uint8_t value);
+int digitalRead(uint8_t pin);
+
+// Analog input comes from a mock ADC.
+// Host programs install a function that supplies ADC codes per pin.
+namespace HostADC
+{
+  void setSource(uint16_t (*source)(uint8_t pin));
+}
+void analogReference(uint8_t mode);
+void analogReadResolution(int bits);
+int analogRead(uint8_t pin);
+
+// Interrupts are dispatched by host code, for example a radio emulator.
+#define digitalPinToInterrupt(pin) (pin)
+void attachInterrupt(uint8_t interrupt, void (*isr)(void), int mode);
+void detachInterrupt(uint8_t interrupt);
+void HostRaiseInterrupt(uint8_t interrupt);
+
+// ====================== Random =======================
+
+void randomSeed(unsigned long seed);
+long random(long howBig);
+long random(long howSmall, long howBig);
+
+// ====================== String =======================
+
+class String
+{
+public:
+  String(const char* text = "") : s(text ? text : "") {}
+  String(const std::string& text) : s(text) {}
+  String(char c) : s(1, c) {}
+  String(int value, unsigned char base = DEC) : s(FromLong(value, base)) {}
+  String(unsigned int value, unsigned char base = DEC) : s(FromUnsigned(value, base)) {}
+  String(long value, unsigned char base = DEC) : s(FromLong(value, base)) {}
+  String(unsigned long value, unsigned char base = DEC) : s(FromUnsigned(value, base)) {}
+  String(unsigned char value, unsigned char base = DEC) : s(FromUnsigned(value, base)) {}
+  String(float value, unsigned char decimals = 2) : s(FromDouble(value, decimals)) {}
+  String(double value, unsigned char decimals = 2) : s(FromDouble(value, decimals)) {}
+
+  unsigned int length() const { return (unsigned int)s.length(); }
+  const char* c_str() const { return s.c_str(); }
+  int indexOf(const String& other) const
+  {
+    size_t p = s.find(other.s);
+    return p == std::string::npos ? -1 : (int)p;
+  }
+  String& operator+=(const String& other) { s += other.s; return *this; }
+  String& operator+=(char c) { s += c; return *this; }
+  char operator[](unsigned int index) const { return s[index]; }
+  bool operator==(const String& other) const { return s == other.s; }
+  bool operator!=(const String& other) const { return s != other.s; }
+  friend String operator+(const String& a, const String& b) { return String(a.s + b.s); }
+
+private:
+  std::string s;
+  static std::string FromLong(long value, unsigned char base);
+  static std::string FromUnsigned(unsigned long value, unsigned char base);
+  static std::string FromDouble(double value, unsigned char decimals);
+};
+
+// ====================== Print/Stream =================
+
+class Print
+{
+public:
+  virtual ~Print() {}
+  virtual size_t write(uint8_t byte) = 0;
+  virtual size_t write(const uint8_t* buffer, size_t size)
+  {
+    size_t n = 0;
+    while (size--) n += write(*buffer++);
+    return n;
+  }
+  size_t write(const char* text) { return write((const uint8_t*)text, strlen(text)); }
+  virtual int availableForWrite() { return 0; }
+  virtual void flush() {}
+
+  size_t print(const char* text) { return write(text); }
+  size_t print(const String& text) { return write(text.c_str()); }
+  size_t print(char c) { return write((uint8_t)c); }
+  size_t print(int value, int base = DEC) { return print(String((long)value, base)); }
+  size_t print(unsigned int value, int base = DEC) { return print(String((unsigned long)value, base)); }
+  size_t print(long value, int base = DEC) { return print(String(value, base)); }
+  size_t print(unsigned long value, int base = DEC) { return print(String(value, base)); }
+  size_t print(unsigned char value, int base = DEC) { return print(String((unsigned long)value, base)); }
+  size_t print(double value, int decimals = 2) { return print(String(value, decimals)); }
+
+  size_t println() { return write("\r\n"); }
+  template <typename T> size_t println(T value) { size_t n = print(value); return n + println(); }
+  template <typename T> size_t println(T value, int format) { size_t n = print(value, format); return n + println(); }
+};
+
+class Stream : public Print
+{
+public:
+  virtual int available() = 0;
+  virtual int read() = 0;
+  virtual int peek() = 0;
+  void setTimeout(unsigned long timeout) { _timeout = timeout; }
+
+protected:
+  unsigned long _timeout = 1000;
+};
+
+// Serial writes to standard output.
+// Input can be queued by host code with HostSerial::inject().
+class HostSerial : public Stream
+{
+public:
+  void begin(unsigned long baud) { (void)baud; }
+  void end() {}
+  operator bool() const { return true; }
+
+  size_t write(uint8_t byte) override { return fwrite(&byte, 1, 1, stdout); }
+  size_t write(const uint8_t* buffer, size_t size) override { return fwrite(buffer, 1, size, stdout); }
+  using Print::write;
+  int availableForWrite() override { return 64; }
+  void flush() override { fflush(stdout); }
+
+  int available() override { return (int)(input.length() - inputIndex); }
+  int read() override { return available() ? (uint8_t)input[inputIndex++] : -1; }
+  int peek() override { return available() ? (uint8_t)input[inputIndex] : -1; }
+  void inject(const uint8_t* buffer, size_t size) { input.append((const char*)buffer, size); }
+
+private:
+  std::string input;
+  size_t inputIndex = 0;
+};
+
+extern HostSerial Serial;
+extern HostSerial Serial1;
@@ -0,0 +1,418 @@
+// Micro-benchmarks for the project's compute kernels.
+// Runs on a PC. The radio is the SX127x emulator. See ../ReadMe.txt.
+// Output is comma-separated, one row per kernel and parameter,
+// so that results can be kept and compared between commits:
+//   ./Benchmarks > Benchmarks.csv
+// Columns:
+//   kernel, parameter, bytes per call, nanoseconds per call,
+//   nanoseconds per byte, cycles per call (frame), heap allocations per call.
+
+// Error detection
+#include "crc-16-dnp.h"
+
+// Encryption
+#include "AES.h"
+#include "CCM.h"
+
+// Message building. Radio traffic goes to the emulator.
+#include <LoRaMessageHandler.h>
+LoRaMessageHandler *MessagingLibrary = NULL;
+
+// The Mega's camera pipeline, fed a synthetic frame.
+#include "../../NetworkApplication/Camera/Mega/CameraPipeline.h"
+
+// Cycle counter. x86 hosts read the time-stamp counter.
+// Elsewhere cycles are derived from elapsed time and F_CPU.
+#if defined(__x86_64__) || defined(__i386__)
+  #include <x86intrin.h>
+  #define HAVE_CYCLE_COUNTER
+#endif
+
+// Each kernel runs until at least this much time has elapsed.
+#define MIN_RUN_MICROS 200000UL
+
+// Frame sizes exercised.
+// 13 bytes is a request/response frame, 222 the maximum message length.
+const unsigned int frameSizes[] = { 13, 64, 128, 222 };
+const unsigned int numFrameSizes = sizeof(frameSizes) / sizeof(frameSizes[0]);
+
+// ====================== Allocation counting ==========
+
+unsigned long allocationCount = 0;
+
+void* operator new(size_t size)
+{
+  allocationCount++;
+  void* p = malloc(size ? size : 1);
+  if (!p) abort();
+  return p;
+}
+void* operator new[](size_t size) { return operator new(size); }
+// Kept out of line, so that the compiler pairs delete with this
+// operator new rather than with the malloc() inside it.
+__attribute__((noinline)) void operator delete(void* p) noexcept { free(p); }
+void operator delete[](void* p) noexcept { operator delete(p); }
+void operator delete(void* p, size_t) noexcept { operator delete(p); }
+void operator delete[](void* p, size_t) noexcept { operator delete(p); }
+
+// ====================== Kernel inputs ================
+
+uint8_t data[256];
+unsigned int dataLength = 0;
+volatile uint16_t crcSink = 0;
+
+AES* aes = NULL;
+unsigned char key[32];
+unsigned char iv[16];
+
+String text;
+uint8_t cameraSegment[MAX_MESSAGE_LENGTH + 1];
+
+// ====================== Kernels ======================
+
+void CRC_Kernel() { crcSink = crcr16dnp(data, dataLength, 0); }
+template <unsigned SLICES> void CRCSlice_Kernel()
+{
+  crcSink = CRC16Reflected<CRC16_DNP_POLY, SLICES>::Update(0xFFFF, data, dataLength) ^ 0xFFFF;
+}
+void CRCIncremental_Kernel()
+{
+  // As the handler does it: header, skip the rebroadcast byte, then the rest.
+  CRC16DNP crc;
+  crc.Update(data, LOCATION_REBROADCASTS);
+  crc.Update(data + LOCATION_REBROADCASTS + 1, dataLength - (LOCATION_REBROADCASTS + 1));
+  crcSink = crc.Value();
+}
+
+void EncryptECB_Kernel() { delete[] aes->EncryptECB(data, dataLength, key); }
+void DecryptECB_Kernel() { delete[] aes->DecryptECB(data, dataLength, key); }
+void EncryptCBC_Kernel() { delete[] aes->EncryptCBC(data, dataLength, key, iv); }
+void DecryptCBC_Kernel() { delete[] aes->DecryptCBC(data, dataLength, key, iv); }
+void EncryptCFB_Kernel() { delete[] aes->EncryptCFB(data, dataLength, key, iv); }
+void DecryptCFB_Kernel() { delete[] aes->DecryptCFB(data, dataLength, key, iv); }
+
+// Expanded key reused, output written in place.
+uint8_t block[256];
+void SetKey_Kernel() { aes->SetKey(key); }
+void EncryptECBInPlace_Kernel() { aes->EncryptECB(block, block, dataLength); }
+void DecryptECBInPlace_Kernel() { aes->DecryptECB(block, block, dataLength); }
+void EncryptCBCInPlace_Kernel() { aes->EncryptCBC(block, block, dataLength, iv); }
+void DecryptCBCInPlace_Kernel() { aes->DecryptCBC(block, block, dataLength, iv); }
+void EncryptCFBInPlace_Kernel() { aes->EncryptCFB(block, block, dataLength, iv); }
+void DecryptCFBInPlace_Kernel() { aes->DecryptCFB(block, block, dataLength, iv); }
+
+// Many independent frames per call, as a basestation sees them.
+#define BATCH_FRAMES 64
+uint8_t batchIn[BATCH_FRAMES][256];
+uint8_t batchOut[BATCH_FRAMES][256];
+AESFrame batch[BATCH_FRAMES];
+void EncryptCBCBatch_Kernel() { aes->EncryptCBC(batch, BATCH_FRAMES); }
+void DecryptCBCBatch_Kernel() { aes->DecryptCBC(batch, BATCH_FRAMES); }
+void EncryptCFBBatch_Kernel() { aes->EncryptCFB(batch, BATCH_FRAMES); }
+void DecryptCFBBatch_Kernel() { aes->DecryptCFB(batch, BATCH_FRAMES); }
+
+const AESBackend backends[] = { AESBackend::Reference, AESBackend::TTable, AESBackend::AESNI };
+const char* backendNames[] = { "Reference", "TTable", "AESNI" };
+const char* modeNames[] = { "EncryptECB", "DecryptECB", "EncryptCBC", "DecryptCBC", "EncryptCFB", "DecryptCFB" };
+
+void RunMode(AES& cipher, int mode, AESFrame* frames, unsigned int count)
+{
+  switch (mode)
+  {
+    case 0: cipher.EncryptECB(frames, count); break;
+    case 1: cipher.DecryptECB(frames, count); break;
+    case 2: cipher.EncryptCBC(frames, count); break;
+    case 3: cipher.DecryptCBC(frames, count); break;
+    case 4: cipher.EncryptCFB(frames, count); break;
+    case 5: cipher.DecryptCFB(frames, count); break;
+  }
+}
+
+// Every backend must give the reference results, batched and in place,
+// before any of them is timed.
+bool BackendsMatchReference(AESKeyLength keyLength)
+{
+  static uint8_t expected[BATCH_FRAMES][256];
+  AES reference(keyLength);
+  AES candidate(keyLength);
+  reference.SetBackend(AESBackend::Reference);
+  reference.SetKey(key);
+  candidate.SetKey(key);
+
+  for (int b = 0; b < 3; b++)
+  {
+    if (!candidate.SetBackend(backends[b])) continue;
+    for (int mode = 0; mode < 6; mode++)
+    {
+      for (int f = 0; f < BATCH_FRAMES; f++)
+      {
+        for (int i = 0; i < 256; i++) batchIn[f][i] = (uint8_t)random(256);
+        batch[f].in = batchIn[f];
+        batch[f].out = batchOut[f];
+        batch[f].len = 16 * (f % 16);
+        batch[f].iv = data + f;
+        AESFrame one = batch[f];
+        one.out = expected[f];
+        RunMode(reference, mode, &one, 1);
+      }
+      RunMode(candidate, mode, batch, BATCH_FRAMES);
+
+      bool match = true;
+      for (int f = 0; f < BATCH_FRAMES; f++)
+      {
+        match = match && memcmp(batchOut[f], expected[f], batch[f].len) == 0;
+        AESFrame self = batch[f];
+        self.in = self.out = batchOut[f];
+        memcpy(batchOut[f], batchIn[f], self.len);
+        RunMode(candidate, mode, &self, 1);
+        match = match && memcmp(batchOut[f], expected[f], batch[f].len) == 0;
+      }
+      if (!match)
+      {
+        Serial.print("# "); Serial.print(backendNames[b]);
+        Serial.print(" differs from Reference in "); Serial.println(modeNames[mode]);
+        return false;
+      }
+    }
+  }
+  return true;
+}
+
+// CCM must give RFC 3610 packet vector #1, and reject it once altered,
+// before the secured messages are timed.
+bool CCMMatchesRFC3610()
+{
+  const uint8_t nonce[CCM::nonceLen] = { 0x00, 0x00, 0x00, 0x03, 0x02, 0x01, 0x00,
+                                         0xA0, 0xA1, 0xA2, 0xA3, 0xA4, 0xA5 };
+  const uint8_t expected[31 + 8] =
+  {
+    0x00, 0x01, 0x02, 0x03, 0x04, 0x05, 0x06, 0x07, 0x58, 0x8C, 0x97, 0x9A, 0x61,
+    0xC6, 0x63, 0xD2, 0xF0, 0x66, 0xD0, 0xC2, 0xC0, 0xF9, 0x89, 0x80, 0x6D, 0x5F,
+    0x6B, 0x61, 0xDA, 0xC3, 0x84, 0x17, 0xE8, 0xD1, 0x2C, 0xFD, 0xF9, 0x26, 0xE0
+  };
+  uint8_t vectorKey[16];
+  uint8_t packet[31 + 8]; // 8 bytes authenticated, 23 encrypted, then the tag
+  for (int i = 0; i < 16; i++) vectorKey[i] = 0xC0 + i;
+  for (int i = 0; i < 31; i++) packet[i] = i;
+
+  AES cipher(AESKeyLength::AES_128);
+  cipher.SetKey(vectorKey);
+  CCM ccm(cipher);
+  bool match = ccm.Encrypt(nonce, packet, 8, packet + 8, 23, packet + 31, 8) &&
+               memcmp(packet, expected, sizeof(expected)) == 0;
+  match = match && ccm.Decrypt(nonce, packet, 8, packet + 8, 23, packet + 31, 8);
+  for (int i = 0; i < 31; i++) match = match && packet[i] == i;
+
+  ccm.Encrypt(nonce, packet, 8, packet + 8, 23, packet + 31, 8);
+  packet[0] ^= 1;
+  match = match && !ccm.Decrypt(nonce, packet, 8, packet + 8, 23, packet + 31, 8);
+  if (!match) Serial.println("# CCM differs from RFC 3610 packet vector #1");
+  return match;
+}
+
+void SendTextMessage_Kernel() { MessagingLibrary->SendTextMessage(text, 3); }
+void SendRequest_Kernel() { MessagingLibrary->SendRequest(1, 0, 2); }
+void SendResponse_Kernel() { MessagingLibrary->SendResponse(1, 0x40533333, 2, 0x0102); }
+void SendCameraData_Kernel() { MessagingLibrary->SendCameraData(cameraSegment, 3); }
+
+// A full-node poll: three apparatus in one batch request and response.
+const uint8_t batchApparatus[] = { 0, 1, 2 };
+const uint32_t batchValues[] = { 0x40533333, 0x414b6600, 1 };
+void SendBatchRequest_Kernel() { MessagingLibrary->SendBatchRequest(batchApparatus, 3, 2); }
+void SendBatchResponse_Kernel() { MessagingLibrary->SendBatchResponse(batchApparatus, batchValues, 3, 2, 0x0102); }
+
+// Camera pipeline, on a synthetic frame the size of the Pixy2's.
+// Output is counted and discarded. The output buffer is as large as the Mega's.
+class SyntheticCamera : public CameraSource
+{
+public:
+  unsigned int Width() override { return 316; }
+  unsigned int Height() override { return 208; }
+  void GetRGB(unsigned int column, unsigned int row,
+              unsigned char* red, unsigned char* green, unsigned char* blue) override
+  {
+    *red = (uint8_t)(column + row);
+    *green = (uint8_t)(column ^ row);
+    *blue = (uint8_t)(column * 3 + row);
+  }
+};
+
+class DiscardPort : public Stream
+{
+public:
+  unsigned long written = 0;
+  size_t write(uint8_t) override { written++; return 1; }
+  int availableForWrite() override { return 63; }
+  int available() override { return 0; }
+  int read() override { return -1; }
+  int peek() override { return -1; }
+};
+
+SyntheticCamera syntheticCamera;
+DiscardPort cameraPort;
+CameraPipeline cameraPipeline(syntheticCamera, cameraPort, cameraSegment);
+
+// One segment, without sending it. Wraps around at the end of the frame.
+void PackCameraSegment_Kernel()
+{
+  if (cameraPipeline.Row() >= syntheticCamera.Height() - NUMBER_TO_SKIP) cameraPipeline.Start();
+  cameraPipeline.Pack();
+}
+
+// A whole frame, one credit at a time, as the MKR requests it.
+void CameraFrame_Kernel()
+{
+  cameraPipeline.Start();
+  while (cameraPipeline.Step())
+    if (cameraPipeline.Waiting()) cameraPipeline.Credit();
+}
+
+// ====================== Harness ======================
+
+uint64_t Cycles()
+{
+#ifdef HAVE_CYCLE_COUNTER
+  return __rdtsc();
+#else
+  return (uint64_t)micros() * (F_CPU / 1000000UL);
+#endif
+}
+
+// Runs a kernel repeatedly and prints one result row.
+void Run(const char* kernel, const char* parameter, unsigned int bytesPerCall, void (*function)())
+{
+  function(); // warm up
+
+  unsigned long iterations = 0;
+  unsigned long allocations = allocationCount;
+  uint64_t cycles = Cycles();
+  unsigned long start = micros();
+  unsigned long elapsed = 0;
+  do
+  {
+    for (int i = 0; i < 100; i++) function();
+    iterations += 100;
+    elapsed = micros() - start;
+  } while (elapsed < MIN_RUN_MICROS);
+  cycles = Cycles() - cycles;
+  allocations = allocationCount - allocations;
+
+  double nsPerCall = (double)elapsed * 1000.0 / iterations;
+  Serial.print(kernel); Serial.print(',');
+  Serial.print(parameter); Serial.print(',');
+  Serial.print(bytesPerCall); Serial.print(',');
+  Serial.print(nsPerCall, 1); Serial.print(',');
+  Serial.print(bytesPerCall ? nsPerCall / bytesPerCall : 0.0, 2); Serial.print(',');
+  Serial.print((double)cycles / iterations, 0); Serial.print(',');
+  Serial.println((double)allocations / iterations, 2);
+}
+
+void setup()
+{
+  Serial.begin(9600);
+
+  MessagingLibrary = new LoRaMessageHandler(1);
+
+  randomSeed(1);
+  for (int i = 0; i < 256; i++) data[i] = (uint8_t)random(256);
+  for (int i = 0; i < 32; i++) key[i] = (uint8_t)i;
+  for (int i = 0; i < 16; i++) iv[i] = (uint8_t)(0xf0 + i);
+
+  Serial.println("kernel,parameter,bytes,ns_per_call,ns_per_byte,cycles_per_call,allocations_per_call");
+
+  // CRC-16/DNP over realistic frame sizes.
+  for (unsigned int f = 0; f < numFrameSizes; f++)
+  {
+    dataLength = frameSizes[f];
+    Run("crcr16dnp", String(dataLength).c_str(), dataLength, CRC_Kernel);
+    Run("crc16dnp_slice1", String(dataLength).c_str(), dataLength, CRCSlice_Kernel<1>);
+    Run("crc16dnp_slice4", String(dataLength).c_str(), dataLength, CRCSlice_Kernel<4>);
+    Run("crc16dnp_slice8", String(dataLength).c_str(), dataLength, CRCSlice_Kernel<8>);
+    Run("crc16dnp_e2e", String(dataLength).c_str(), dataLength, CRCIncremental_Kernel);
+  }
+
+  // AES modes for all three key lengths.
+  // Input is a full frame rounded up to whole 16-byte blocks.
+  const AESKeyLength keyLengths[] = { AESKeyLength::AES_128, AESKeyLength::AES_192, AESKeyLength::AES_256 };
+  const char* keyNames[] = { "AES-128", "AES-192", "AES-256" };
+  dataLength = ((MAX_MESSAGE_LENGTH + 15) / 16) * 16;
+  for (int k = 0; k < 3; k++)
+  {
+    if (!BackendsMatchReference(keyLengths[k])) exit(1);
+
+    // Original interface, reference code, comparable with older results.
+    AES thisAES(keyLengths[k]);
+    thisAES.SetBackend(AESBackend::Reference);
+    aes = &thisAES;
+    Run("EncryptECB", keyNames[k], dataLength, EncryptECB_Kernel);
+    Run("DecryptECB", keyNames[k], dataLength, DecryptECB_Kernel);
+    Run("EncryptCBC", keyNames[k], dataLength, EncryptCBC_Kernel);
+    Run("DecryptCBC", keyNames[k], dataLength, DecryptCBC_Kernel);
+    Run("EncryptCFB", keyNames[k], dataLength, EncryptCFB_Kernel);
+    Run("DecryptCFB", keyNames[k], dataLength, DecryptCFB_Kernel);
+    Run("SetKey", keyNames[k], 0, SetKey_Kernel);
+
+    // In place and batched, for each backend this CPU has.
+    for (int b = 0; b < 3; b++)
+    {
+      if (!thisAES.SetBackend(backends[b])) continue;
+      String parameter = String(keyNames[k]) + "/" + backendNames[b];
+      memcpy(block, data, dataLength);
+      Run("EncryptECBInPlace", parameter.c_str(), dataLength, EncryptECBInPlace_Kernel);
+      Run("DecryptECBInPlace", parameter.c_str(), dataLength, DecryptECBInPlace_Kernel);
+      Run("EncryptCBCInPlace", parameter.c_str(), dataLength, EncryptCBCInPlace_Kernel);
+      Run("DecryptCBCInPlace", parameter.c_str(), dataLength, DecryptCBCInPlace_Kernel);
+      Run("EncryptCFBInPlace", parameter.c_str(), dataLength, EncryptCFBInPlace_Kernel);
+      Run("DecryptCFBInPlace", parameter.c_str(), dataLength, DecryptCFBInPlace_Kernel);
+
+      for (int f = 0; f < BATCH_FRAMES; f++)
+      {
+        batch[f].in = batch[f].out = batchIn[f];
+        batch[f].len = dataLength;
+        batch[f].iv = iv;
+      }
+      parameter += "/" + String(BATCH_FRAMES);
+      Run("EncryptCBCBatch", parameter.c_str(), dataLength * BATCH_FRAMES, EncryptCBCBatch_Kernel);
+      Run("DecryptCBCBatch", parameter.c_str(), dataLength * BATCH_FRAMES, DecryptCBCBatch_Kernel);
+      Run("EncryptCFBBatch", parameter.c_str(), dataLength * BATCH_FRAMES, EncryptCFBBatch_Kernel);
+      Run("DecryptCFBBatch", parameter.c_str(), dataLength * BATCH_FRAMES, DecryptCFBBatch_Kernel);
+    }
+    aes = NULL;
+  }
+
+  // Message framing, including the driver's register traffic.
+  text = "DATA: BattV:  4.1: VWC: 23.5";
+  Run("SendTextMessage", "28", MESSAGE_HEADER_LENGTH + text.length(), SendTextMessage_Kernel);
+  Run("SendRequest", "6", REQUEST_MESSAGE_LENGTH, SendRequest_Kernel);
+  Run("SendResponse", "6", REQUEST_MESSAGE_LENGTH, SendResponse_Kernel);
+  Run("SendBatchRequest", "3", LOCATION_BATCH_ENTRIES + 3, SendBatchRequest_Kernel);
+  Run("SendBatchResponse", "3", LOCATION_BATCH_ENTRIES + 3 * BATCH_VALUE_LENGTH, SendBatchResponse_Kernel);
+  cameraPipeline.Start();
+  PackCameraSegment_Kernel();
+  Run("PackCameraSegment", String(SEGMENT_SIZE).c_str(), cameraSegment[0] + 1, PackCameraSegment_Kernel);
+  Run("SendCameraData", String(SEGMENT_SIZE).c_str(), MESSAGE_HEADER_LENGTH + cameraSegment[0], SendCameraData_Kernel);
+  cameraPort.written = 0;
+  CameraFrame_Kernel();
+  String frame = String(syntheticCamera.Width()) + "x" + String(syntheticCamera.Height());
+  Run("CameraFrame", frame.c_str(), cameraPort.written, CameraFrame_Kernel);
+
+  // Same, with the end-to-end CRC appended.
+  MessagingLibrary->EnableEndToEndCRC(true);
+  Run("SendTextMessage+CRC", "28", MESSAGE_HEADER_LENGTH + text.length() + MESSAGE_CRC_LENGTH, SendTextMessage_Kernel);
+  Run("SendRequest+CRC", "6", REQUEST_MESSAGE_LENGTH + MESSAGE_CRC_LENGTH, SendRequest_Kernel);
+  MessagingLibrary->EnableEndToEndCRC(false);
+
+  // Same, secured with AES-128-CCM and a 4-byte tag.
+  if (!CCMMatchesRFC3610()) exit(1);
+  MessagingLibrary->EnableSecurity(key);
+  Run("SendTextMessage+CCM", "28", MESSAGE_HEADER_LENGTH + text.length() + DEFAULT_TAG_LENGTH, SendTextMessage_Kernel);
+  Run("SendRequest+CCM", "6", REQUEST_MESSAGE_LENGTH + DEFAULT_TAG_LENGTH, SendRequest_Kernel);
+  MessagingLibrary->DisableSecurity();
+
+  Serial.flush();
+  exit(0);
+}
+
+void loop()
+{
+}
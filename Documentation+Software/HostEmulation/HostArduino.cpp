@@ -0,0 +1,149 @@
+// Host implementation of the Arduino stand-in.
+// Also supplies main(), which runs a sketch's setup() and loop().
+
+#include <Arduino.h>
+#include <SPI.h>
+#include <chrono>
+#include <thread>
+
+HostSerial Serial;
+HostSerial Serial1;
+SPIClass SPI;
+
+// ====================== Time =========================
+
+namespace
+{
+  bool clockIsVirtual = false;
+  unsigned long virtualMicros = 0;
+  const auto startTime = std::chrono::steady_clock::now();
+}
+
+void HostClock::setVirtual(bool isVirtual) { clockIsVirtual = isVirtual; }
+bool HostClock::isVirtual() { return clockIsVirtual; }
+void HostClock::advanceMicros(unsigned long microseconds) { virtualMicros += microseconds; }
+
+unsigned long micros()
+{
+  if (clockIsVirtual) return virtualMicros;
+  return (unsigned long)std::chrono::duration_cast<std::chrono::microseconds>
+    (std::chrono::steady_clock::now() - startTime).count();
+}
+
+unsigned long millis() { return micros() / 1000; }
+
+void delay(unsigned long milliseconds)
+{
+  if (clockIsVirtual) virtualMicros += milliseconds * 1000;
+  else std::this_thread::sleep_for(std::chrono::milliseconds(milliseconds));
+}
+
+void delayMicroseconds(unsigned int microseconds)
+{
+  if (clockIsVirtual) virtualMicros += microseconds;
+  else std::this_thread::sleep_for(std::chrono::microseconds(microseconds));
+}
+
+void yield() {}
+
+// ====================== Pins =========================
+
+namespace
+{
+  uint8_t pinLevels[NUM_HOST_PINS];
+  uint16_t (*adcSource)(uint8_t pin) = NULL;
+  int adcBits = 10;
+  void (*interruptHandlers[NUM_HOST_PINS])(void);
+}
+
+void pinMode(uint8_t pin, uint8_t mode) { (void)pin; (void)mode; }
+void digitalWrite(uint8_t pin, uint8_t value) { if (pin < NUM_HOST_PINS) pinLevels[pin] = value ? HIGH : LOW; }
+int digitalRead(uint8_t pin) { return pin < NUM_HOST_PINS ? pinLevels[pin] : LOW; }
+
+void HostADC::setSource(uint16_t (*source)(uint8_t pin)) { adcSource = source; }
+void analogReference(uint8_t mode) { (void)mode; }
+void analogReadResolution(int bits) { adcBits = bits; }
+
+// The mock ADC supplies 12-bit codes.
+// They are scaled to the configured resolution as the SAMD core does.
+int analogRead(uint8_t pin)
+{
+  if (!adcSource) return 0;
+  int code = adcSource(pin) & 0x0fff;
+  if (adcBits > 12) return code << (adcBits - 12);
+  return code >> (12 - adcBits);
+}
+
+void attachInterrupt(uint8_t interrupt, void (*isr)(void), int mode)
+{
+  (void)mode;
+  if (interrupt < NUM_HOST_PINS) interruptHandlers[interrupt] = isr;
+}
+
+void detachInterrupt(uint8_t interrupt)
+{
+  if (interrupt < NUM_HOST_PINS) interruptHandlers[interrupt] = NULL;
+}
+
+void HostRaiseInterrupt(uint8_t interrupt)
+{
+  if (interrupt < NUM_HOST_PINS && interruptHandlers[interrupt])
+    interruptHandlers[interrupt]();
+}
+
+// ====================== Random =======================
+
+void randomSeed(unsigned long seed) { srand((unsigned int)seed); }
+long random(long howBig) { return howBig > 0 ? rand() % howBig : 0; }
+long random(long howSmall, long howBig)
+{
+  if (howSmall >= howBig) return howSmall;
+  return random(howBig - howSmall) + howSmall;
+}
+
+// ====================== String =======================
+
+std::string String::FromLong(long value, unsigned char base)
+{
+  if (value < 0 && base == DEC) return "-" + FromUnsigned((unsigned long)(-value), base);
+  return FromUnsigned((unsigned long)value, base);
+}
+
+std::string String::FromUnsigned(unsigned long value, unsigned char base)
+{
+  char text[8 * sizeof(long) + 1];
+  char* p = text + sizeof(text) - 1;
+  *p = '\0';
+  if (base < 2) base = DEC;
+  do
+  {
+    unsigned long digit = value % base;
+    *--p = (char)(digit < 10 ? '0' + digit : 'A' + digit - 10);
+    value /= base;
+  } while (value);
+  return p;
+}
+
+std::string String::FromDouble(double value, unsigned char decimals)
+{
+  char text[64];
+  snprintf(text, sizeof(text), "%.*f", decimals, value);
+  return text;
+}
+
+// ====================== Sketch =======================
+
+extern void setup();
+extern void loop();
+
+// Number of loop() passes. Zero means run until stopped.
+unsigned long HostLoopCount = 0;
+
+int main(int argc, char** argv)
+{
+  if (argc > 1) HostLoopCount = strtoul(argv[1], NULL, 10);
+  setup();
+  for (unsigned long i = 0; HostLoopCount == 0 || i < HostLoopCount; i++) loop();
+  fflush(stdout);
+  return 0;
+}
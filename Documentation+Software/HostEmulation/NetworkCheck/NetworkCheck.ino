@@ -0,0 +1,510 @@
+// Checks of LoRaMessageHandler's network behaviour, with several handlers
+// sharing the SX127x emulator on a virtual clock.
+// Runs on a PC. No boards attached. See ../ReadMe.txt for how to build.
+// Prints one comma-separated row per check, and exits with status 1,
+// after lines starting with #, if any check fails.
+
+#include <SX127xEmulator.h>
+#include <LoRaMessageHandler.h>
+#include <ApparatusRegistry.h>
+#include <RequestTable.h>
+
+// Failures in the check under way
+int failures = 0;
+
+void Expect(bool condition, const char* what)
+{
+  if (condition) return;
+  failures++;
+  Serial.print("# ");
+  Serial.println(what);
+}
+
+// Puts a frame on the air and lets a handler receive it.
+int Feed(LoRaMessageHandler* handler, const uint8_t* frame, uint8_t length, bool relay = false)
+{
+  SX127x.injectPacket(frame, length);
+  int received = 0;
+  for (int i = 0; i < 3 && received == 0; i++)
+    received = relay ? handler->CheckForRelayPacket() : handler->CheckForIncomingPacket();
+  return received;
+}
+
+// A text message from node 1 to node 3, five rebroadcasts left.
+uint8_t TextFrame(uint8_t* frame, uint8_t messageID, const char* text)
+{
+  uint8_t length = MESSAGE_HEADER_LENGTH + strlen(text);
+  uint8_t header[MESSAGE_HEADER_LENGTH] = { length, SYSTEM_ID, 1, 3, 0, messageID, 3, 0, 5 };
+  memcpy(frame, header, MESSAGE_HEADER_LENGTH);
+  memcpy(frame + MESSAGE_HEADER_LENGTH, text, strlen(text));
+  return length;
+}
+
+// The relayed frame is the one received, one rebroadcast fewer.
+bool RelayedUnchanged(const uint8_t* frame, uint8_t length)
+{
+  uint8_t sent[256];
+  if (SX127x.lastTransmitted(sent) != length) return false;
+  if (sent[LOCATION_REBROADCASTS] != frame[LOCATION_REBROADCASTS] - 1) return false;
+  sent[LOCATION_REBROADCASTS] = frame[LOCATION_REBROADCASTS];
+  return memcmp(sent, frame, length) == 0;
+}
+
+// A relay holding a frame for a busy channel must not lose it to the
+// next frame the radio hears meanwhile.
+void RelayHoldsFrame()
+{
+  LoRaMessageHandler relay(0);
+  uint8_t frame[256], next[256];
+  uint8_t length = TextFrame(frame, 50, "relayed as received");
+  uint8_t nextLength = TextFrame(next, 51, "heard while held");
+
+  // Clear channel: sent at once, from the FIFO.
+  uint32_t transmitted = SX127x.transmitCount();
+  Expect(Feed(&relay, frame, length, true) > 0, "Relay did not receive the frame");
+  Expect(relay.RelayMessage(), "Relay did not send the frame");
+  Expect(SX127x.transmitCount() == transmitted + 1 && RelayedUnchanged(frame, length),
+         "Relayed frame differs from the one received");
+
+  // Busy channel: held, while another frame comes in.
+  frame[LOCATION_MESSAGE_ID + 1]++;
+  Expect(Feed(&relay, frame, length, true) > 0, "Relay did not receive the frame");
+  SX127x.setChannelBusy(true);
+  SX127x.injectPacket(next, nextLength);
+  Expect(relay.RelayMessage(), "Relay did not hold the frame");
+  Expect(relay.QueuedMessages() == 1, "Held frame not queued");
+  SX127x.setChannelBusy(false);
+  relay.Wait(500);
+  Expect(relay.QueuedMessages() == 0, "Held frame not sent");
+  Expect(RelayedUnchanged(frame, length), "Held frame overwritten");
+}
+
+// Runs the scheduler, for at most a superframe or so, until a frame has
+// gone out since transmitCount() was transmitted.
+// Returns the network time of a handler when it went.
+uint32_t WaitForTransmit(LoRaMessageHandler* handler, uint32_t transmitted)
+{
+  for (int waited = 0; waited < 4000 && SX127x.transmitCount() == transmitted; waited++)
+    Tasks.Wait(1);
+  Expect(SX127x.transmitCount() != transmitted, "Nothing sent");
+  return handler->NetworkTime();
+}
+
+// Lets the clock run to a point in a slot of a handler's schedule.
+void RunTo(LoRaMessageHandler* handler, uint8_t slot, uint16_t into, uint16_t slotLength, uint8_t slots)
+{
+  while (handler->NetworkTime() % ((uint32_t)slots * slotLength) != (uint32_t)slot * slotLength + into)
+    HostClock::advanceMicros(1000);
+}
+
+// Whether a frame sent at start, of length bytes, was within a slot,
+// the guard time or more from its start.
+bool WithinSlot(uint32_t start, uint8_t length, uint8_t slot, uint16_t slotLength, uint8_t slots)
+{
+  uint32_t into = start % slotLength;
+  unsigned long air = (LoRaMessageHandler::AirTime(length) + 999) / 1000;
+  return (start % ((uint32_t)slots * slotLength)) / slotLength == slot &&
+         into >= TDMA_GUARD_MS && into + air <= slotLength;
+}
+
+// Gets the schedule to a node, through a beacon from the sink.
+void FollowSink(LoRaMessageHandler* sink, LoRaMessageHandler* node, bool relay = false)
+{
+  uint8_t beacon[256];
+  uint32_t transmitted = SX127x.transmitCount();
+  sink->SendBeacon();
+  WaitForTransmit(sink, transmitted);
+  uint8_t length = SX127x.lastTransmitted(beacon);
+  node->EnableTDMA(true);
+  Feed(node, beacon, length, relay);
+  Expect(node->Scheduled(), "Schedule not followed");
+}
+
+// Nodes and relays send in their own slots only. A frame too long for
+// any slot goes at the start of one, and counts as a violation.
+void TDMAKeepsSlots()
+{
+  // Slots of 400 ms: sink 3, relays, node 1, relays, then four free.
+  LoRaMessageHandler sink(3);
+  sink.StartSchedule(8, 400, 1);
+  Expect(sink.AssignSlot(1) == 2, "Node 1 not given slot 2");
+  LoRaMessageHandler node(1);
+  LoRaMessageHandler relay(0);
+  FollowSink(&sink, &node);
+  FollowSink(&sink, &relay, true);
+
+  // The node's own message waits for slot 2.
+  RunTo(&node, 0, 50, 400, 8);
+  uint32_t transmitted = SX127x.transmitCount();
+  node.SendTextMessage("in my slot", 3);
+  Expect(node.QueuedMessages() == 1, "Sent outside the node's slot");
+  uint32_t start = WaitForTransmit(&node, transmitted);
+  uint8_t sent[256];
+  Expect(WithinSlot(start, SX127x.lastTransmitted(sent), 2, 400, 8), "Not sent within the node's slot");
+  LoRaMessageHandler::SlotStatistics statistics = node.getSlotStatistics();
+  Expect(statistics.slotsUsed == 1 && statistics.sentViolations == 0, "Node's slot statistics");
+
+  // The relay holds the node's message for the relay slot after it.
+  uint8_t frame[256];
+  uint8_t length = TextFrame(frame, 60, "relayed in a relay slot");
+  RunTo(&relay, 2, 100, 400, 8);
+  transmitted = SX127x.transmitCount();
+  Expect(Feed(&relay, frame, length, true) > 0, "Relay did not receive the frame");
+  Expect(relay.RelayMessage() && relay.QueuedMessages() == 1, "Relay did not hold the frame");
+  start = WaitForTransmit(&relay, transmitted);
+  Expect(WithinSlot(start, length, 3, 400, 8), "Not relayed within a relay slot");
+  Expect(relay.getSlotStatistics().sentViolations == 0, "Relay's slot statistics");
+
+  // Slots of 100 ms: sink 3, node 1, then two free.
+  LoRaMessageHandler shortSink(3);
+  shortSink.StartSchedule(4, 100, 0);
+  shortSink.AssignSlot(1);
+  LoRaMessageHandler shortNode(1);
+  FollowSink(&shortSink, &shortNode);
+
+  // Half way into its slot, the node keeps a long frame for the next.
+  char text[201];
+  memset(text, 'x', 200);
+  text[200] = 0;
+  RunTo(&shortNode, 1, 50, 100, 4);
+  transmitted = SX127x.transmitCount();
+  shortNode.SendTextMessage(text, 3);
+  Expect(shortNode.QueuedMessages() == 1, "Long frame sent half way into the slot");
+  start = WaitForTransmit(&shortNode, transmitted);
+  uint32_t into = start % 100;
+  Expect((start % 400) / 100 == 1 && into >= TDMA_GUARD_MS && into < 2 * TDMA_GUARD_MS,
+         "Long frame not sent at the start of the node's slot");
+  Expect(shortNode.getSlotStatistics().sentViolations == 1, "Long frame not counted as a violation");
+}
+
+// The sink's clock runs 80 ppm fast of the others', and well ahead.
+uint32_t SinkTime()
+{
+  return (uint32_t)(millis() * 1.00008) + 123456;
+}
+
+// Lets the clock run for the time a frame is on the air.
+void OnTheAir(uint8_t length)
+{
+  HostClock::advanceMicros(LoRaMessageHandler::AirTime(length));
+}
+
+// A node two hops from the sink keeps to its clock, though the relay in
+// between holds some beacons for a busy channel.
+void TimeFollowsSink()
+{
+  LoRaMessageHandler relay(0);
+  LoRaMessageHandler node(9);
+  long worstReceived = 0, worstBetween = 0;
+
+  for (uint16_t b = 1; b <= 30; b++)
+  {
+    uint32_t stamp = SinkTime();
+    uint8_t beacon[BEACON_LENGTH] = { BEACON_LENGTH, SYSTEM_ID, 3, 0, (uint8_t)(b >> 8), (uint8_t)b, 6, 0,
+                                      (1 << HOP_DISTANCE_SHIFT) | 5,
+                                      (uint8_t)(stamp >> 24), (uint8_t)(stamp >> 16), (uint8_t)(stamp >> 8), (uint8_t)stamp };
+    OnTheAir(BEACON_LENGTH);
+    Expect(Feed(&relay, beacon, BEACON_LENGTH, true) > 0, "Relay did not receive the beacon");
+
+    // Every third beacon goes at once. The others are held 150 or 300 ms.
+    uint32_t transmitted = SX127x.transmitCount();
+    SX127x.setChannelBusy(b % 3 != 0);
+    relay.RelayMessage();
+    HostClock::advanceMicros((b % 3) * 150000UL);
+    SX127x.setChannelBusy(false);
+    WaitForTransmit(&relay, transmitted);
+
+    uint8_t relayed[256];
+    uint8_t length = SX127x.lastTransmitted(relayed);
+    OnTheAir(length);
+    Feed(&node, relayed, length);
+    long received = (long)(node.NetworkTime() - SinkTime());
+    HostClock::advanceMicros(60000000UL);
+    long between = (long)(node.NetworkTime() - SinkTime());
+
+    // Drift is learned from the second beacon on. Judge once it settles.
+    if (b <= 10) continue;
+    if (labs(received) > worstReceived) worstReceived = labs(received);
+    if (labs(between) > worstBetween) worstBetween = labs(between);
+  }
+
+  Expect(worstReceived <= 2, "Time off by more than 2 ms on a beacon");
+  Expect(worstBetween <= 3, "Time off by more than 3 ms a minute after a beacon");
+
+  // A millisecond in a minute is 17 ppm, a quarter of it taken each time.
+  Expect(labs(node.ClockDrift() - 80) <= 10, "Clock drift not learned");
+  Expect(labs(relay.ClockDrift() - 80) <= 10, "Relay's clock drift not learned");
+}
+
+// Whether the radio is tuned to a channel of the plan, by its registers.
+bool TunedTo(uint8_t channel)
+{
+  long frequency = channel == HOME_CHANNEL ? (long)FREQUENCY : (long)(HOP_FIRST_FREQUENCY + channel * HOP_CHANNEL_SPACING);
+  uint32_t frf = ((uint64_t)frequency << 19) / 32000000;
+  return SX127x.peekRegister(0x06) == (uint8_t)(frf >> 16) &&
+         SX127x.peekRegister(0x07) == (uint8_t)(frf >> 8) &&
+         SX127x.peekRegister(0x08) == (uint8_t)frf;
+}
+
+// Sink, node and relay hop together, and tune the radio to the plan.
+// The sink's slot and the relay slot after it stay home, as do nodes
+// that do not follow the schedule. Hopping ends with the next beacon
+// once the sink turns it off.
+void HoppingAgrees()
+{
+  // Slots of 400 ms: sink 3, relays, then nodes 1, 5 and 6, each
+  // followed by relays, over 4 channels.
+  LoRaMessageHandler sink(3);
+  sink.StartSchedule(8, 400, 1);
+  sink.EnableHopping(4);
+  sink.AssignSlot(1);
+  sink.AssignSlot(5);
+  sink.AssignSlot(6);
+  LoRaMessageHandler node(1);
+  LoRaMessageHandler relay(0);
+  LoRaMessageHandler unscheduled(9);
+  FollowSink(&sink, &node);
+  FollowSink(&sink, &relay, true);
+  uint8_t beacon[256];
+  SX127x.lastTransmitted(beacon);
+  Expect(beacon[LOCATION_SCHEDULE + 3] == 4, "Channels not in the schedule");
+
+  uint8_t used = 0; // channels hopped to, a bit each
+  RunTo(&sink, 0, 200, 400, 8);
+  for (uint8_t s = 0; s < 24; s++)
+  {
+    sink.CheckForIncomingPacket();
+    node.CheckForIncomingPacket();
+    relay.CheckForRelayPacket();
+    unscheduled.CheckForIncomingPacket();
+    uint8_t channel = sink.Channel();
+    Expect(node.Channel() == channel && relay.Channel() == channel, "Not on the sink's channel");
+    Expect(TunedTo(channel), "Radio not tuned to the channel");
+    Expect(unscheduled.Channel() == HOME_CHANNEL, "Node without a schedule hopped");
+    if (s % 8 < 2) Expect(channel == HOME_CHANNEL, "Sink's or relay slot not home");
+    else if (channel < 4) used |= 1 << channel;
+    else Expect(false, "Channel outside the schedule's");
+    HostClock::advanceMicros(400000);
+  }
+  Expect(used == 0x0F, "Not every channel used");
+
+  sink.EnableHopping(0);
+  FollowSink(&sink, &node);
+  for (uint8_t s = 0; s < 8; s++)
+  {
+    node.CheckForIncomingPacket();
+    Expect(node.Channel() == HOME_CHANNEL && TunedTo(HOME_CHANNEL), "Still hopping");
+    HostClock::advanceMicros(400000);
+  }
+}
+
+// With security on, a sealed message gets through, and one with a bad
+// tag or none at all is rejected and counted.
+void SecurityRejectsForgery()
+{
+  const uint8_t key[16] = { 0x2B, 0x7E, 0x15, 0x16, 0x28, 0xAE, 0xD2, 0xA6,
+                            0xAB, 0xF7, 0x15, 0x88, 0x09, 0xCF, 0x4F, 0x3C };
+  LoRaMessageHandler sender(1);
+  LoRaMessageHandler receiver(3);
+  Expect(sender.EnableSecurity(key) && receiver.EnableSecurity(key), "Security not enabled");
+
+  uint8_t frame[256];
+  sender.SendTextMessage("sealed", 3);
+  uint8_t length = SX127x.lastTransmitted(frame);
+  Expect(frame[LOCATION_MESSAGE_TYPE] & MESSAGE_FLAG_SECURE, "Message not sealed");
+  Expect(memcmp(frame + MESSAGE_HEADER_LENGTH, "sealed", 6) != 0, "Contents not encrypted");
+  Expect(Feed(&receiver, frame, length) == MESSAGE_HEADER_LENGTH + 6, "Sealed message not received");
+  Expect(memcmp(receiver.getMESSAGE() + MESSAGE_HEADER_LENGTH, "sealed", 6) == 0, "Sealed message not decrypted");
+
+  uint32_t invalid = receiver.getTelemetry().dropped[TELEMETRY_DROP_INVALID];
+  sender.SendTextMessage("tampered", 3);
+  length = SX127x.lastTransmitted(frame);
+  frame[length - 1] ^= 0x01;
+  Expect(Feed(&receiver, frame, length) == -2, "Message with a bad tag accepted");
+
+  length = TextFrame(frame, 70, "forged");
+  Expect(Feed(&receiver, frame, length) == -2, "Message without a tag accepted");
+  Expect(receiver.getTelemetry().dropped[TELEMETRY_DROP_INVALID] == invalid + 2, "Rejections not counted");
+}
+
+// Apparatus as in the request/response sketches. The LED is listed but
+// not served here. Readings answer with 1234 plus the request's value.
+bool ReadFixed(uint32_t request, uint32_t& response)
+{
+  response = 1234 + request;
+  return true;
+}
+
+constexpr Apparatus checkApparatusList[] =
+{
+  {0, ApparatusKind::Sensor,   "Sensor BATTV", ReadFixed, PayloadEncoding::Hundredths},
+  {1, ApparatusKind::Sensor,   "Sensor SOIL",  ReadFixed, PayloadEncoding::Hundredths},
+  {2, ApparatusKind::Actuator, "Actuator LED", NULL,      PayloadEncoding::OnOff}
+};
+constexpr ApparatusRegistry checkApparatus(checkApparatusList);
+static_assert(checkApparatus.Valid(), "apparatus IDs must match their position in checkApparatusList");
+
+// Lets a handler receive the last frame sent.
+int Deliver(LoRaMessageHandler* handler)
+{
+  uint8_t frame[256];
+  uint8_t length = SX127x.lastTransmitted(frame);
+  return Feed(handler, frame, length);
+}
+
+// Serves a received request as the Application sketches do. Only an
+// apparatus that is listed and served is answered.
+// Returns whether a response was sent.
+bool ServeRequest(LoRaMessageHandler* node)
+{
+  const uint8_t* message = node->getMESSAGE();
+  const Apparatus* thisApparatus = checkApparatus.Find(message[LOCATION_APPARATUS_ID]);
+  uint32_t response = 0;
+  if (thisApparatus == NULL || thisApparatus->handler == NULL ||
+      !thisApparatus->handler(node->getAssociatedValue(), response))
+    return false;
+  return node->SendResponse(thisApparatus->id, response, message[LOCATION_SOURCE_ID], node->getRequestID());
+}
+
+// Requests are dispatched by one registry lookup. An apparatus ID not in
+// the registry, or one this node does not serve, gets no response.
+void RegistryRejectsUnknown()
+{
+  for (uint8_t id = 0; id < checkApparatus.Count(); id++)
+    Expect(checkApparatus.Find(id) != NULL && checkApparatus.Find(id)->id == id, "Listed apparatus not found");
+  Expect(checkApparatus.Find(checkApparatus.Count()) == NULL && checkApparatus.Find(0xFF) == NULL,
+         "Unknown apparatus found");
+
+  LoRaMessageHandler requester(1);
+  LoRaMessageHandler server(3);
+  requester.SendRequest(1, 5, 3);
+  Expect(Deliver(&server) > 0, "Request not received");
+  uint32_t transmitted = SX127x.transmitCount();
+  Expect(ServeRequest(&server) && SX127x.transmitCount() == transmitted + 1, "Listed apparatus not served");
+  Expect(Deliver(&requester) > 0 && requester.getMESSAGE()[LOCATION_APPARATUS_ID] == 1 &&
+         requester.getAssociatedValue() == 1239, "Wrong response");
+
+  uint8_t unanswered[] = { 2, 7, 0xFF };
+  for (uint8_t i = 0; i < sizeof(unanswered); i++)
+  {
+    requester.SendRequest(unanswered[i], 0, 3);
+    Expect(Deliver(&server) > 0, "Request not received");
+    transmitted = SX127x.transmitCount();
+    Expect(!ServeRequest(&server) && SX127x.transmitCount() == transmitted,
+           "Unknown or unserved apparatus answered");
+  }
+}
+
+// Two requests in flight to the same apparatus are told apart by their
+// request IDs. A response is matched only by the ID of its request.
+void RequestIDsMatch()
+{
+  LoRaMessageHandler requester(1);
+  LoRaMessageHandler server(3);
+  RequestTable outstanding;
+
+  uint8_t first[256], second[256];
+  uint16_t firstID = 0, secondID = 0;
+  Expect(requester.SendRequest(0, 0, 3, &firstID), "First request not sent");
+  uint8_t firstLength = SX127x.lastTransmitted(first);
+  Expect(requester.SendRequest(0, 0, 3, &secondID), "Second request not sent");
+  uint8_t secondLength = SX127x.lastTransmitted(second);
+  Expect(firstID != secondID, "Requests share an ID");
+  outstanding.Add(3, 0, firstID, 0, 60000);
+  outstanding.Add(3, 0, secondID, 0, 60000);
+
+  // The second is answered first, and its ID is echoed.
+  Expect(Feed(&server, second, secondLength) > 0 && server.getRequestID() == secondID,
+         "Request ID not received");
+  Expect(ServeRequest(&server), "Request not served");
+  Expect(Deliver(&requester) > 0 && requester.getRequestID() == secondID &&
+         requester.getAssociatedValue() == 1234, "Request ID not echoed");
+  Expect(outstanding.Remove(3, 0, requester.getRequestID()), "Response not matched");
+  Expect(outstanding.Find(3, 0, firstID) != NULL, "Other request retired");
+
+  // A response with an ID not outstanding matches nothing.
+  server.SendResponse(0, 1234, 1, (uint16_t)(secondID + 100));
+  Expect(Deliver(&requester) > 0, "Response not received");
+  Expect(!outstanding.Remove(3, 0, requester.getRequestID()) && outstanding.Count() == 1,
+         "Response with the wrong ID matched");
+
+  Expect(Feed(&server, first, firstLength) > 0 && ServeRequest(&server), "Request not served");
+  Expect(Deliver(&requester) > 0 && outstanding.Remove(3, 0, requester.getRequestID()),
+         "Response not matched");
+  Expect(outstanding.Count() == 0, "Request left outstanding");
+}
+
+// A batch request carries every apparatus asked for. The batch response
+// leaves out those that cannot be served, and retires the request.
+void BatchRetiresRequest()
+{
+  LoRaMessageHandler requester(1);
+  LoRaMessageHandler server(3);
+  RequestTable outstanding;
+
+  const uint8_t asked[] = { 0, 9, 1 };
+  uint16_t requestID = 0;
+  Expect(requester.SendBatchRequest(asked, sizeof(asked), 3, &requestID), "Batch request not sent");
+  outstanding.Add(3, BATCH_APPARATUS, requestID, 0, 60000);
+
+  // Served as the Application sketches do.
+  Expect(Deliver(&server) > 0 && (server.getMESSAGE()[LOCATION_MESSAGE_TYPE] & MESSAGE_TYPE_MASK) == 4,
+         "Batch request not received");
+  Expect(server.getBatchCount() == sizeof(asked), "Wrong batch count");
+  uint8_t served[MAX_BATCH_COUNT];
+  uint32_t values[MAX_BATCH_COUNT];
+  uint8_t numServed = 0;
+  for (uint8_t i = 0; i < server.getBatchCount(); i++)
+  {
+    Expect(server.getBatchApparatus(i) == asked[i], "Wrong apparatus in batch request");
+    const Apparatus* thisApparatus = checkApparatus.Find(server.getBatchApparatus(i));
+    if (thisApparatus != NULL && thisApparatus->handler != NULL &&
+        thisApparatus->handler(0, values[numServed]))
+      served[numServed++] = thisApparatus->id;
+  }
+  Expect(numServed == 2, "Unknown apparatus served");
+  Expect(server.SendBatchResponse(served, values, numServed, 1, server.getRequestID()), "Batch response not sent");
+
+  Expect(Deliver(&requester) > 0 && (requester.getMESSAGE()[LOCATION_MESSAGE_TYPE] & MESSAGE_TYPE_MASK) == 5,
+         "Batch response not received");
+  Expect(requester.getBatchCount() == 2 &&
+         requester.getBatchApparatus(0) == 0 && requester.getBatchValue(0) == 1234 &&
+         requester.getBatchApparatus(1) == 1 && requester.getBatchValue(1) == 1234,
+         "Batch response not decoded");
+  Expect(outstanding.Remove(3, BATCH_APPARATUS, requester.getRequestID()) && outstanding.Count() == 0,
+         "Batch request not retired");
+}
+
+// Each check starts with the radio as at power-on, nothing on the air.
+void Run(const char* name, void (*check)())
+{
+  failures = 0;
+  SX127x.reset();
+  check();
+  Serial.print(name);
+  Serial.println(failures == 0 ? ",pass" : ",FAIL");
+}
+
+void setup()
+{
+  Serial.begin(9600);
+  HostClock::setVirtual(true);
+  HostClock::advanceMicros(1000000000ULL); // well away from time zero
+
+  int failed = 0;
+  Run("relay holds frame", RelayHoldsFrame); failed += failures > 0;
+  Run("TDMA keeps slots", TDMAKeepsSlots); failed += failures > 0;
+  Run("time follows sink", TimeFollowsSink); failed += failures > 0;
+  Run("hopping agrees", HoppingAgrees); failed += failures > 0;
+  Run("security rejects forgery", SecurityRejectsForgery); failed += failures > 0;
+  Run("registry rejects unknown", RegistryRejectsUnknown); failed += failures > 0;
+  Run("request IDs match", RequestIDsMatch); failed += failures > 0;
+  Run("batch retires request", BatchRetiresRequest); failed += failures > 0;
+
+  Serial.flush();
+  exit(failed == 0 ? 0 : 1);
+}
+
+void loop()
+{
+}
@@ -0,0 +1,151 @@
+// Check of RequestTable against a plain reference model.
+// Runs on a PC, on a virtual clock. See ../ReadMe.txt for how to build.
+// Millions of random adds, removes, finds and expiries are done on the
+// table and on the model, which keeps every possible request in an
+// array indexed by its key. After each one they have to agree:
+//   - Add succeeds only for a request not outstanding, with room left.
+//   - Remove and Find see exactly the requests the model holds.
+//   - Count is the model's count.
+//   - No request expires before its timeout, nor stays past its timeout
+//     plus a tick once Expire() has run.
+// Prints the counts, and exits with status 1 if anything disagreed.
+
+#include <RequestTable.h>
+
+// Operations done. Three million take a few seconds.
+#define OPERATIONS 3000000UL
+
+// Keys drawn from a small range, so that requests collide often.
+#define DESTINATIONS 4
+#define APPARATUS 3
+#define REQUEST_IDS 4
+
+struct ModelRequest
+{
+  bool outstanding;
+  unsigned long timeSent;
+  unsigned long timeout;
+};
+
+// Made in setup(), once the virtual clock runs.
+RequestTable* table;
+ModelRequest model[DESTINATIONS][APPARATUS][REQUEST_IDS];
+unsigned int modelCount = 0;
+
+unsigned long mismatches = 0;
+unsigned long expired = 0;
+unsigned long lastExpire = 0; // millis() of the previous Expire()
+
+void Mismatch(const char* what)
+{
+  if (mismatches++ < 10)
+  {
+    Serial.print("# ");
+    Serial.println(what);
+  }
+}
+
+// Mostly timeouts within the wheel's direct reach, some beyond it.
+unsigned long RandomTimeout()
+{
+  if (random(3) == 0) return random(800000);
+  return random(70000);
+}
+
+bool AddBoth(uint8_t d, uint8_t a, uint8_t id, unsigned long timeout)
+{
+  ModelRequest& m = model[d][a][id];
+  bool expected = !m.outstanding && modelCount < REQUEST_TABLE_CAPACITY;
+  bool added = table->Add(d, a, id, 0, timeout) != NULL;
+  if (added != expected) Mismatch("Add");
+  if (added)
+  {
+    m.outstanding = true;
+    m.timeSent = millis();
+    m.timeout = timeout;
+    modelCount++;
+  }
+  return added;
+}
+
+void OnExpired(const RequestTable::Request& request)
+{
+  ModelRequest& m = model[request.destination][request.apparatus][request.requestID];
+  if (!m.outstanding)
+  {
+    Mismatch("Expired a request not outstanding");
+    return;
+  }
+
+  unsigned long age = millis() - m.timeSent;
+  if (age < m.timeout) Mismatch("Expired early");
+  if (age > m.timeout + REQUEST_TABLE_TICK_MS + (millis() - lastExpire)) Mismatch("Expired late");
+  m.outstanding = false;
+  modelCount--;
+  expired++;
+
+  // The callback may add requests again.
+  if (random(4) == 0) AddBoth(request.destination, request.apparatus, request.requestID, RandomTimeout());
+}
+
+// After Expire(), nothing outstanding may be past its timeout and a tick.
+void CheckNoneOverdue()
+{
+  for (uint8_t d = 0; d < DESTINATIONS; d++)
+    for (uint8_t a = 0; a < APPARATUS; a++)
+      for (uint8_t id = 0; id < REQUEST_IDS; id++)
+      {
+        const ModelRequest& m = model[d][a][id];
+        if (m.outstanding && millis() - m.timeSent > m.timeout + REQUEST_TABLE_TICK_MS)
+          Mismatch("Not expired in time");
+      }
+}
+
+void setup()
+{
+  Serial.begin(9600);
+  HostClock::setVirtual(true);
+  HostClock::advanceMicros(4000000000ULL); // well away from time zero
+  randomSeed(1);
+  memset(model, 0, sizeof(model));
+  table = new RequestTable();
+
+  for (unsigned long operation = 0; operation < OPERATIONS; operation++)
+  {
+    HostClock::advanceMicros(random(50) * 1000UL);
+    uint8_t d = random(DESTINATIONS);
+    uint8_t a = random(APPARATUS);
+    uint8_t id = random(REQUEST_IDS);
+    ModelRequest& m = model[d][a][id];
+
+    long choice = random(10);
+    if (choice < 3) AddBoth(d, a, id, RandomTimeout());
+    else if (choice < 5)
+    {
+      if (table->Remove(d, a, id) != m.outstanding) Mismatch("Remove");
+      if (m.outstanding) modelCount--;
+      m.outstanding = false;
+    }
+    else if (choice < 6)
+    {
+      if ((table->Find(d, a, id) != NULL) != m.outstanding) Mismatch("Find");
+    }
+    else
+    {
+      table->Expire(OnExpired);
+      lastExpire = millis();
+      if (choice == 9) CheckNoneOverdue();
+    }
+    if (table->Count() != modelCount) Mismatch("Count");
+  }
+
+  Serial.print("operations,"); Serial.println(OPERATIONS);
+  Serial.print("expired,"); Serial.println(expired);
+  Serial.print("mismatches,"); Serial.println(mismatches);
+  Serial.flush();
+  exit(mismatches == 0 ? 0 : 1);
+}
+
+void loop()
+{
+}
@@ -0,0 +1,30 @@
+// Minimal stand-in for the Arduino SPI library.
+// On the host, radio traffic goes to the SX127x emulator instead.
+// See ReadMe.txt in this directory.
+
+#pragma once
+
+#include <Arduino.h>
+
+#define MSBFIRST 1
+#define SPI_MODE0 0x00
+
+class SPISettings
+{
+public:
+  SPISettings() {}
+  SPISettings(uint32_t clock, uint8_t bitOrder, uint8_t dataMode)
+  { (void)clock; (void)bitOrder; (void)dataMode; }
+};
+
+class SPIClass
+{
+public:
+  void begin() {}
+  void end() {}
+  void beginTransaction(SPISettings settings) { (void)settings; }
+  void endTransaction() {}
+  uint8_t transfer(uint8_t data) { (void)data; return 0; }
+};
+
+extern SPIClass SPI;
@@ -0,0 +1,69 @@
+// SPI-cost report for the LoRa driver's hot paths.
+// Runs on a PC against the SX127x register emulator. No boards attached.
+// See ../ReadMe.txt for how to build.
+// Prints one comma-separated row per LoRaClass API call.
+
+#include <LoRa.h>
+#include <SX127xEmulator.h>
+
+// Frame sizes exercised: a request/response frame and a full-size frame.
+#define SMALL_FRAME 13
+#define LARGE_FRAME 222
+#define NUM_FRAMES 100
+
+uint8_t frame[256];
+uint8_t received[256];
+
+void setup()
+{
+  Serial.begin(9600);
+
+  if (!LoRa.begin(915E6))
+  {
+    Serial.println("Starting LoRa failed!");
+    exit(1);
+  }
+  LoRa.setSpreadingFactor(7);
+  LoRa.setSignalBandwidth(125E3);
+  LoRa.enableCrc();
+
+  for (int i = 0; i < 256; i++) frame[i] = (uint8_t)i;
+  SX127x.resetCounters();
+
+  // Receive path. Same sequence LoRaMessageHandler::CheckForIncomingPacket() uses.
+  for (int f = 0; f < NUM_FRAMES; f++)
+  {
+    uint8_t size = (f % 2) ? LARGE_FRAME : SMALL_FRAME;
+    LoRa.parsePacket(); // enter RX
+    SX127x.injectPacket(frame, size);
+    int packetSize = LoRa.parsePacket();
+    for (int i = 0; i < packetSize; i++) received[i] = LoRa.read();
+    if (packetSize != size || memcmp(frame, received, size) != 0)
+    {
+      Serial.println("*** Received frame does not match");
+      exit(1);
+    }
+  }
+
+  // Transmit path. Same sequence LoRaMessageHandler::BroadcastPacket() uses.
+  for (int f = 0; f < NUM_FRAMES; f++)
+  {
+    uint8_t size = (f % 2) ? LARGE_FRAME : SMALL_FRAME;
+    while (LoRa.rxSignalDetected());
+    LoRa.beginPacket();
+    LoRa.write(frame, size);
+    LoRa.endPacket();
+    if (SX127x.lastTransmitted(received) != size || memcmp(frame, received, size) != 0)
+    {
+      Serial.println("*** Transmitted frame does not match");
+      exit(1);
+    }
+  }
+
+  SX127x.printReport(Serial);
+  exit(0);
+}
+
+void loop()
+{
+}
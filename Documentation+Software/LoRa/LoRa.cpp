@@ -2,6 +2,7 @@
 // Licensed under the MIT license. See LICENSE file in the project root for full license information.
 
 #include "LoRa.h"
+#include "SX127xEmulator.h" // host builds only, see LORA_EMULATOR
 
 // registers
 #define REG_FIFO                 0x00
@@ -69,6 +70,8 @@
 
 #define MAX_PKT_LENGTH           255
 
+#define CAD_TIMEOUT_MS           100
+
 #if (ESP8266 || ESP32)
     #define ISR_PREFIX ICACHE_RAM_ATTR
 #else
@@ -78,10 +81,35 @@
 // *** Added for CAD, checking for clear channel
 bool LoRaClass::rxSignalDetected()
 {
+  LORA_SPI_COST("rxSignalDetected");
   LoRa.receive();
   return (readRegister(REG_MODEM_STAT) & 0x01) == 0x01;
 }
 
+// *** Added for relaying a received packet without reading it out.
+// Channel activity detection, polled. The radio is left in standby, not
+// receiving, so the packet in the FIFO stays as it is.
+bool LoRaClass::channelActive()
+{
+  LORA_SPI_COST("channelActive");
+  idle();
+  writeRegister(REG_IRQ_FLAGS, IRQ_CAD_DONE_MASK | IRQ_CAD_DETECTED_MASK);
+  writeRegister(REG_OP_MODE, MODE_LONG_RANGE_MODE | MODE_CAD);
+
+  // Detection takes about two symbols, 66 ms at SF12 and 125 kHz.
+  unsigned long start = millis();
+  int irqFlags;
+  while (((irqFlags = readRegister(REG_IRQ_FLAGS)) & IRQ_CAD_DONE_MASK) == 0) {
+    if (millis() - start > CAD_TIMEOUT_MS) {
+      // No answer. Take the channel as busy.
+      idle();
+      return true;
+    }
+  }
+  writeRegister(REG_IRQ_FLAGS, IRQ_CAD_DONE_MASK | IRQ_CAD_DETECTED_MASK);
+  return (irqFlags & IRQ_CAD_DETECTED_MASK) != 0;
+}
+
 LoRaClass::LoRaClass() :
   _spiSettings(LORA_DEFAULT_SPI_FREQUENCY, MSBFIRST, SPI_MODE0),
   _spi(&LORA_DEFAULT_SPI),
@@ -89,6 +117,8 @@ LoRaClass::LoRaClass() :
   _frequency(0),
   _packetIndex(0),
   _implicitHeaderMode(0),
+  _packetAddress(0),
+  _packetLength(0),
   _onReceive(NULL),
   _onCadDone(NULL),
   _onTxDone(NULL)
@@ -99,6 +129,7 @@ LoRaClass::LoRaClass() :
 
 int LoRaClass::begin(long frequency)
 {
+  LORA_SPI_COST("begin");
 #if defined(ARDUINO_SAMD_MKRWAN1300) || defined(ARDUINO_SAMD_MKRWAN1310)
   pinMode(LORA_IRQ_DUMB, OUTPUT);
   digitalWrite(LORA_IRQ_DUMB, LOW);
@@ -167,6 +198,7 @@ int LoRaClass::begin(long frequency)
 
 void LoRaClass::end()
 {
+  LORA_SPI_COST("end");
   // put in sleep mode
   sleep();
 
@@ -176,6 +208,7 @@ void LoRaClass::end()
 
 int LoRaClass::beginPacket(int implicitHeader)
 {
+  LORA_SPI_COST("beginPacket");
   if (isTransmitting()) {
     return 0;
   }
@@ -198,6 +231,7 @@ int LoRaClass::beginPacket(int implicitHeader)
 
 int LoRaClass::endPacket(bool async)
 {
+  LORA_SPI_COST("endPacket");
   
   if ((async) && (_onTxDone))
       writeRegister(REG_DIO_MAPPING_1, 0x40); // DIO0 => TXDONE
@@ -236,6 +270,7 @@ bool LoRaClass::isTransmitting()
 
 int LoRaClass::parsePacket(int size)
 {
+  LORA_SPI_COST("parsePacket");
   int packetLength = 0;
   int irqFlags = readRegister(REG_IRQ_FLAGS);
 
@@ -265,7 +300,9 @@ int LoRaClass::parsePacket(int size)
     }
 
     // set FIFO address to current RX address
-    writeRegister(REG_FIFO_ADDR_PTR, readRegister(REG_FIFO_RX_CURRENT_ADDR));
+    _packetAddress = readRegister(REG_FIFO_RX_CURRENT_ADDR);
+    _packetLength = packetLength;
+    writeRegister(REG_FIFO_ADDR_PTR, _packetAddress);
 
     // put in standby mode
     idle();
@@ -282,18 +319,56 @@ int LoRaClass::parsePacket(int size)
   return packetLength;
 }
 
+void LoRaClass::writePacket(uint8_t offset, uint8_t value)
+{
+  LORA_SPI_COST("writePacket");
+  // store current FIFO address
+  int currentAddress = readRegister(REG_FIFO_ADDR_PTR);
+
+  writeRegister(REG_FIFO_ADDR_PTR, (uint8_t)(_packetAddress + offset));
+  writeRegister(REG_FIFO, value);
+
+  // restore FIFO address
+  writeRegister(REG_FIFO_ADDR_PTR, currentAddress);
+}
+
+int LoRaClass::resendPacket()
+{
+  LORA_SPI_COST("resendPacket");
+  if (isTransmitting()) {
+    return 0;
+  }
+
+  // put in standby mode
+  idle();
+  explicitHeaderMode();
+
+  // transmit from the received packet
+  writeRegister(REG_FIFO_TX_BASE_ADDR, _packetAddress);
+  writeRegister(REG_PAYLOAD_LENGTH, _packetLength);
+  endPacket();
+
+  // beginPacket() writes from address 0
+  writeRegister(REG_FIFO_TX_BASE_ADDR, 0);
+
+  return 1;
+}
+
 int LoRaClass::packetRssi()
 {
+  LORA_SPI_COST("packetRssi");
   return (readRegister(REG_PKT_RSSI_VALUE) - (_frequency < RF_MID_BAND_THRESHOLD ? RSSI_OFFSET_LF_PORT : RSSI_OFFSET_HF_PORT));
 }
 
 float LoRaClass::packetSnr()
 {
+  LORA_SPI_COST("packetSnr");
   return ((int8_t)readRegister(REG_PKT_SNR_VALUE)) * 0.25;
 }
 
 long LoRaClass::packetFrequencyError()
 {
+  LORA_SPI_COST("packetFrequencyError");
   int32_t freqError = 0;
   freqError = static_cast<int32_t>(readRegister(REG_FREQ_ERROR_MSB) & 0b111);
   freqError <<= 8L;
@@ -313,16 +388,19 @@ long LoRaClass::packetFrequencyError()
 
 int LoRaClass::rssi()
 {
+  LORA_SPI_COST("rssi");
   return (readRegister(REG_RSSI_VALUE) - (_frequency < RF_MID_BAND_THRESHOLD ? RSSI_OFFSET_LF_PORT : RSSI_OFFSET_HF_PORT));
 }
 
 size_t LoRaClass::write(uint8_t byte)
 {
+  LORA_SPI_COST("write");
   return write(&byte, sizeof(byte));
 }
 
 size_t LoRaClass::write(const uint8_t *buffer, size_t size)
 {
+  LORA_SPI_COST("write");
   int currentLength = readRegister(REG_PAYLOAD_LENGTH);
 
   // check size
@@ -343,11 +421,13 @@ size_t LoRaClass::write(const uint8_t *buffer, size_t size)
 
 int LoRaClass::available()
 {
+  LORA_SPI_COST("available");
   return (readRegister(REG_RX_NB_BYTES) - _packetIndex);
 }
 
 int LoRaClass::read()
 {
+  LORA_SPI_COST("read");
   if (!available()) {
     return -1;
   }
@@ -359,6 +439,7 @@ int LoRaClass::read()
 
 int LoRaClass::peek()
 {
+  LORA_SPI_COST("peek");
   if (!available()) {
     return -1;
   }
@@ -436,6 +517,7 @@ void LoRaClass::onTxDone(void(*callback)())
 
 void LoRaClass::receive(int size)
 {
+  LORA_SPI_COST("receive");
 
   writeRegister(REG_DIO_MAPPING_1, 0x00); // DIO0 => RXDONE
 
@@ -452,6 +534,7 @@ void LoRaClass::receive(int size)
 
 void LoRaClass::channelActivityDetection(void)
 {
+  LORA_SPI_COST("channelActivityDetection");
   writeRegister(REG_DIO_MAPPING_1, 0x80);// DIO0 => CADDONE
   writeRegister(REG_OP_MODE, MODE_LONG_RANGE_MODE | MODE_CAD);
 }
@@ -459,16 +542,19 @@ void LoRaClass::channelActivityDetection(void)
 
 void LoRaClass::idle()
 {
+  LORA_SPI_COST("idle");
   writeRegister(REG_OP_MODE, MODE_LONG_RANGE_MODE | MODE_STDBY);
 }
 
 void LoRaClass::sleep()
 {
+  LORA_SPI_COST("sleep");
   writeRegister(REG_OP_MODE, MODE_LONG_RANGE_MODE | MODE_SLEEP);
 }
 
 void LoRaClass::setTxPower(int level, int outputPin)
 {
+  LORA_SPI_COST("setTxPower");
   if (PA_OUTPUT_RFO_PIN == outputPin) {
     // RFO
     if (level < 0) {
@@ -506,6 +592,7 @@ void LoRaClass::setTxPower(int level, int outputPin)
 
 void LoRaClass::setFrequency(long frequency)
 {
+  LORA_SPI_COST("setFrequency");
   _frequency = frequency;
 
   uint64_t frf = ((uint64_t)frequency << 19) / 32000000;
@@ -522,6 +609,7 @@ int LoRaClass::getSpreadingFactor()
 
 void LoRaClass::setSpreadingFactor(int sf)
 {
+  LORA_SPI_COST("setSpreadingFactor");
   if (sf < 6) {
     sf = 6;
   } else if (sf > 12) {
@@ -562,6 +650,7 @@ long LoRaClass::getSignalBandwidth()
 
 void LoRaClass::setSignalBandwidth(long sbw)
 {
+  LORA_SPI_COST("setSignalBandwidth");
   int bw;
 
   if (sbw <= 7.8E3) {
@@ -605,6 +694,7 @@ void LoRaClass::setLdoFlag()
 
 void LoRaClass::setCodingRate4(int denominator)
 {
+  LORA_SPI_COST("setCodingRate4");
   if (denominator < 5) {
     denominator = 5;
   } else if (denominator > 8) {
@@ -618,39 +708,46 @@ void LoRaClass::setCodingRate4(int denominator)
 
 void LoRaClass::setPreambleLength(long length)
 {
+  LORA_SPI_COST("setPreambleLength");
   writeRegister(REG_PREAMBLE_MSB, (uint8_t)(length >> 8));
   writeRegister(REG_PREAMBLE_LSB, (uint8_t)(length >> 0));
 }
 
 void LoRaClass::setSyncWord(int sw)
 {
+  LORA_SPI_COST("setSyncWord");
   writeRegister(REG_SYNC_WORD, sw);
 }
 
 void LoRaClass::enableCrc()
 {
+  LORA_SPI_COST("enableCrc");
   writeRegister(REG_MODEM_CONFIG_2, readRegister(REG_MODEM_CONFIG_2) | 0x04);
 }
 
 void LoRaClass::disableCrc()
 {
+  LORA_SPI_COST("disableCrc");
   writeRegister(REG_MODEM_CONFIG_2, readRegister(REG_MODEM_CONFIG_2) & 0xfb);
 }
 
 void LoRaClass::enableInvertIQ()
 {
+  LORA_SPI_COST("enableInvertIQ");
   writeRegister(REG_INVERTIQ,  0x66);
   writeRegister(REG_INVERTIQ2, 0x19);
 }
 
 void LoRaClass::disableInvertIQ()
 {
+  LORA_SPI_COST("disableInvertIQ");
   writeRegister(REG_INVERTIQ,  0x27);
   writeRegister(REG_INVERTIQ2, 0x1d);
 }
 
 void LoRaClass::setOCP(uint8_t mA)
 {
+  LORA_SPI_COST("setOCP");
   uint8_t ocpTrim = 27;
 
   if (mA <= 120) {
@@ -664,6 +761,7 @@ void LoRaClass::setOCP(uint8_t mA)
 
 void LoRaClass::setGain(uint8_t gain)
 {
+  LORA_SPI_COST("setGain");
   // check allowed range
   if (gain > 6) {
     gain = 6;
@@ -690,6 +788,7 @@ void LoRaClass::setGain(uint8_t gain)
 
 byte LoRaClass::random()
 {
+  LORA_SPI_COST("random");
   return readRegister(REG_RSSI_WIDEBAND);
 }
 
@@ -712,6 +811,7 @@ void LoRaClass::setSPIFrequency(uint32_t frequency)
 
 void LoRaClass::dumpRegisters(Stream& out)
 {
+  LORA_SPI_COST("dumpRegisters");
   for (int i = 0; i < 128; i++) {
     out.print("0x");
     out.print(i, HEX);
@@ -736,6 +836,7 @@ void LoRaClass::implicitHeaderMode()
 
 void LoRaClass::handleDio0Rise()
 {
+  LORA_SPI_COST("handleDio0Rise");
   int irqFlags = readRegister(REG_IRQ_FLAGS);
 
   // clear IRQ's
@@ -755,7 +856,9 @@ void LoRaClass::handleDio0Rise()
       int packetLength = _implicitHeaderMode ? readRegister(REG_PAYLOAD_LENGTH) : readRegister(REG_RX_NB_BYTES);
 
       // set FIFO address to current RX address
-      writeRegister(REG_FIFO_ADDR_PTR, readRegister(REG_FIFO_RX_CURRENT_ADDR));
+      _packetAddress = readRegister(REG_FIFO_RX_CURRENT_ADDR);
+      _packetLength = packetLength;
+      writeRegister(REG_FIFO_ADDR_PTR, _packetAddress);
 
       if (_onReceive) {
         _onReceive(packetLength);
@@ -780,6 +883,9 @@ void LoRaClass::writeRegister(uint8_t address, uint8_t value)
 
 uint8_t LoRaClass::singleTransfer(uint8_t address, uint8_t value)
 {
+#ifdef LORA_EMULATOR
+  return SX127x.transfer(address, value);
+#else
   uint8_t response;
 
   _spi->beginTransaction(_spiSettings);
@@ -790,6 +896,7 @@ uint8_t LoRaClass::singleTransfer(uint8_t address, uint8_t value)
   _spi->endTransaction();
 
   return response;
+#endif
 }
 
 ISR_PREFIX void LoRaClass::onDio0Rise()
@@ -36,6 +36,11 @@ public:
   // *** Added for CAD, checking for clear channel
   bool rxSignalDetected();
 
+  // *** Added for relaying a received packet without reading it out.
+  // Same check, by channel activity detection. Unlike rxSignalDetected()
+  // it does not start receiving, which would overwrite the FIFO.
+  bool channelActive();
+
   LoRaClass();
 
   int begin(long frequency);
@@ -45,6 +50,13 @@ public:
   int endPacket(bool async = false);
 
   int parsePacket(int size = 0);
+
+  // *** Added for relaying a received packet without reading it out.
+  // It stays in the FIFO until the next receive or beginPacket().
+  // writePacket() changes one byte of it. resendPacket() transmits it
+  // as it is, from where it was received.
+  void writePacket(uint8_t offset, uint8_t value);
+  int resendPacket();
   int packetRssi();
   float packetSnr();
   long packetFrequencyError();
@@ -127,6 +139,8 @@ private:
   long _frequency;
   int _packetIndex;
   int _implicitHeaderMode;
+  uint8_t _packetAddress; // FIFO address of the received packet
+  uint8_t _packetLength;
   void (*_onReceive)(int);
   void (*_onCadDone)(boolean);
   void (*_onTxDone)();
@@ -0,0 +1,288 @@
+// Register-level SX127x emulator.
+// Compiled only for host builds with LORA_EMULATOR defined.
+
+#include "LoRa.h"
+#include "SX127xEmulator.h"
+
+#ifdef LORA_EMULATOR
+
+// registers
+#define REG_FIFO                 0x00
+#define REG_OP_MODE              0x01
+#define REG_FIFO_ADDR_PTR        0x0d
+#define REG_FIFO_TX_BASE_ADDR    0x0e
+#define REG_FIFO_RX_BASE_ADDR    0x0f
+#define REG_FIFO_RX_CURRENT_ADDR 0x10
+#define REG_IRQ_FLAGS            0x12
+#define REG_RX_NB_BYTES          0x13
+#define REG_MODEM_STAT           0x18
+#define REG_PKT_SNR_VALUE        0x19
+#define REG_PKT_RSSI_VALUE       0x1a
+#define REG_RSSI_VALUE           0x1b
+#define REG_MODEM_CONFIG_1       0x1d
+#define REG_MODEM_CONFIG_2       0x1e
+#define REG_PAYLOAD_LENGTH       0x22
+#define REG_RSSI_WIDEBAND        0x2c
+#define REG_SYNC_WORD            0x39
+#define REG_DIO_MAPPING_1        0x40
+#define REG_VERSION              0x42
+
+// modes
+#define MODE_LONG_RANGE_MODE     0x80
+#define MODE_MASK                0x07
+#define MODE_SLEEP               0x00
+#define MODE_STDBY               0x01
+#define MODE_TX                  0x03
+#define MODE_RX_CONTINUOUS       0x05
+#define MODE_RX_SINGLE           0x06
+#define MODE_CAD                 0x07
+
+// IRQ masks
+#define IRQ_TX_DONE_MASK           0x08
+#define IRQ_PAYLOAD_CRC_ERROR_MASK 0x20
+#define IRQ_RX_DONE_MASK           0x40
+#define IRQ_CAD_DONE_MASK          0x04
+#define IRQ_CAD_DETECTED_MASK      0x01
+
+// DIO0 mapping, bits 7:6 of REG_DIO_MAPPING_1
+#define DIO0_RX_DONE  0x00
+#define DIO0_TX_DONE  0x40
+#define DIO0_CAD_DONE 0x80
+
+SX127xEmulator::SX127xEmulator() :
+  _dio0Pin(LORA_DEFAULT_DIO0_PIN)
+{
+  reset();
+  resetCounters();
+}
+
+void SX127xEmulator::reset()
+{
+  memset(_registers, 0, sizeof(_registers));
+  memset(_fifo, 0, sizeof(_fifo));
+  _registers[REG_OP_MODE] = MODE_STDBY;
+  _registers[REG_FIFO_RX_BASE_ADDR] = 0x00;
+  _registers[REG_FIFO_TX_BASE_ADDR] = 0x80;
+  _registers[REG_MODEM_CONFIG_1] = 0x72;
+  _registers[REG_MODEM_CONFIG_2] = 0x70;
+  _registers[REG_PAYLOAD_LENGTH] = 0x01;
+  _registers[REG_SYNC_WORD] = 0x12;
+  _registers[REG_VERSION] = 0x12;
+  _queueHead = 0;
+  _queueCount = 0;
+  _transmittedSize = 0;
+  _transmitCount = 0;
+  _channelBusy = false;
+}
+
+uint8_t SX127xEmulator::transfer(uint8_t address, uint8_t value)
+{
+  _transactions++;
+  _bytes += 2;
+  if (_currentCall >= 0) {
+    _calls[_currentCall].transactions++;
+    _calls[_currentCall].bytes += 2;
+  }
+
+  uint8_t reg = address & 0x7f;
+
+  if ((address & 0x80) == 0) {
+    // read
+    switch (reg) {
+      case REG_FIFO:
+        return _fifo[_registers[REG_FIFO_ADDR_PTR]++];
+      case REG_MODEM_STAT:
+        return _channelBusy ? 0x01 : 0x00;
+      case REG_RSSI_WIDEBAND:
+        return (uint8_t)::random(256);
+      default:
+        return _registers[reg];
+    }
+  }
+
+  // write
+  switch (reg) {
+    case REG_FIFO:
+      _fifo[_registers[REG_FIFO_ADDR_PTR]++] = value;
+      break;
+    case REG_OP_MODE:
+      writeOpMode(value);
+      break;
+    case REG_IRQ_FLAGS:
+      _registers[REG_IRQ_FLAGS] &= ~value; // write one to clear
+      if ((_registers[REG_OP_MODE] & MODE_MASK) == MODE_RX_CONTINUOUS) deliverPacket();
+      break;
+    case REG_FIFO_RX_CURRENT_ADDR:
+    case REG_RX_NB_BYTES:
+    case REG_MODEM_STAT:
+    case REG_PKT_SNR_VALUE:
+    case REG_PKT_RSSI_VALUE:
+    case REG_RSSI_VALUE:
+    case REG_VERSION:
+      break; // read-only
+    default:
+      _registers[reg] = value;
+      break;
+  }
+
+  return 0;
+}
+
+void SX127xEmulator::writeOpMode(uint8_t value)
+{
+  _registers[REG_OP_MODE] = value;
+
+  switch (value & MODE_MASK) {
+    case MODE_TX: {
+      // The modem sends PayloadLength bytes starting at FifoTxBaseAddr.
+      uint8_t address = _registers[REG_FIFO_TX_BASE_ADDR];
+      _transmittedSize = _registers[REG_PAYLOAD_LENGTH];
+      for (uint8_t i = 0; i < _transmittedSize; i++) _transmitted[i] = _fifo[(uint8_t)(address + i)];
+      _transmitCount++;
+      _registers[REG_OP_MODE] = (value & ~MODE_MASK) | MODE_STDBY;
+      _registers[REG_IRQ_FLAGS] |= IRQ_TX_DONE_MASK;
+      raiseDio0(IRQ_TX_DONE_MASK);
+      break;
+    }
+
+    case MODE_RX_CONTINUOUS:
+    case MODE_RX_SINGLE:
+      deliverPacket();
+      break;
+
+    case MODE_CAD:
+      _registers[REG_OP_MODE] = (value & ~MODE_MASK) | MODE_STDBY;
+      _registers[REG_IRQ_FLAGS] |= IRQ_CAD_DONE_MASK | (_channelBusy ? IRQ_CAD_DETECTED_MASK : 0);
+      raiseDio0(IRQ_CAD_DONE_MASK);
+      break;
+  }
+}
+
+// Moves the oldest queued packet into the FIFO if the chip is receiving
+// and the previous packet has been acknowledged.
+void SX127xEmulator::deliverPacket()
+{
+  uint8_t mode = _registers[REG_OP_MODE] & MODE_MASK;
+  if (mode != MODE_RX_CONTINUOUS && mode != MODE_RX_SINGLE) return;
+  if (_queueCount == 0 || (_registers[REG_IRQ_FLAGS] & IRQ_RX_DONE_MASK)) return;
+
+  QueuedPacket &packet = _queue[_queueHead];
+  _queueHead = (_queueHead + 1) % SX127X_EMULATOR_MAX_QUEUED_PACKETS;
+  _queueCount--;
+
+  uint8_t address = _registers[REG_FIFO_RX_BASE_ADDR];
+  for (uint16_t i = 0; i < packet.size; i++) _fifo[(uint8_t)(address + i)] = packet.data[i];
+  _registers[REG_FIFO_RX_CURRENT_ADDR] = address;
+  _registers[REG_RX_NB_BYTES] = packet.size;
+  _registers[REG_PKT_SNR_VALUE] = (uint8_t)packet.snr;
+  _registers[REG_PKT_RSSI_VALUE] = packet.rssi;
+  _registers[REG_IRQ_FLAGS] |= IRQ_RX_DONE_MASK | (packet.crcError ? IRQ_PAYLOAD_CRC_ERROR_MASK : 0);
+
+  if (mode == MODE_RX_SINGLE) _registers[REG_OP_MODE] = (_registers[REG_OP_MODE] & ~MODE_MASK) | MODE_STDBY;
+
+  raiseDio0(IRQ_RX_DONE_MASK);
+}
+
+void SX127xEmulator::raiseDio0(uint8_t irq)
+{
+  uint8_t mapping = _registers[REG_DIO_MAPPING_1] & 0xc0;
+  if ((irq == IRQ_RX_DONE_MASK && mapping == DIO0_RX_DONE) ||
+      (irq == IRQ_TX_DONE_MASK && mapping == DIO0_TX_DONE) ||
+      (irq == IRQ_CAD_DONE_MASK && mapping == DIO0_CAD_DONE)) {
+    HostRaiseInterrupt(_dio0Pin);
+  }
+}
+
+bool SX127xEmulator::injectPacket(const uint8_t *buffer, uint8_t size, bool crcError,
+                                  int8_t snr, uint8_t rssi)
+{
+  if (_queueCount == SX127X_EMULATOR_MAX_QUEUED_PACKETS) return false;
+
+  QueuedPacket &packet = _queue[(_queueHead + _queueCount) % SX127X_EMULATOR_MAX_QUEUED_PACKETS];
+  memcpy(packet.data, buffer, size);
+  packet.size = size;
+  packet.crcError = crcError;
+  packet.snr = snr;
+  packet.rssi = rssi;
+  _queueCount++;
+
+  deliverPacket();
+  return true;
+}
+
+void SX127xEmulator::setChannelBusy(bool busy) { _channelBusy = busy; }
+
+uint8_t SX127xEmulator::lastTransmitted(uint8_t *buffer)
+{
+  memcpy(buffer, _transmitted, _transmittedSize);
+  return _transmittedSize;
+}
+
+uint32_t SX127xEmulator::transmitCount() { return _transmitCount; }
+
+void SX127xEmulator::setDio0Pin(uint8_t pin) { _dio0Pin = pin; }
+
+uint8_t SX127xEmulator::peekRegister(uint8_t address) { return _registers[address & 0x7f]; }
+uint8_t SX127xEmulator::peekFifo(uint8_t address) { return _fifo[address]; }
+
+void SX127xEmulator::beginCall(const char *name)
+{
+  if (_callDepth++ > 0) return;
+
+  for (uint8_t i = 0; i < _numCalls; i++) {
+    if (strcmp(_calls[i].name, name) == 0) {
+      _currentCall = i;
+      _calls[i].calls++;
+      return;
+    }
+  }
+
+  if (_numCalls == SX127X_EMULATOR_MAX_API_CALLS) {
+    _currentCall = -1;
+    return;
+  }
+
+  _currentCall = _numCalls++;
+  _calls[_currentCall].name = name;
+  _calls[_currentCall].calls = 1;
+  _calls[_currentCall].transactions = 0;
+  _calls[_currentCall].bytes = 0;
+}
+
+void SX127xEmulator::endCall()
+{
+  if (_callDepth > 0 && --_callDepth == 0) _currentCall = -1;
+}
+
+void SX127xEmulator::resetCounters()
+{
+  _numCalls = 0;
+  _currentCall = -1;
+  _callDepth = 0;
+  _transactions = 0;
+  _bytes = 0;
+}
+
+uint32_t SX127xEmulator::transactions() { return _transactions; }
+uint32_t SX127xEmulator::bytes() { return _bytes; }
+
+// Comma-separated so that reports can be compared between commits.
+void SX127xEmulator::printReport(Stream &out)
+{
+  out.println("call,calls,transactions,bytes,transactions_per_call,bytes_per_call");
+  for (uint8_t i = 0; i < _numCalls; i++) {
+    CallCost &c = _calls[i];
+    out.print(c.name); out.print(',');
+    out.print((unsigned long)c.calls); out.print(',');
+    out.print((unsigned long)c.transactions); out.print(',');
+    out.print((unsigned long)c.bytes); out.print(',');
+    out.print((double)c.transactions / c.calls); out.print(',');
+    out.println((double)c.bytes / c.calls);
+  }
+  out.print("total,,"); out.print((unsigned long)_transactions);
+  out.print(','); out.println((unsigned long)_bytes);
+}
+
+SX127xEmulator SX127x;
+
+#endif
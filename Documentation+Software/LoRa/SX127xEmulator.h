@@ -0,0 +1,112 @@
+// Register-level SX127x emulator.
+// Used when the LoRa library is compiled on a PC with LORA_EMULATOR defined.
+// LoRaClass::singleTransfer() then talks to this register file instead of SPI.
+// Models the FIFO, IRQ flags, operating modes, RX byte count, CAD and DIO0.
+// Counts SPI transactions and bytes per LoRaClass API call.
+
+#ifndef SX127X_EMULATOR_H
+#define SX127X_EMULATOR_H
+
+#ifdef LORA_EMULATOR
+
+#include <Arduino.h>
+
+#define SX127X_EMULATOR_MAX_QUEUED_PACKETS 8
+#define SX127X_EMULATOR_MAX_API_CALLS      48
+
+class SX127xEmulator {
+public:
+  SX127xEmulator();
+
+  // Power-on state of the register file.
+  void reset();
+
+  // One SPI frame: address byte (bit 7 set for write) then data byte.
+  uint8_t transfer(uint8_t address, uint8_t value);
+
+  // Radio side. A packet "arrives over the air".
+  // It is delivered into the FIFO when the chip is next in a receive mode.
+  bool injectPacket(const uint8_t *buffer, uint8_t size, bool crcError = false,
+                    int8_t snr = 40, uint8_t rssi = 100);
+
+  // Channel state reported by CAD and REG_MODEM_STAT.
+  void setChannelBusy(bool busy);
+
+  // Last frame put on the air by a TX.
+  uint8_t lastTransmitted(uint8_t *buffer);
+  uint32_t transmitCount();
+
+  // Pin raised when DIO0 fires. Dispatched through attachInterrupt().
+  void setDio0Pin(uint8_t pin);
+
+  // Direct register access for test benches. Not counted.
+  uint8_t peekRegister(uint8_t address);
+  uint8_t peekFifo(uint8_t address);
+
+  // SPI accounting.
+  // beginCall()/endCall() bracket one LoRaClass API call.
+  // Nested calls are charged to the outermost call.
+  void beginCall(const char *name);
+  void endCall();
+  void resetCounters();
+  uint32_t transactions();
+  uint32_t bytes();
+  void printReport(Stream &out);
+
+private:
+  void writeOpMode(uint8_t value);
+  void deliverPacket();
+  void raiseDio0(uint8_t irq);
+
+  uint8_t _registers[128];
+  uint8_t _fifo[256];
+
+  struct QueuedPacket {
+    uint8_t data[256];
+    uint8_t size;
+    bool crcError;
+    int8_t snr;
+    uint8_t rssi;
+  };
+  QueuedPacket _queue[SX127X_EMULATOR_MAX_QUEUED_PACKETS];
+  uint8_t _queueHead;
+  uint8_t _queueCount;
+
+  uint8_t _transmitted[256];
+  uint8_t _transmittedSize;
+  uint32_t _transmitCount;
+
+  bool _channelBusy;
+  uint8_t _dio0Pin;
+
+  struct CallCost {
+    const char *name;
+    uint32_t calls;
+    uint32_t transactions;
+    uint32_t bytes;
+  };
+  CallCost _calls[SX127X_EMULATOR_MAX_API_CALLS];
+  uint8_t _numCalls;
+  int _currentCall;
+  uint8_t _callDepth;
+  uint32_t _transactions;
+  uint32_t _bytes;
+};
+
+extern SX127xEmulator SX127x;
+
+// Charges the SPI traffic of the enclosing scope to a named API call.
+class SX127xCallScope {
+public:
+  SX127xCallScope(const char *name) { SX127x.beginCall(name); }
+  ~SX127xCallScope() { SX127x.endCall(); }
+};
+#define LORA_SPI_COST(name) SX127xCallScope _spiCostScope(name)
+
+#else
+
+#define LORA_SPI_COST(name)
+
+#endif
+
+#endif
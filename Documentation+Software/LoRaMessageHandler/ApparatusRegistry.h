@@ -0,0 +1,73 @@
+#pragma once
+
+// Registry of the apparatus (sensors and actuators) a node answers for.
+//
+// Each sketch declares a constant table of Apparatus entries.
+// The apparatus ID is the position in the table, and all request/response
+// nodes need to have the same ID associations. The registry checks this at
+// compile time. At run time a received apparatus ID is looked up with one
+// bounds-checked index, without string comparisons or heap use.
+
+#include <Arduino.h>
+
+enum class ApparatusKind : uint8_t
+{
+  Sensor,
+  Actuator
+};
+
+// How the 32-bit value in a response is to be read.
+enum class PayloadEncoding : uint8_t
+{
+  Float,    // IEEE 754 float, as from memcpy
+  Unsigned, // uint32_t
+  OnOff,    // 0 is OFF, 1 is ON
+  Hundredths // int32_t fixed point, for example 1234 is 12.34
+};
+
+// Serves a request. Takes the request's associated value and fills in the
+// response's. Returns false if the request cannot be served.
+typedef bool (*ApparatusHandler)(uint32_t request, uint32_t& response);
+
+struct Apparatus
+{
+  uint8_t id;
+  ApparatusKind kind;
+  const char* name;
+  ApparatusHandler handler; // NULL if this node does not serve it
+  PayloadEncoding encoding;
+};
+
+class ApparatusRegistry
+{
+
+public:
+
+  template <size_t N>
+  constexpr ApparatusRegistry(const Apparatus (&apparatus)[N]) :
+    table(apparatus), count(N)
+  {
+    static_assert(N < 256, "apparatus IDs are one byte");
+  }
+
+  // Returns the apparatus with this ID, or NULL if there is none.
+  const Apparatus* Find(uint8_t id) const
+  {
+    return id < count ? &table[id] : NULL;
+  }
+
+  constexpr uint8_t Count() const { return count; }
+
+  // True if every entry's ID is its position in the table.
+  // For use in static_assert.
+  constexpr bool Valid(uint8_t position = 0) const
+  {
+    return position == count ||
+           (table[position].id == position && table[position].name != NULL && Valid(position + 1));
+  }
+
+private:
+
+  const Apparatus* table;
+  uint8_t count;
+};
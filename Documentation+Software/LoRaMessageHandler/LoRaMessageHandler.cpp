@@ -5,11 +5,23 @@
 #include "LoRaMessageHandler.h" // class declaration
 
 // Constructor
-LoRaMessageHandler::LoRaMessageHandler(uint8_t nodeAddress)
+LoRaMessageHandler::LoRaMessageHandler(uint16_t nodeAddress)
 {
   // Establish a unique address for this node within the network.
   LOCAL_ADDRESS = nodeAddress;
 
+  // No distances known yet
+  for (uint8_t i = 0; i < GRADIENT_MAX_SINKS; i++)
+    sinkDistances[i].hops = HOP_DISTANCE_UNKNOWN;
+  for (uint8_t i = 0; i < MAX_KNOWN_SOURCES; i++)
+    sourceRelays[i].hops = HOP_DISTANCE_UNKNOWN;
+  for (uint8_t i = 0; i <= MESSAGE_TYPE_MASK; i++)
+    typeRebroadcasts[i] = ADAPTIVE_REBROADCASTS;
+  for (uint8_t i = 0; i < REASSEMBLY_BUFFERS; i++)
+    reassembly[i].count = 0;
+  memset(channelStatistics, 0, sizeof(channelStatistics));
+  memset(&telemetry, 0, sizeof(telemetry));
+
   // Initialize LoRa transceiver.
   // https://github.com/sandeepmistry/arduino-LoRa/blob/master/API.md
   // National Frequencies:
@@ -31,11 +43,13 @@ LoRaMessageHandler::LoRaMessageHandler(uint8_t nodeAddress)
   LoRa.setSpreadingFactor(SPREADING_FACTOR);
   LoRa.setSignalBandwidth(SIGNAL_BANDWIDTH);
   LoRa.enableCrc(); // rejects corrupted messages without notice
+  LoRa.setSyncWord(SYNC_WORD); // rejects other systems' messages
   #ifdef DEBUG
     Serial.print("Frequency: "); Serial.println(FREQUENCY);
     Serial.print("Spreading Factor: "); Serial.println(SPREADING_FACTOR);
     Serial.print("Signal Bandwidth: "); Serial.println(SIGNAL_BANDWIDTH);
     Serial.print("Max message length: "); Serial.println(MAX_MESSAGE_LENGTH);
+    Serial.print("Sync word: 0x"); Serial.println(SYNC_WORD, HEX);
     Serial.print("Node Address: "); Serial.println(LOCAL_ADDRESS);
   #endif
 }
@@ -43,10 +57,12 @@ LoRaMessageHandler::LoRaMessageHandler(uint8_t nodeAddress)
 // Deconstructor
 LoRaMessageHandler::~LoRaMessageHandler()
 {
+  Tasks.Cancel(retryTask);
+  DisableSecurity();
 }
 
 // Starts a message with its header
-bool LoRaMessageHandler::StartMessage(uint8_t messageType, uint8_t destination)
+bool LoRaMessageHandler::StartMessage(uint8_t messageType, uint16_t destination)
 {
   #ifdef DEBUG
     Serial.println("StartMessage. Type " + String(messageType) + " to Node " + String(destination));
@@ -56,18 +72,26 @@ bool LoRaMessageHandler::StartMessage(uint8_t messageType, uint8_t destination)
   sourceMessageID++;
   
   MESSAGE[LOCATION_SYSTEM_ID] = SYSTEM_ID;
-  MESSAGE[LOCATION_SOURCE_ID] = LOCAL_ADDRESS;
-  MESSAGE[LOCATION_DESTINATION_ID] = destination;
+  MESSAGE[LOCATION_SOURCE_ID] = (uint8_t)LOCAL_ADDRESS;
+  MESSAGE[LOCATION_DESTINATION_ID] = (uint8_t)destination;
   MESSAGE[LOCATION_MESSAGE_ID] = (uint8_t)(sourceMessageID >> 8); // high byte
   MESSAGE[LOCATION_MESSAGE_ID + 1] = (uint8_t)((sourceMessageID << 8) >> 8); // low byte
-  MESSAGE[LOCATION_MESSAGE_TYPE] = messageType;
-  MESSAGE[LOCATION_REBROADCASTS] = 05; // number of times to rebroadcast this message
+  uint8_t rebroadcasts = Rebroadcasts(messageType, destination); // number of times to rebroadcast this message
+  MESSAGE[LOCATION_MESSAGE_TYPE] = messageType | (rebroadcasts << MESSAGE_REBROADCASTS_SHIFT);
+  MESSAGE[LOCATION_APPARATUS_ID] = 0; // left out of compact headers
+  MESSAGE[LOCATION_REBROADCASTS] = rebroadcasts;
+  if (gradientRouting) MESSAGE[LOCATION_REBROADCASTS] |= HopField(HopDistance(destination)) << HOP_DISTANCE_SHIFT;
   messageIndex = MESSAGE_HEADER_LENGTH;
+
+  // Addresses that do not fit in a byte need the compact header.
+  format.compact = compactHeader || LOCAL_ADDRESS > 0xFF || destination > 0xFF;
+  format.sourceHigh = (uint8_t)(LOCAL_ADDRESS >> 8);
+  format.destinationHigh = (uint8_t)(destination >> 8);
   return true;
 }
 
 // Send an image segment.
-bool LoRaMessageHandler::SendCameraData(uint8_t* imageSegment, uint8_t destination)
+bool LoRaMessageHandler::SendCameraData(uint8_t* imageSegment, uint16_t destination)
 {
   #ifdef DEBUG
     Serial.println("SendCameraData. Segment Length " + String(imageSegment[0]) + ". To Node " + String(destination));
@@ -75,7 +99,7 @@ bool LoRaMessageHandler::SendCameraData(uint8_t* imageSegment, uint8_t destinati
 
   // Ignore if segment is too long.
   // Should trigger an error message if false is returned.
-  if ((MESSAGE_HEADER_LENGTH + imageSegment[0]) > MAX_MESSAGE_LENGTH)
+  if ((MESSAGE_HEADER_LENGTH + imageSegment[0] + MessageOverhead() + HeaderGrowth(destination)) > MAX_MESSAGE_LENGTH)
     return false;
 
   // Start with the message header.
@@ -90,18 +114,19 @@ bool LoRaMessageHandler::SendCameraData(uint8_t* imageSegment, uint8_t destinati
   #endif
 
   // Create a packet containing the message and broadcast.
+  FinishMessage();
   return BroadcastPacket();
 }
 
 // Send text message.
-bool LoRaMessageHandler::SendTextMessage(String text, uint8_t destination)
+bool LoRaMessageHandler::SendTextMessage(String text, uint16_t destination)
 {
   #ifdef DEBUG
    Serial.println("SendTextMessage. '" + text + "' to Node " + String(destination));
   #endif
 
   // Ignore if text is too long
-  if((MESSAGE_HEADER_LENGTH + text.length()) > MAX_MESSAGE_LENGTH)
+  if((MESSAGE_HEADER_LENGTH + text.length() + MessageOverhead() + HeaderGrowth(destination)) > MAX_MESSAGE_LENGTH)
     return false;
 
   // Start with the message header.
@@ -112,37 +137,279 @@ bool LoRaMessageHandler::SendTextMessage(String text, uint8_t destination)
   memcpy(MESSAGE + MESSAGE_HEADER_LENGTH, (uint8_t*)text.c_str(), text.length());
 
   // Create a packet containing the message and broadcast.
+  FinishMessage();
   return BroadcastPacket();
 }
 
-bool LoRaMessageHandler::SendRequest(uint8_t apparatus, uint32_t associatedValue, uint8_t destination)
+// Send a datagram, one fragment after another.
+// Each fragment is a message of its own, with its own message ID.
+bool LoRaMessageHandler::SendDatagram(const uint8_t* data, uint16_t length, uint16_t destination,
+                                      uint8_t apparatus)
+{
+  if (length == 0 || length > MAX_DATAGRAM_LENGTH) return false;
+
+  uint8_t count = (length + FRAGMENT_DATA_LENGTH - 1) / FRAGMENT_DATA_LENGTH;
+  if (count > MAX_FRAGMENTS) return false;
+  uint16_t datagramID = sourceMessageID + 1; // the first fragment's message ID
+  unsigned long beginTime = millis();
+
+  for (uint8_t index = 0; index < count; index++)
+  {
+    // The queue drains as the channel clears. Past the reassembly
+    // timeout, the destination would drop the datagram anyway.
+    while (queueCount >= TRANSMIT_QUEUE_LENGTH)
+    {
+      if (millis() - beginTime >= REASSEMBLY_TIMEOUT_MS) return false;
+      Wait(CAD_BACKOFF_MS);
+    }
+
+    uint16_t offset = index * FRAGMENT_DATA_LENGTH;
+    uint8_t fragmentLength = length - offset < FRAGMENT_DATA_LENGTH ? length - offset : FRAGMENT_DATA_LENGTH;
+
+    // Start with the message header.
+    StartMessage(7, destination);
+
+    // Add datagram ID, fragment index and count, then the data
+    MESSAGE[LOCATION_APPARATUS_ID] = apparatus;
+    MESSAGE[LOCATION_DATAGRAM_ID] = (uint8_t)(datagramID >> 8); // high byte
+    MESSAGE[LOCATION_DATAGRAM_ID + 1] = (uint8_t)datagramID; // low byte
+    MESSAGE[LOCATION_FRAGMENT_INDEX] = index;
+    MESSAGE[LOCATION_FRAGMENT_COUNT] = count;
+    memcpy(MESSAGE + LOCATION_FRAGMENT_DATA, data + offset, fragmentLength);
+    MESSAGE[LOCATION_MESSAGE_LENGTH] = LOCATION_FRAGMENT_DATA + fragmentLength;
+
+    // Create a packet containing the message and broadcast.
+    FinishMessage();
+    if (!BroadcastPacket()) return false;
+  }
+  return true;
+}
+
+// Send a request. Its ID is this message's ID, which is unique
+// among recent messages from this node.
+bool LoRaMessageHandler::SendRequest(uint8_t apparatus, uint32_t associatedValue, uint16_t destination,
+                                     uint16_t* requestID)
 {
   // Start with the message header.
   StartMessage(1, destination);
 
-  // Add apparatus ID and associated value
-  MESSAGE[LOCATION_APPARATUS_ID] = apparatus;
-  memcpy(MESSAGE + MESSAGE_HEADER_LENGTH, &associatedValue, sizeof(uint32_t));
-  MESSAGE[LOCATION_MESSAGE_LENGTH] = MESSAGE_HEADER_LENGTH + sizeof(uint32_t);
+  // Add request ID, apparatus ID and associated value
+  SetRequestContents(apparatus, associatedValue, sourceMessageID);
+  if (requestID) *requestID = sourceMessageID;
 
   // Create a packet containing the message and broadcast.
+  FinishMessage();
   return BroadcastPacket();
 }
 
-bool LoRaMessageHandler::SendResponse(uint8_t apparatus, uint32_t associatedValue, uint8_t destination)
+// Send a response. requestID is that of the request being answered.
+bool LoRaMessageHandler::SendResponse(uint8_t apparatus, uint32_t associatedValue, uint16_t destination,
+                                      uint16_t requestID)
 {
   // Start with the message header.
   StartMessage(2, destination);
 
-  // Add apparatus ID and associated value
-  MESSAGE[LOCATION_APPARATUS_ID] = apparatus;
-  memcpy(MESSAGE + MESSAGE_HEADER_LENGTH, &associatedValue, sizeof(uint32_t));
-  MESSAGE[LOCATION_MESSAGE_LENGTH] = MESSAGE_HEADER_LENGTH + sizeof(uint32_t);
+  // Add request ID, apparatus ID and associated value
+  SetRequestContents(apparatus, associatedValue, requestID);
+
+  // Create a packet containing the message and broadcast.
+  FinishMessage();
+  return BroadcastPacket();
+}
+
+// Send one request for several apparatus.
+bool LoRaMessageHandler::SendBatchRequest(const uint8_t* apparatus, uint8_t count, uint16_t destination,
+                                          uint16_t* requestID)
+{
+  if (count == 0 || count > MAX_BATCH_COUNT) return false;
+
+  // Start with the message header.
+  StartMessage(4, destination);
+
+  // Add request ID and the list of apparatus IDs
+  SetBatchContents(sourceMessageID, count);
+  memcpy(MESSAGE + LOCATION_BATCH_ENTRIES, apparatus, count);
+  MESSAGE[LOCATION_MESSAGE_LENGTH] = LOCATION_BATCH_ENTRIES + count;
+  if (requestID) *requestID = sourceMessageID;
 
   // Create a packet containing the message and broadcast.
+  FinishMessage();
   return BroadcastPacket();
 }
+
+// Answer a batch request with a value for each apparatus served.
+// apparatus must not point into the received message, which is overwritten.
+bool LoRaMessageHandler::SendBatchResponse(const uint8_t* apparatus, const uint32_t* associatedValues, uint8_t count,
+                                           uint16_t destination, uint16_t requestID)
+{
+  if (count > MAX_BATCH_COUNT) return false;
+
+  // Start with the message header.
+  StartMessage(5, destination);
+
+  // Add request ID and the list of (apparatus ID, associated value)
+  SetBatchContents(requestID, count);
+  uint8_t* entry = MESSAGE + LOCATION_BATCH_ENTRIES;
+  for (uint8_t i = 0; i < count; i++)
+  {
+    entry[0] = apparatus[i];
+    memcpy(entry + 1, &associatedValues[i], sizeof(uint32_t));
+    entry += BATCH_VALUE_LENGTH;
+  }
+  MESSAGE[LOCATION_MESSAGE_LENGTH] = entry - MESSAGE;
+
+  // Create a packet containing the message and broadcast.
+  FinishMessage();
+  return BroadcastPacket();
+}
+
+void LoRaMessageHandler::SetBatchContents(uint16_t requestID, uint8_t count)
+{
+  MESSAGE[LOCATION_APPARATUS_ID] = BATCH_APPARATUS;
+  MESSAGE[LOCATION_REQUEST_ID] = (uint8_t)(requestID >> 8); // high byte
+  MESSAGE[LOCATION_REQUEST_ID + 1] = (uint8_t)requestID; // low byte
+  MESSAGE[LOCATION_BATCH_COUNT] = count;
+}
+
+void LoRaMessageHandler::SetRequestContents(uint8_t apparatus, uint32_t associatedValue, uint16_t requestID)
+{
+  MESSAGE[LOCATION_APPARATUS_ID] = apparatus;
+  MESSAGE[LOCATION_REQUEST_ID] = (uint8_t)(requestID >> 8); // high byte
+  MESSAGE[LOCATION_REQUEST_ID + 1] = (uint8_t)requestID; // low byte
+  memcpy(MESSAGE + LOCATION_ASSOCIATED_VALUE, &associatedValue, sizeof(uint32_t));
+  MESSAGE[LOCATION_MESSAGE_LENGTH] = REQUEST_MESSAGE_LENGTH;
+}
   
+// Adds the authentication tag, then the CRC, as enabled.
+// The CRC covers the tag, so the destination checks the CRC first.
+void LoRaMessageHandler::FinishMessage()
+{
+  SecureMessage();
+  AppendCRC();
+}
+
+// Bytes added to a message by FinishMessage().
+uint8_t LoRaMessageHandler::MessageOverhead()
+{
+  return (cipher ? tagLength : 0) + (endToEndCRC ? MESSAGE_CRC_LENGTH : 0);
+}
+
+// Bytes a compact header adds to a message for destination, over the
+// classic MESSAGE_HEADER_LENGTH. Addresses of 128 and up take two varint
+// bytes or more, and a nonzero apparatus one more. See MessageHeader.h
+uint8_t LoRaMessageHandler::HeaderGrowth(uint16_t destination, uint8_t apparatus)
+{
+  if (!compactHeader && LOCAL_ADDRESS <= 0xFF && destination <= 0xFF) return 0;
+  uint8_t length = COMPACT_HEADER_MIN_LENGTH - 2 + VarintLength(LOCAL_ADDRESS) +
+                   VarintLength(destination) + (apparatus != 0 ? 1 : 0);
+  return length > MESSAGE_HEADER_LENGTH ? length - MESSAGE_HEADER_LENGTH : 0;
+}
+
+void LoRaMessageHandler::EnableCompactHeader(bool enable) { compactHeader = enable; }
+
+void LoRaMessageHandler::EnableEndToEndCRC(bool enable) { endToEndCRC = enable; }
+
+bool LoRaMessageHandler::EnableSecurity(const uint8_t* key, uint8_t tagLength)
+{
+  if (!CCM::ValidTagLength(tagLength)) return false;
+
+  if (!cipher)
+  {
+    cipher = new AES(AESKeyLength::AES_128);
+    ccm = new CCM(*cipher);
+  }
+  cipher->SetKey(key);
+  this->tagLength = tagLength;
+  return true;
+}
+
+void LoRaMessageHandler::DisableSecurity()
+{
+  delete ccm;
+  delete cipher;
+  ccm = NULL;
+  cipher = NULL;
+}
+
+// Nonce for the message in MESSAGE: system, source and message ID,
+// then the high bytes of the addresses, which the header does not
+// authenticate.
+void LoRaMessageHandler::MessageNonce(uint8_t* nonce)
+{
+  memset(nonce, 0, CCM::nonceLen);
+  nonce[0] = MESSAGE[LOCATION_SYSTEM_ID];
+  nonce[1] = MESSAGE[LOCATION_SOURCE_ID];
+  nonce[2] = MESSAGE[LOCATION_MESSAGE_ID];
+  nonce[3] = MESSAGE[LOCATION_MESSAGE_ID + 1];
+  nonce[4] = format.sourceHigh;
+  nonce[5] = format.destinationHigh;
+}
+
+// Encrypts the message contents in place and appends the tag, if enabled.
+// Length and flag are set first because the header is authenticated.
+void LoRaMessageHandler::SecureMessage()
+{
+  if (!cipher) return;
+
+  uint8_t length = MESSAGE[LOCATION_MESSAGE_LENGTH];
+  MESSAGE[LOCATION_MESSAGE_LENGTH] = length + tagLength;
+  MESSAGE[LOCATION_MESSAGE_TYPE] |= MESSAGE_FLAG_SECURE;
+  uint8_t nonce[CCM::nonceLen];
+  MessageNonce(nonce);
+  ccm->Encrypt(nonce, MESSAGE, LOCATION_REBROADCASTS,
+               MESSAGE + MESSAGE_HEADER_LENGTH, length - MESSAGE_HEADER_LENGTH,
+               MESSAGE + length, tagLength);
+}
+
+// Checks the tag and decrypts the message contents in place.
+// On success the tag and flag are removed.
+bool LoRaMessageHandler::OpenMessage()
+{
+  uint8_t length = MESSAGE[LOCATION_MESSAGE_LENGTH];
+  if (!cipher || length < MESSAGE_HEADER_LENGTH + tagLength) return false;
+
+  uint8_t contentLength = length - tagLength;
+  uint8_t nonce[CCM::nonceLen];
+  MessageNonce(nonce);
+  if (!ccm->Decrypt(nonce, MESSAGE, LOCATION_REBROADCASTS,
+                    MESSAGE + MESSAGE_HEADER_LENGTH, contentLength - MESSAGE_HEADER_LENGTH,
+                    MESSAGE + contentLength, tagLength))
+    return false;
+
+  MESSAGE[LOCATION_MESSAGE_LENGTH] = contentLength;
+  MESSAGE[LOCATION_MESSAGE_TYPE] &= ~MESSAGE_FLAG_SECURE;
+  return true;
+}
+
+// CRC of a message of the given length, skipping the rebroadcast counter.
+// The high bytes of long addresses follow, so that short ones check as before.
+uint16_t LoRaMessageHandler::MessageCRC(uint8_t messageLength)
+{
+  CRC16DNP crc;
+  crc.Update(MESSAGE, LOCATION_REBROADCASTS);
+  crc.Update(MESSAGE + LOCATION_REBROADCASTS + 1, messageLength - (LOCATION_REBROADCASTS + 1));
+  if (format.sourceHigh != 0 || format.destinationHigh != 0)
+  {
+    uint8_t high[2] = { format.sourceHigh, format.destinationHigh };
+    crc.Update(high, sizeof(high));
+  }
+  return crc.Value();
+}
+
+// Appends the end-to-end CRC to a fully-formed message, if enabled.
+// Length and flag are set first because both are covered by the CRC.
+void LoRaMessageHandler::AppendCRC()
+{
+  if (!endToEndCRC) return;
+
+  uint8_t length = MESSAGE[LOCATION_MESSAGE_LENGTH];
+  MESSAGE[LOCATION_MESSAGE_LENGTH] = length + MESSAGE_CRC_LENGTH;
+  MESSAGE[LOCATION_MESSAGE_TYPE] |= MESSAGE_FLAG_CRC;
+  uint16_t crc = MessageCRC(length);
+  MESSAGE[length] = (uint8_t)(crc >> 8); // high byte
+  MESSAGE[length + 1] = (uint8_t)crc; // low byte
+}
+
 // Send a packet.
 bool LoRaMessageHandler::BroadcastPacket()
 {
@@ -151,81 +418,1101 @@ bool LoRaMessageHandler::BroadcastPacket()
   #endif
 
   // Try next channel activity detection.
-  // Transmit if no signal detected.
-  while (LoRa.rxSignalDetected()) Wait(100); // wait for clear channel
-  LoRa.beginPacket();                        // start packet
-  LoRa.write(MESSAGE, MESSAGE[LOCATION_MESSAGE_LENGTH]); // add contents
-  //Serial.println("Trying to end packet");
-  LoRa.endPacket();                          // finish packet and send it
+  // Transmit if no signal detected, nothing is queued ahead,
+  // and, with TDMA, it is the message's slot.
+  Retune();
+  unsigned long delay = 0;
+  if (queueCount == 0) delay = SlotDelay(SlotFor(MESSAGE, format), FrameLength(MESSAGE, format));
+  if (queueCount == 0 && delay == 0)
+  {
+    if (!LoRa.rxSignalDetected())
+    {
+      Transmit(MESSAGE, format);
+      return true;
+    }
+    telemetry.channelBusy++;
+  }
+
+  // Queue until the channel is clear.
+  if (queueCount == TRANSMIT_QUEUE_LENGTH)
+  {
+    telemetry.dropped[TELEMETRY_DROP_QUEUE]++;
+    return false;
+  }
+  uint8_t slot = (queueHead + queueCount) % TRANSMIT_QUEUE_LENGTH;
+  memcpy(transmitQueue[slot], MESSAGE, MESSAGE[LOCATION_MESSAGE_LENGTH]);
+  transmitFormat[slot] = format;
+  if (queueCount++ == 0) Retry(delay > 0 ? delay : CAD_BACKOFF_MS);
+  if (queueCount > telemetry.queueHighWater) telemetry.queueHighWater = queueCount;
   #ifdef DEBUG
-        Serial.print("Sent message of length "); Serial.println(MESSAGE[LOCATION_MESSAGE_LENGTH]);
+    Serial.println("Channel busy or not our slot. Queued message " + String(queueCount));
   #endif
 
   return true;
 }
 
+// Sends a message kept in the classic layout, with the header it is to have.
+void LoRaMessageHandler::Transmit(const uint8_t* message, const MessageFormat& messageFormat)
+{
+  fifoLength = 0; // overwritten from here on
+  uint8_t frameLength = message[LOCATION_MESSAGE_LENGTH];
+  Retune(SlotChannel(NetworkTime()));
+  LoRa.beginPacket();                                    // start packet
+  if (!messageFormat.compact)
+    LoRa.write(message, MESSAGE_HEADER_LENGTH);          // add header
+  else
+  {
+    uint8_t frame[COMPACT_HEADER_MAX_LENGTH];
+    uint8_t headerLength = CompactHeader(message, messageFormat, frame);
+    LoRa.write(frame, headerLength);
+    frameLength = frameLength - MESSAGE_HEADER_LENGTH + headerLength;
+  }
+
+  // add contents, with the time in beacons brought up to now
+  const uint8_t* contents = message + MESSAGE_HEADER_LENGTH;
+  uint8_t contentLength = message[LOCATION_MESSAGE_LENGTH] - MESSAGE_HEADER_LENGTH;
+  if (TimedBeacon(message))
+  {
+    uint8_t time[BEACON_TIME_LENGTH];
+    StampBeacon(message, time);
+    LoRa.write(time, BEACON_TIME_LENGTH);
+    contents += BEACON_TIME_LENGTH;
+    contentLength -= BEACON_TIME_LENGTH;
+  }
+  LoRa.write(contents, contentLength);
+  uint32_t start = NetworkTime();
+  LoRa.endPacket();                                      // finish packet and send it
+  SlotSent(SlotFor(message, messageFormat), start, frameLength);
+  CountAirtime(channel, frameLength, true);
+  telemetry.sent++;
+  #ifdef DEBUG
+        Serial.print("Sent message of length "); Serial.println(message[LOCATION_MESSAGE_LENGTH]);
+  #endif
+}
+
+// Sends queued messages while the channel is clear.
+// Tries again after CAD_BACKOFF_MS if it is not.
+void LoRaMessageHandler::TransmitQueued()
+{
+  Tasks.Cancel(retryTask);
+  retryTask = TaskScheduler::NO_TASK;
+
+  Retune();
+  while (queueCount > 0)
+  {
+    const uint8_t* message = transmitQueue[queueHead];
+    unsigned long delay = SlotDelay(SlotFor(message, transmitFormat[queueHead]),
+                                    FrameLength(message, transmitFormat[queueHead]));
+    if (delay == 0 && LoRa.rxSignalDetected())
+    {
+      telemetry.channelBusy++;
+      delay = CAD_BACKOFF_MS;
+    }
+    if (delay > 0)
+    {
+      Retry(delay);
+      return;
+    }
+    Transmit(message, transmitFormat[queueHead]);
+    queueHead = (queueHead + 1) % TRANSMIT_QUEUE_LENGTH;
+    queueCount--;
+  }
+}
+
+void LoRaMessageHandler::Retry(unsigned long delay)
+{
+  retryTime = millis() + delay;
+  telemetry.backoff += delay;
+  retryTask = Tasks.After(delay, RetryTask, this);
+}
+
+void LoRaMessageHandler::RetryTask(void* handler)
+{
+  ((LoRaMessageHandler*)handler)->TransmitQueued();
+}
+
+// Writes the compact header of a message kept in the classic layout.
+// Returns its length.
+uint8_t LoRaMessageHandler::CompactHeader(const uint8_t* message, const MessageFormat& messageFormat, uint8_t* frame)
+{
+  MessageHeader header;
+  header.system = message[LOCATION_SYSTEM_ID];
+  header.source = (uint16_t)((messageFormat.sourceHigh << 8) | message[LOCATION_SOURCE_ID]);
+  header.destination = (uint16_t)((messageFormat.destinationHigh << 8) | message[LOCATION_DESTINATION_ID]);
+  header.messageID = (uint16_t)((message[LOCATION_MESSAGE_ID] << 8) | message[LOCATION_MESSAGE_ID + 1]);
+  header.type = message[LOCATION_MESSAGE_TYPE];
+  header.apparatus = message[LOCATION_APPARATUS_ID];
+  header.rebroadcasts = message[LOCATION_REBROADCASTS];
+  return EncodeCompactHeader(header, SYSTEM_ID, frame);
+}
+
+// Length of a message on the air
+uint8_t LoRaMessageHandler::FrameLength(const uint8_t* message, const MessageFormat& messageFormat)
+{
+  if (!messageFormat.compact) return message[LOCATION_MESSAGE_LENGTH];
+  uint8_t frame[COMPACT_HEADER_MAX_LENGTH];
+  return message[LOCATION_MESSAGE_LENGTH] - MESSAGE_HEADER_LENGTH + CompactHeader(message, messageFormat, frame);
+}
+
 // Look for an incoming packet. Parse if present.
 // Contents exists in MESSAGE if packet for this node.
 // Returns:  0 if no message present
 //          -1 if message present but not for this node
+//          -2 if message for this node failed its end-to-end CRC
+//             or could not be authenticated
 //          >0 if message present and for this node
+// A message that passes its end-to-end CRC is returned without it.
+// A secured message is returned decrypted, without its tag.
+// The message type is returned without the initial rebroadcast count.
 int LoRaMessageHandler::CheckForIncomingPacket()
 {
+  // A frame waiting in the radio came in on the channel tuned to so far.
+  uint8_t listening = channel;
+
+  // Sketches that do not run the scheduler still get queued messages sent.
+  if (queueCount > 0 && (long)(millis() - retryTime) >= 0) TransmitQueued();
+
+  // The datagram returned last time is done with.
+  if (datagram)
+  {
+    datagram->count = 0;
+    datagram = NULL;
+  }
+
   // actually not the size of the whole packet, just the message contents
+  fifoLength = 0;
+  Retune();
   int messageSize = LoRa.parsePacket();
 
   // download the message contents
   if(messageSize > 0)
   {
-    if(messageSize < MESSAGE_HEADER_LENGTH ||
+    CountAirtime(listening, messageSize, false);
+    telemetry.received++;
+    if(messageSize < COMPACT_HEADER_MIN_LENGTH ||
        messageSize > MAX_MESSAGE_LENGTH)
     {
       for(int i = 0; i < messageSize; i++) LoRa.read();
+      telemetry.dropped[TELEMETRY_DROP_SIZE]++;
       return -1;
     }
-    
-    for(int i = 0; i < MESSAGE_HEADER_LENGTH; i++)
-      MESSAGE[i] = LoRa.read();
+
+    // From here on, messageSize is that of the message in the classic layout.
+    int frameSize = messageSize;
+    messageSize = ReadHeader(frameSize);
+
+    // A header that cannot be read, or another system that happens to
+    // share the sync word
+    if (messageSize < 0 || MESSAGE[LOCATION_SYSTEM_ID] != SYSTEM_ID)
+    {
+      for(int i = frameRead; i < frameSize; i++) LoRa.read();
+      telemetry.dropped[messageSize < 0 ? TELEMETRY_DROP_SIZE : TELEMETRY_DROP_NOT_FOR_ME]++;
+      return -1;
+    }
+
+    // Every node learns distances, whoever the message is for.
+    CheckSlot(frameSize);
+    LearnRelays();
+    if ((MESSAGE[LOCATION_MESSAGE_TYPE] & MESSAGE_TYPE_MASK) == 6)
+    {
+      if (LearnTime(frameSize)) LearnSchedule(frameSize);
+      LearnRoute();
+    }
 
     // if the message is not for this node, ignore
-    if (MESSAGE[LOCATION_DESTINATION_ID] != LOCAL_ADDRESS &&
+    if (getDestinationAddress() != LOCAL_ADDRESS &&
         LOCAL_ADDRESS != 00) // relays have address 0
     {
       #ifdef DEBUG
         Serial.println("This message is not for me.");
       #endif
     
-      for(int i = MESSAGE_HEADER_LENGTH; i < messageSize; i++) LoRa.read();
+      for(int i = frameRead; i < frameSize; i++) LoRa.read();
+      telemetry.dropped[TELEMETRY_DROP_NOT_FOR_ME]++;
       return -1;
     }
 
     // message is for this node
 
-    for(int i = MESSAGE_HEADER_LENGTH; i < messageSize; i++)
-      MESSAGE[i] = LoRa.read();
+    for(int i = frameRead; i < frameSize; i++)
+      MESSAGE[i - frameHeaderLength + MESSAGE_HEADER_LENGTH] = LoRa.read();
+
+    // Check the end-to-end CRC at the destination only.
+    // Relays pass messages on untouched.
+    if ((MESSAGE[LOCATION_MESSAGE_TYPE] & MESSAGE_FLAG_CRC) &&
+        getDestinationAddress() == LOCAL_ADDRESS &&
+        LOCAL_ADDRESS != 00)
+    {
+      uint8_t length = MESSAGE[LOCATION_MESSAGE_LENGTH];
+      if (length != messageSize ||
+          length < MESSAGE_HEADER_LENGTH + MESSAGE_CRC_LENGTH ||
+          MessageCRC(length - MESSAGE_CRC_LENGTH) !=
+            (uint16_t)((MESSAGE[length - 2] << 8) | MESSAGE[length - 1]))
+      {
+        #ifdef DEBUG
+          Serial.println("End-to-end CRC failed. Message rejected.");
+        #endif
+        telemetry.dropped[TELEMETRY_DROP_INVALID]++;
+        return -2;
+      }
+
+      MESSAGE[LOCATION_MESSAGE_LENGTH] = length - MESSAGE_CRC_LENGTH;
+      MESSAGE[LOCATION_MESSAGE_TYPE] &= ~MESSAGE_FLAG_CRC;
+      messageSize -= MESSAGE_CRC_LENGTH;
+    }
+
+    // Authenticate and decrypt at the destination only.
+    // With security on, a message without a tag is rejected too, or anyone
+    // could forge one by leaving the flag clear. Beacons are not sealed.
+    if ((cipher || (MESSAGE[LOCATION_MESSAGE_TYPE] & MESSAGE_FLAG_SECURE)) &&
+        (MESSAGE[LOCATION_MESSAGE_TYPE] & MESSAGE_TYPE_MASK) != 6 &&
+        getDestinationAddress() == LOCAL_ADDRESS &&
+        LOCAL_ADDRESS != 00)
+    {
+      if (!(MESSAGE[LOCATION_MESSAGE_TYPE] & MESSAGE_FLAG_SECURE) ||
+          MESSAGE[LOCATION_MESSAGE_LENGTH] != messageSize || !OpenMessage())
+      {
+        #ifdef DEBUG
+          Serial.println("Message not authenticated. Message rejected.");
+        #endif
+        telemetry.dropped[TELEMETRY_DROP_INVALID]++;
+        return -2;
+      }
+
+      messageSize -= tagLength;
+    }
+
+    // The initial rebroadcast count is of no further use at the destination.
+    if (getDestinationAddress() == LOCAL_ADDRESS && LOCAL_ADDRESS != 00)
+      MESSAGE[LOCATION_MESSAGE_TYPE] &= ~MESSAGE_REBROADCASTS_MASK;
 
     #ifdef DEBUG
-      Serial.println("Received from: 0x" + String(MESSAGE[LOCATION_SOURCE_ID], HEX));
-      Serial.println("Sent to: 0x" + String(MESSAGE[LOCATION_DESTINATION_ID], HEX));
+      Serial.println("Received from: 0x" + String(getSourceAddress(), HEX));
+      Serial.println("Sent to: 0x" + String(getDestinationAddress(), HEX));
       Serial.println("Message length: " + String(messageSize));
       Serial.print("RSSI: " + String(LoRa.packetRssi()));
       Serial.println("   Snr: " + String(LoRa.packetSnr()));
       Serial.println();
     #endif
+
+    // Fragments are held until their datagram is complete.
+    if ((MESSAGE[LOCATION_MESSAGE_TYPE] & MESSAGE_TYPE_MASK) == 7 &&
+        getDestinationAddress() == LOCAL_ADDRESS &&
+        LOCAL_ADDRESS != 00)
+    {
+      messageSize = Reassemble(messageSize);
+      if (messageSize < 0) telemetry.dropped[TELEMETRY_DROP_INVALID]++;
+    }
   }
   
   return messageSize;
 }
 
+// Adds the fragment in MESSAGE to its datagram.
+// Returns messageSize when that completes the datagram, 0 when more
+// fragments are to come, and -1 when the fragment does not fit.
+int LoRaMessageHandler::Reassemble(int messageSize)
+{
+  uint8_t length = MESSAGE[LOCATION_MESSAGE_LENGTH];
+  if (length < LOCATION_FRAGMENT_DATA) return -1;
+
+  uint8_t index = MESSAGE[LOCATION_FRAGMENT_INDEX];
+  uint8_t count = MESSAGE[LOCATION_FRAGMENT_COUNT];
+  uint8_t dataLength = length - LOCATION_FRAGMENT_DATA;
+  uint16_t offset = index * FRAGMENT_DATA_LENGTH;
+  if (count == 0 || count > MAX_FRAGMENTS || index >= count ||
+      (index < count - 1 && dataLength != FRAGMENT_DATA_LENGTH) ||
+      offset + dataLength > MAX_DATAGRAM_LENGTH)
+    return -1;
+
+  uint16_t datagramID = (uint16_t)((MESSAGE[LOCATION_DATAGRAM_ID] << 8) | MESSAGE[LOCATION_DATAGRAM_ID + 1]);
+  Reassembly* buffer = FindReassembly(getSourceAddress(), datagramID);
+  if (buffer->count == 0)
+  {
+    buffer->source = getSourceAddress();
+    buffer->datagramID = datagramID;
+    buffer->count = count;
+    buffer->received = 0;
+    buffer->length = 0;
+  }
+  else if (buffer->count != count) return -1;
+  buffer->heard = millis();
+
+  uint16_t bit = (uint16_t)1 << index;
+  if (buffer->received & bit) return 0; // a copy, already in
+  buffer->received |= bit;
+  memcpy(buffer->data + offset, MESSAGE + LOCATION_FRAGMENT_DATA, dataLength);
+  if (index == count - 1) buffer->length = offset + dataLength;
+
+  if (buffer->received != (uint16_t)((1UL << count) - 1)) return 0;
+  datagram = buffer;
+  return messageSize;
+}
+
+// The buffer for a datagram. A new datagram gets a free buffer, one that
+// has timed out, or else the one heard from least recently, with count 0.
+LoRaMessageHandler::Reassembly* LoRaMessageHandler::FindReassembly(uint16_t source, uint16_t datagramID)
+{
+  unsigned long now = millis();
+  Reassembly* oldest = &reassembly[0];
+  for (uint8_t i = 0; i < REASSEMBLY_BUFFERS; i++)
+  {
+    Reassembly* buffer = &reassembly[i];
+    if (buffer->count != 0 && now - buffer->heard >= REASSEMBLY_TIMEOUT_MS) buffer->count = 0;
+    if (buffer->count != 0 && buffer->source == source && buffer->datagramID == datagramID)
+      return buffer;
+    if (oldest->count != 0 &&
+        (buffer->count == 0 || (long)(buffer->heard - oldest->heard) < 0))
+      oldest = buffer;
+  }
+  oldest->count = 0;
+  return oldest;
+}
+
 // Wait for a specific number of milliseconds.
 // delay() is blocking so we do not use that.
-// This approach does not use hardware-specific timers.
+// Scheduled tasks run, and the node idles, while waiting.
 void LoRaMessageHandler::Wait(long milliseconds)
 {
-  long beginTime = millis();
-  uint8_t doSomething = 00;
-  while ((millis() - beginTime) <= milliseconds) doSomething++;
+  if (milliseconds > 0) Tasks.Wait(milliseconds);
 }
 
 const uint8_t* LoRaMessageHandler::getMESSAGE() { return (const uint8_t*)MESSAGE; }
-void LoRaMessageHandler::RelayMessage() { MESSAGE[LOCATION_REBROADCASTS] -= 1; BroadcastPacket(); }
+
+uint16_t LoRaMessageHandler::getSourceAddress()
+{
+  return (uint16_t)((format.sourceHigh << 8) | MESSAGE[LOCATION_SOURCE_ID]);
+}
+
+uint16_t LoRaMessageHandler::getDestinationAddress()
+{
+  return (uint16_t)((format.destinationHigh << 8) | MESSAGE[LOCATION_DESTINATION_ID]);
+}
+
+const uint8_t* LoRaMessageHandler::getDatagram() { return datagram ? datagram->data : NULL; }
+uint16_t LoRaMessageHandler::getDatagramLength() { return datagram ? datagram->length : 0; }
+
+uint16_t LoRaMessageHandler::getRequestID()
+{
+  return (uint16_t)((MESSAGE[LOCATION_REQUEST_ID] << 8) | MESSAGE[LOCATION_REQUEST_ID + 1]);
+}
+
+uint32_t LoRaMessageHandler::getAssociatedValue()
+{
+  uint32_t associatedValue;
+  memcpy(&associatedValue, MESSAGE + LOCATION_ASSOCIATED_VALUE, sizeof(uint32_t));
+  return associatedValue;
+}
+
+// Checks the count against the message length, so that the
+// entries can be read without further bounds checks.
+uint8_t LoRaMessageHandler::getBatchCount()
+{
+  uint8_t type = MESSAGE[LOCATION_MESSAGE_TYPE] & MESSAGE_TYPE_MASK;
+  uint8_t length = MESSAGE[LOCATION_MESSAGE_LENGTH];
+  if ((type != 4 && type != 5) || length < LOCATION_BATCH_ENTRIES) return 0;
+
+  uint8_t count = MESSAGE[LOCATION_BATCH_COUNT];
+  uint8_t entryLength = type == 4 ? 1 : BATCH_VALUE_LENGTH;
+  if (count > (length - LOCATION_BATCH_ENTRIES) / entryLength) return 0;
+  return count;
+}
+
+uint8_t LoRaMessageHandler::getBatchApparatus(uint8_t index)
+{
+  if ((MESSAGE[LOCATION_MESSAGE_TYPE] & MESSAGE_TYPE_MASK) == 4)
+    return MESSAGE[LOCATION_BATCH_ENTRIES + index];
+  return MESSAGE[LOCATION_BATCH_ENTRIES + index * BATCH_VALUE_LENGTH];
+}
+
+uint32_t LoRaMessageHandler::getBatchValue(uint8_t index)
+{
+  uint32_t associatedValue;
+  memcpy(&associatedValue, MESSAGE + LOCATION_BATCH_ENTRIES + index * BATCH_VALUE_LENGTH + 1, sizeof(uint32_t));
+  return associatedValue;
+}
+
+// Beacons carry the relay's own distance onwards, so that nodes farther
+// out learn theirs. Other messages are held back, with gradient routing,
+// when the node they came from was no farther from the sink than this one.
+// Reads the header only. Relays need nothing else to decide,
+// and whatever is sent on can go straight from the FIFO.
+int LoRaMessageHandler::CheckForRelayPacket()
+{
+  uint8_t listening = channel;
+  if (queueCount > 0 && (long)(millis() - retryTime) >= 0) TransmitQueued();
+
+  fifoLength = 0;
+  Retune();
+  int frameSize = LoRa.parsePacket();
+  if (frameSize <= 0) return 0;
+  CountAirtime(listening, frameSize, false);
+  telemetry.received++;
+  if (frameSize < COMPACT_HEADER_MIN_LENGTH ||
+      frameSize > MAX_MESSAGE_LENGTH)
+  {
+    telemetry.dropped[TELEMETRY_DROP_SIZE]++;
+    return -1;
+  }
+
+  int messageSize = ReadHeader(frameSize);
+  if (messageSize < 0 || MESSAGE[LOCATION_SYSTEM_ID] != SYSTEM_ID)
+  {
+    telemetry.dropped[messageSize < 0 ? TELEMETRY_DROP_SIZE : TELEMETRY_DROP_NOT_FOR_ME]++;
+    return -1;
+  }
+
+  CheckSlot(frameSize);
+  LearnRelays();
+  if ((MESSAGE[LOCATION_MESSAGE_TYPE] & MESSAGE_TYPE_MASK) == 6)
+  {
+    if (LearnTime(frameSize)) LearnSchedule(frameSize);
+    LearnRoute();
+  }
+
+  fifoLength = frameSize;
+  return messageSize;
+}
+
+// Reads the header of a received frame into MESSAGE, in the classic
+// layout, and notes its format. Contents read along with a compact
+// header are put in place after it.
+// Returns the size of the message in the classic layout, -1 if the
+// header cannot be read.
+int LoRaMessageHandler::ReadHeader(int frameSize)
+{
+  uint8_t frame[COMPACT_HEADER_MAX_LENGTH];
+  frame[0] = LoRa.read();
+  frameRead = 1;
+  if (!IsCompactHeader(frame[0]))
+  {
+    if (frameSize < MESSAGE_HEADER_LENGTH) return -1;
+    MESSAGE[0] = frame[0];
+    for(int i = 1; i < MESSAGE_HEADER_LENGTH; i++)
+      MESSAGE[i] = LoRa.read();
+    frameRead = frameHeaderLength = MESSAGE_HEADER_LENGTH;
+    format.compact = false;
+    format.sourceHigh = 0;
+    format.destinationHigh = 0;
+    return frameSize;
+  }
+
+  // The header is at most COMPACT_HEADER_MAX_LENGTH bytes.
+  while (frameRead < frameSize && frameRead < COMPACT_HEADER_MAX_LENGTH)
+    frame[frameRead++] = LoRa.read();
+  MessageHeader header;
+  frameHeaderLength = DecodeCompactHeader(frame, frameRead, SYSTEM_ID, header);
+  if (frameHeaderLength == 0) return -1;
+
+  int messageSize = frameSize - frameHeaderLength + MESSAGE_HEADER_LENGTH;
+  MESSAGE[LOCATION_MESSAGE_LENGTH] = (uint8_t)messageSize;
+  MESSAGE[LOCATION_SYSTEM_ID] = header.system;
+  MESSAGE[LOCATION_SOURCE_ID] = (uint8_t)header.source;
+  MESSAGE[LOCATION_DESTINATION_ID] = (uint8_t)header.destination;
+  MESSAGE[LOCATION_MESSAGE_ID] = (uint8_t)(header.messageID >> 8); // high byte
+  MESSAGE[LOCATION_MESSAGE_ID + 1] = (uint8_t)header.messageID; // low byte
+  MESSAGE[LOCATION_MESSAGE_TYPE] = header.type;
+  MESSAGE[LOCATION_APPARATUS_ID] = header.apparatus;
+  MESSAGE[LOCATION_REBROADCASTS] = header.rebroadcasts;
+  format.compact = true;
+  format.sourceHigh = (uint8_t)(header.source >> 8);
+  format.destinationHigh = (uint8_t)(header.destination >> 8);
+  memcpy(MESSAGE + MESSAGE_HEADER_LENGTH, frame + frameHeaderLength, frameRead - frameHeaderLength);
+  return messageSize;
+}
+
+bool LoRaMessageHandler::RelayMessage()
+{
+  uint8_t length = fifoLength;
+  fifoLength = 0;
+
+  uint8_t rebroadcasts = MESSAGE[LOCATION_REBROADCASTS] & REBROADCAST_MASK;
+  uint8_t previous = MESSAGE[LOCATION_REBROADCASTS] >> HOP_DISTANCE_SHIFT;
+  if (rebroadcasts == 0)
+  {
+    telemetry.dropped[TELEMETRY_DROP_TTL]++;
+    return false;
+  }
+
+  uint8_t field = 0;
+  if ((MESSAGE[LOCATION_MESSAGE_TYPE] & MESSAGE_TYPE_MASK) == 6)
+    field = HopField(HopDistance(getSourceAddress()));
+  else if (gradientRouting)
+  {
+    field = HopField(HopDistance(getDestinationAddress()));
+    if (field != 0 && previous != 0 && field >= previous)
+    {
+      #ifdef DEBUG
+        Serial.println("Not closer to the destination. Not relayed.");
+      #endif
+      telemetry.dropped[TELEMETRY_DROP_ROUTE]++;
+      return false;
+    }
+  }
+
+  MESSAGE[LOCATION_REBROADCASTS] = (field << HOP_DISTANCE_SHIFT) | (rebroadcasts - 1);
+
+  // Frame still in the FIFO: change the one byte and send it from there.
+  // If it has to wait, the queue needs the whole of it.
+  // The radio stays out of receive until then, or a frame heard meanwhile
+  // would overwrite this one. Hence channelActive(), not rxSignalDetected().
+  if (length > 0)
+  {
+    uint16_t owner = SlotFor(MESSAGE, format);
+    if (queueCount == 0 && SlotDelay(owner, length) == 0 && !LoRa.channelActive())
+    {
+      LoRa.writePacket(format.compact ? COMPACT_LOCATION_REBROADCASTS : LOCATION_REBROADCASTS,
+                       MESSAGE[LOCATION_REBROADCASTS]);
+      if (TimedBeacon(MESSAGE))
+      {
+        uint8_t time[BEACON_TIME_LENGTH];
+        StampBeacon(MESSAGE, time);
+        for (uint8_t i = 0; i < BEACON_TIME_LENGTH; i++)
+          LoRa.writePacket(frameHeaderLength + i, time[i]);
+      }
+      #ifdef DEBUG
+        Serial.print("Relayed from the FIFO, length "); Serial.println(length);
+      #endif
+      uint32_t start = NetworkTime();
+      Retune(SlotChannel(start));
+      bool sent = LoRa.resendPacket();
+      if (sent)
+      {
+        SlotSent(owner, start, length);
+        CountAirtime(channel, length, true);
+        telemetry.sent++;
+      }
+      return sent;
+    }
+    for(int i = frameRead; i < length; i++)
+      MESSAGE[i - frameHeaderLength + MESSAGE_HEADER_LENGTH] = LoRa.read();
+  }
+  return BroadcastPacket();
+}
+
+void LoRaMessageHandler::EnableGradientRouting(bool enable) { gradientRouting = enable; }
+
+// Beacons go to the relays, address 0, and carry the time, and the
+// schedule if this node makes one.
+// The sink is the source, at distance zero. Its clock is network time,
+// so the time field, network time less millis(), is zero.
+bool LoRaMessageHandler::SendBeacon()
+{
+  StartMessage(6, 0);
+  MESSAGE[LOCATION_MESSAGE_LENGTH] = BEACON_LENGTH;
+  MESSAGE[LOCATION_REBROADCASTS] = (HopField(0) << HOP_DISTANCE_SHIFT) | (MESSAGE[LOCATION_REBROADCASTS] & REBROADCAST_MASK);
+  memset(MESSAGE + LOCATION_BEACON_TIME, 0, BEACON_TIME_LENGTH);
+  if (scheduleSink)
+  {
+    uint8_t* schedule = MESSAGE + LOCATION_SCHEDULE;
+    schedule[0] = (uint8_t)(slotLength >> 8);
+    schedule[1] = (uint8_t)slotLength;
+    schedule[2] = superframeSlots;
+    schedule[3] = hopChannels;
+    schedule[4] = assignedSlots;
+    for (uint8_t i = 0; i < assignedSlots; i++)
+    {
+      schedule[SCHEDULE_HEADER_LENGTH + 2 * i] = (uint8_t)(slotOwners[i] >> 8);
+      schedule[SCHEDULE_HEADER_LENGTH + 2 * i + 1] = (uint8_t)slotOwners[i];
+    }
+    MESSAGE[LOCATION_MESSAGE_LENGTH] += SCHEDULE_HEADER_LENGTH + 2 * assignedSlots;
+  }
+  timeSink = true;
+  return BroadcastPacket();
+}
+
+static uint32_t ReadTime(const uint8_t* field)
+{
+  return ((uint32_t)field[0] << 24) | ((uint32_t)field[1] << 16) | ((uint32_t)field[2] << 8) | field[3];
+}
+
+static void WriteTime(uint8_t* field, uint32_t time)
+{
+  field[0] = (uint8_t)(time >> 24);
+  field[1] = (uint8_t)(time >> 16);
+  field[2] = (uint8_t)(time >> 8);
+  field[3] = (uint8_t)time;
+}
+
+bool LoRaMessageHandler::TimedBeacon(const uint8_t* message)
+{
+  return (message[LOCATION_MESSAGE_TYPE] & MESSAGE_TYPE_MASK) == 6 &&
+         message[LOCATION_MESSAGE_LENGTH] >= BEACON_LENGTH;
+}
+
+// Network time now, for a held beacon about to go on the air.
+void LoRaMessageHandler::StampBeacon(const uint8_t* message, uint8_t* time)
+{
+  WriteTime(time, ReadTime(message + LOCATION_BEACON_TIME) + millis());
+}
+
+// Reads a received frame into MESSAGE, up to offset on the air.
+void LoRaMessageHandler::ReadFrame(uint8_t offset)
+{
+  for (; frameRead < offset; frameRead++)
+    MESSAGE[frameRead - frameHeaderLength + MESSAGE_HEADER_LENGTH] = LoRa.read();
+}
+
+// Reads the time in the beacon being received and follows it.
+// The time is taken to be when the beacon is checked for.
+bool LoRaMessageHandler::LearnTime(int frameSize)
+{
+  if (frameSize < frameHeaderLength + BEACON_TIME_LENGTH) return false; // no time in it
+  ReadFrame(frameHeaderLength + BEACON_TIME_LENGTH);
+
+  unsigned long now = millis();
+  uint32_t network = ReadTime(MESSAGE + LOCATION_BEACON_TIME) + (AirTime(frameSize) + 500) / 1000;
+  WriteTime(MESSAGE + LOCATION_BEACON_TIME, network - now); // held from here on
+  if (timeSink || getSourceAddress() == LOCAL_ADDRESS) return false;
+
+  // One sink at a time, and the first copy of each of its beacons
+  uint16_t messageID = (uint16_t)((MESSAGE[LOCATION_MESSAGE_ID] << 8) | MESSAGE[LOCATION_MESSAGE_ID + 1]);
+  bool following = timeSynced && now - syncLocal <= TIME_SYNC_TIMEOUT_MS;
+  if (following && getSourceAddress() != timeSource) return false;
+  if (following && (int16_t)(messageID - timeMessageID) <= 0) return false;
+
+  // How far the estimate had gone off since the latest beacon
+  unsigned long elapsed = now - syncLocal;
+  if (following && elapsed >= TIME_DRIFT_MIN_INTERVAL_MS)
+  {
+    long error = (long)(network - NetworkTimeAt(now));
+    clockDrift += (long)((int64_t)error * 1000000 / (int64_t)elapsed) / TIME_DRIFT_GAIN;
+    if (clockDrift > MAX_CLOCK_DRIFT_PPM) clockDrift = MAX_CLOCK_DRIFT_PPM;
+    if (clockDrift < -MAX_CLOCK_DRIFT_PPM) clockDrift = -MAX_CLOCK_DRIFT_PPM;
+  }
+
+  // Slots are counted on the old time up to here, on the new one after.
+  CountSlots();
+  syncLocal = now;
+  syncNetwork = network;
+  timeSource = getSourceAddress();
+  timeMessageID = messageID;
+  timeSynced = true;
+  slotsCountedTo = network;
+  return true;
+}
+
+unsigned long LoRaMessageHandler::NetworkTimeAt(unsigned long local)
+{
+  unsigned long elapsed = local - syncLocal;
+  return syncNetwork + elapsed + (long)((int64_t)elapsed * clockDrift / 1000000);
+}
+
+unsigned long LoRaMessageHandler::NetworkTime()
+{
+  if (timeSink || !timeSynced) return millis();
+  return NetworkTimeAt(millis());
+}
+
+bool LoRaMessageHandler::TimeSynchronized()
+{
+  return timeSink || (timeSynced && millis() - syncLocal <= TIME_SYNC_TIMEOUT_MS);
+}
+
+// From the SX127x datasheet, for the settings used: explicit header,
+// packet CRC, and the radio's default 8-symbol preamble and coding rate 4/5.
+unsigned long LoRaMessageHandler::AirTime(uint8_t length)
+{
+  const unsigned long symbol = (1UL << SPREADING_FACTOR) * 1000000UL / (unsigned long)SIGNAL_BANDWIDTH;
+  const long lowDataRate = symbol > 16000 ? 1 : 0; // as the radio library sets it
+  long bits = 8L * length - 4 * SPREADING_FACTOR + 28 + 16;
+  long perBlock = 4 * (SPREADING_FACTOR - 2 * lowDataRate);
+  long blocks = bits > 0 ? (bits + perBlock - 1) / perBlock : 0;
+  unsigned long symbols = 8 + blocks * 5;
+  return (8 * 4 + 17) * symbol / 4 + symbols * symbol; // preamble is 8 + 4.25 symbols
+}
+
+void LoRaMessageHandler::StartSchedule(uint8_t slots, uint16_t length, uint8_t relays)
+{
+  if (slots == 0 || slots > TDMA_MAX_SLOTS) slots = TDMA_MAX_SLOTS;
+  CountSlots();
+  slotLength = length > 0 ? length : TDMA_SLOT_MS;
+  relaySlots = relays < slots ? relays : slots - 1;
+  superframeSlots = slots;
+  assignedSlots = 0;
+  slotOwners[assignedSlots++] = LOCAL_ADDRESS;
+  for (uint8_t i = 0; i < relaySlots; i++)
+    slotOwners[assignedSlots++] = TDMA_RELAY_SLOT;
+  tdma = true;
+  scheduleSink = true;
+  timeSink = true;
+}
+
+// Nodes get the next free slot, and relay slots after it.
+// Slots are not taken back.
+uint8_t LoRaMessageHandler::AssignSlot(uint16_t node)
+{
+  if (!scheduleSink || node == TDMA_RELAY_SLOT || node == TDMA_FREE_SLOT) return TDMA_NO_SLOT;
+  for (uint8_t i = 0; i < assignedSlots; i++)
+    if (slotOwners[i] == node) return i;
+  if (assignedSlots + 1 + relaySlots > superframeSlots) return TDMA_NO_SLOT;
+
+  uint8_t slot = assignedSlots;
+  slotOwners[assignedSlots++] = node;
+  for (uint8_t i = 0; i < relaySlots; i++)
+    slotOwners[assignedSlots++] = TDMA_RELAY_SLOT;
+  return slot;
+}
+
+void LoRaMessageHandler::EnableTDMA(bool enable)
+{
+  CountSlots();
+  tdma = enable;
+}
+
+bool LoRaMessageHandler::Scheduled()
+{
+  return tdma && superframeSlots > 0 && TimeSynchronized();
+}
+
+LoRaMessageHandler::SlotStatistics LoRaMessageHandler::getSlotStatistics()
+{
+  CountSlots();
+  return slotStatistics;
+}
+
+// Reads the schedule in the beacon being received, one from the sink
+// followed, and follows it. A beacon without one ends the schedule.
+void LoRaMessageHandler::LearnSchedule(int frameSize)
+{
+  if (!tdma) return;
+  int offset = frameHeaderLength + BEACON_TIME_LENGTH; // of the schedule, on the air
+  if (frameSize < offset + SCHEDULE_HEADER_LENGTH)
+  {
+    CountSlots();
+    superframeSlots = 0;
+    return;
+  }
+  ReadFrame(offset + SCHEDULE_HEADER_LENGTH);
+
+  const uint8_t* schedule = MESSAGE + LOCATION_SCHEDULE;
+  uint16_t length = (uint16_t)((schedule[0] << 8) | schedule[1]);
+  uint8_t slots = schedule[2];
+  uint8_t channels = schedule[3];
+  uint8_t assigned = schedule[4];
+  if (length == 0 || slots == 0 || assigned > slots ||
+      frameSize < offset + SCHEDULE_HEADER_LENGTH + 2 * assigned) return;
+  ReadFrame(offset + SCHEDULE_HEADER_LENGTH + 2 * assigned);
+
+  CountSlots();
+  slotLength = length;
+  superframeSlots = slots;
+  hopChannels = channels < HOP_MAX_CHANNELS ? channels : HOP_MAX_CHANNELS;
+  assignedSlots = assigned < TDMA_MAX_SLOTS ? assigned : TDMA_MAX_SLOTS; // the rest count as free
+  for (uint8_t i = 0; i < assignedSlots; i++)
+    slotOwners[i] = (uint16_t)((schedule[SCHEDULE_HEADER_LENGTH + 2 * i] << 8) | schedule[SCHEDULE_HEADER_LENGTH + 2 * i + 1]);
+}
+
+// Owner of the slot at a network time
+uint16_t LoRaMessageHandler::SlotOwner(uint32_t time)
+{
+  uint8_t slot = (time % ((uint32_t)superframeSlots * slotLength)) / slotLength;
+  return slot < assignedSlots ? slotOwners[slot] : TDMA_FREE_SLOT;
+}
+
+// Owner of the slots a message may be sent in:
+// this node for its own messages, the relays for others'.
+uint16_t LoRaMessageHandler::SlotFor(const uint8_t* message, const MessageFormat& messageFormat)
+{
+  uint16_t source = (uint16_t)((messageFormat.sourceHigh << 8) | message[LOCATION_SOURCE_ID]);
+  return source == LOCAL_ADDRESS ? LOCAL_ADDRESS : TDMA_RELAY_SLOT;
+}
+
+bool LoRaMessageHandler::HasSlot(uint16_t owner)
+{
+  for (uint8_t i = 0; i < assignedSlots; i++)
+    if (slotOwners[i] == owner) return true;
+  return false;
+}
+
+// Whether something from start, for duration milliseconds, is within one
+// slot of owner, guard milliseconds or more from its start.
+bool LoRaMessageHandler::InSlot(uint16_t owner, uint32_t start, unsigned long duration, unsigned long guard)
+{
+  uint32_t into = start % slotLength;
+  return SlotOwner(start) == owner && into >= guard && into + duration <= slotLength;
+}
+
+// Milliseconds until a frame may start in a slot of owner, 0 if now.
+// Always 0 without a schedule, or when owner has no slot.
+// A frame too long for a slot starts near the beginning of one, within
+// a second guard time, so that it runs over as few others as it can.
+unsigned long LoRaMessageHandler::SlotDelay(uint16_t owner, uint8_t frameLength)
+{
+  if (!Scheduled() || !HasSlot(owner)) return 0;
+  unsigned long air = (AirTime(frameLength) + 999) / 1000;
+  bool fits = TDMA_GUARD_MS + air <= slotLength;
+  uint32_t now = NetworkTime();
+  uint32_t into = now % slotLength;
+
+  for (uint16_t k = 0; k <= superframeSlots; k++)
+  {
+    if (SlotOwner(now - into + k * slotLength) != owner) continue;
+    if (k > 0) return k * slotLength - into + TDMA_GUARD_MS;
+    if (into < TDMA_GUARD_MS) return TDMA_GUARD_MS - into;
+    if (fits ? into + air <= slotLength : into < 2 * TDMA_GUARD_MS) return 0;
+  }
+  return 0;
+}
+
+// Counts a frame this node sent from start, network time.
+void LoRaMessageHandler::SlotSent(uint16_t owner, uint32_t start, uint8_t frameLength)
+{
+  if (!Scheduled()) return;
+  CountSlots();
+  if (SlotOwner(start) == LOCAL_ADDRESS)
+  {
+    uint32_t slot = start / slotLength;
+    if (!slotUsed || slot != lastSlotUsed) slotStatistics.slotsUsed++;
+    lastSlotUsed = slot;
+    slotUsed = true;
+  }
+  unsigned long air = (AirTime(frameLength) + 999) / 1000;
+  if (HasSlot(owner) && !InSlot(owner, start, air, TDMA_GUARD_MS)) slotStatistics.sentViolations++;
+}
+
+// Checks that the frame being received came in a slot of its transmitter:
+// the source until a relay has sent it on, a relay after.
+void LoRaMessageHandler::CheckSlot(int frameSize)
+{
+  if (!Scheduled() || getSourceAddress() == LOCAL_ADDRESS) return;
+  uint8_t initial = (MESSAGE[LOCATION_MESSAGE_TYPE] & MESSAGE_REBROADCASTS_MASK) >> MESSAGE_REBROADCASTS_SHIFT;
+  if (initial == 0) initial = DEFAULT_REBROADCASTS;
+  uint16_t owner = (MESSAGE[LOCATION_REBROADCASTS] & REBROADCAST_MASK) >= initial ? getSourceAddress() : TDMA_RELAY_SLOT;
+  if (!HasSlot(owner)) return;
+
+  unsigned long air = (AirTime(frameSize) + 999) / 1000;
+  if (!InSlot(owner, NetworkTime() - air, air, 0)) slotStatistics.heardViolations++;
+}
+
+// Adds the slots of this node's that went by since the last count.
+void LoRaMessageHandler::CountSlots()
+{
+  uint32_t now = NetworkTime();
+  bool scheduled = Scheduled();
+  if (scheduled && now > slotsCountedTo)
+    slotStatistics.slots += OwnSlotsBefore(now) - OwnSlotsBefore(slotsCountedTo);
+  if (!scheduled || (long)(now - slotsCountedTo) > 0) slotsCountedTo = now;
+}
+
+// Slots of this node's that started from network time zero to time
+uint32_t LoRaMessageHandler::OwnSlotsBefore(uint32_t time)
+{
+  uint32_t superframe = (uint32_t)superframeSlots * slotLength;
+  uint8_t current = (time % superframe) / slotLength;
+  uint32_t perSuperframe = 0;
+  uint32_t count = 0;
+  for (uint8_t i = 0; i < assignedSlots; i++)
+  {
+    if (slotOwners[i] != LOCAL_ADDRESS) continue;
+    perSuperframe++;
+    if (i <= current) count++;
+  }
+  return (time / superframe) * perSuperframe + count;
+}
+
+void LoRaMessageHandler::EnableHopping(uint8_t channels)
+{
+  if (channels > HOP_MAX_CHANNELS) channels = HOP_MAX_CHANNELS;
+  hopChannels = channels < 2 ? 0 : channels;
+}
+
+LoRaMessageHandler::ChannelStatistics LoRaMessageHandler::getChannelStatistics(uint8_t channel)
+{
+  return channelStatistics[channel < HOP_MAX_CHANNELS ? channel : HOP_MAX_CHANNELS];
+}
+
+// Channel of the slot at a network time
+uint8_t LoRaMessageHandler::SlotChannel(uint32_t time)
+{
+  if (hopChannels == 0 || !Scheduled()) return HOME_CHANNEL;
+
+  // The sink's slot and the relay slots after it stay home.
+  uint8_t slot = (time % ((uint32_t)superframeSlots * slotLength)) / slotLength;
+  uint8_t home = 1;
+  while (home < assignedSlots && slotOwners[home] == TDMA_RELAY_SLOT) home++;
+  if (slot < home) return HOME_CHANNEL;
+
+  // Mixes the slot number and owner, so neighbouring slots, and the
+  // same slot in successive superframes, land on unrelated channels.
+  uint32_t hash = (time / slotLength) * 0x9E3779B1UL + SlotOwner(time);
+  hash ^= hash >> 16;
+  hash *= 0x85EBCA6BUL;
+  hash ^= hash >> 13;
+  return hash % hopChannels;
+}
+
+void LoRaMessageHandler::Retune(uint8_t to)
+{
+  if (to == channel) return;
+  LoRa.idle(); // takes the new frequency on the way back to receiving
+  LoRa.setFrequency(to == HOME_CHANNEL ? (long)FREQUENCY : (long)(HOP_FIRST_FREQUENCY + to * HOP_CHANNEL_SPACING));
+  channel = to;
+}
+
+// Follows the schedule, unless a frame is coming in.
+void LoRaMessageHandler::Retune()
+{
+  uint8_t to = SlotChannel(NetworkTime());
+  if (to == channel || LoRa.rxSignalDetected()) return;
+  Retune(to);
+}
+
+void LoRaMessageHandler::CountAirtime(uint8_t onChannel, uint8_t frameLength, bool sent)
+{
+  ChannelStatistics& statistics = channelStatistics[onChannel < HOP_MAX_CHANNELS ? onChannel : HOP_MAX_CHANNELS];
+  uint32_t airtime = (AirTime(frameLength) + 500) / 1000;
+  if (sent)
+  {
+    statistics.sent += airtime;
+    telemetry.airtimeSent += airtime;
+  }
+  else
+  {
+    statistics.heard += airtime;
+    telemetry.airtimeHeard += airtime;
+  }
+}
+
+void LoRaMessageHandler::CountDrop(uint8_t reason)
+{
+  if (reason < TELEMETRY_DROP_REASONS) telemetry.dropped[reason]++;
+}
+
+// The block is as it was when asked for. The telemetry message itself is
+// counted in the next one.
+bool LoRaMessageHandler::SendTelemetry(uint16_t destination, uint16_t reporter)
+{
+  uint32_t counters[(TELEMETRY_LENGTH - 4) / 4];
+  uint8_t count = 0;
+  counters[count++] = millis() / 1000;
+  counters[count++] = telemetry.received;
+  for (uint8_t i = 0; i < TELEMETRY_DROP_REASONS; i++)
+    counters[count++] = telemetry.dropped[i];
+  counters[count++] = telemetry.sent;
+  counters[count++] = telemetry.airtimeSent;
+  counters[count++] = telemetry.airtimeHeard;
+  counters[count++] = telemetry.channelBusy;
+  counters[count++] = telemetry.backoff;
+
+  uint8_t block[TELEMETRY_LENGTH];
+  uint8_t length = 0;
+  block[length++] = TELEMETRY_VERSION;
+  block[length++] = (uint8_t)(reporter >> 8); // high byte
+  block[length++] = (uint8_t)reporter; // low byte
+  for (uint8_t i = 0; i < count; i++)
+    for (int8_t shift = 24; shift >= 0; shift -= 8)
+      block[length++] = (uint8_t)(counters[i] >> shift); // high byte first
+  block[length++] = telemetry.queueHighWater;
+  return SendDatagram(block, length, destination, TELEMETRY_APPARATUS);
+}
+
+uint8_t LoRaMessageHandler::HopDistance(uint16_t sink)
+{
+  if (sink == LOCAL_ADDRESS && LOCAL_ADDRESS != 00) return 0;
+  return FindDistance(sinkDistances, GRADIENT_MAX_SINKS, sink);
+}
+
+// Value of the hop-distance bits for a distance.
+uint8_t LoRaMessageHandler::HopField(uint8_t distance)
+{
+  return distance > MAX_HOP_DISTANCE ? 0 : distance + 1;
+}
+
+// Learns the distance to a sink from the beacon header in MESSAGE.
+// This node is one hop farther than the beacon's transmitter.
+void LoRaMessageHandler::LearnRoute()
+{
+  uint8_t distance = MESSAGE[LOCATION_REBROADCASTS] >> HOP_DISTANCE_SHIFT; // transmitter's, plus one
+  if (distance == 0 || distance > MAX_HOP_DISTANCE) return;
+  if (getSourceAddress() == LOCAL_ADDRESS && LOCAL_ADDRESS != 00) return;
+
+  LearnDistance(sinkDistances, GRADIENT_MAX_SINKS, getSourceAddress(), distance,
+                (uint16_t)((MESSAGE[LOCATION_MESSAGE_ID] << 8) | MESSAGE[LOCATION_MESSAGE_ID + 1]));
+}
+
+void LoRaMessageHandler::SetRebroadcasts(uint8_t messageType, uint8_t rebroadcasts)
+{
+  if (messageType > MESSAGE_TYPE_MASK) return;
+  if (rebroadcasts != ADAPTIVE_REBROADCASTS)
+    rebroadcasts = rebroadcasts < 1 ? 1 : rebroadcasts > MAX_REBROADCASTS ? MAX_REBROADCASTS : rebroadcasts;
+  typeRebroadcasts[messageType] = rebroadcasts;
+}
+
+uint8_t LoRaMessageHandler::RelaysFrom(uint16_t node)
+{
+  return FindDistance(sourceRelays, MAX_KNOWN_SOURCES, node);
+}
+
+// Rebroadcast count for a new message.
+uint8_t LoRaMessageHandler::Rebroadcasts(uint8_t messageType, uint16_t destination)
+{
+  uint8_t rebroadcasts = typeRebroadcasts[messageType & MESSAGE_TYPE_MASK];
+  if (rebroadcasts != ADAPTIVE_REBROADCASTS) return rebroadcasts;
+
+  uint8_t relays = RelaysFrom(destination);
+  if (relays == HOP_DISTANCE_UNKNOWN) return DEFAULT_REBROADCASTS;
+  return relays + REBROADCAST_MARGIN < MAX_REBROADCASTS ? relays + REBROADCAST_MARGIN : MAX_REBROADCASTS;
+}
+
+// Learns how many relays the frame in MESSAGE came through from its source.
+void LoRaMessageHandler::LearnRelays()
+{
+  uint8_t initial = (MESSAGE[LOCATION_MESSAGE_TYPE] & MESSAGE_REBROADCASTS_MASK) >> MESSAGE_REBROADCASTS_SHIFT;
+  uint8_t remaining = MESSAGE[LOCATION_REBROADCASTS] & REBROADCAST_MASK;
+  if (initial == 0) initial = DEFAULT_REBROADCASTS;
+  if (remaining > initial || getSourceAddress() == LOCAL_ADDRESS) return;
+
+  LearnDistance(sourceRelays, MAX_KNOWN_SOURCES, getSourceAddress(), initial - remaining,
+                (uint16_t)((MESSAGE[LOCATION_MESSAGE_ID] << 8) | MESSAGE[LOCATION_MESSAGE_ID + 1]));
+}
+
+// Distance to a node, HOP_DISTANCE_UNKNOWN if not heard from recently.
+uint8_t LoRaMessageHandler::FindDistance(const Distance* table, uint8_t size, uint16_t node)
+{
+  for (uint8_t i = 0; i < size; i++)
+  {
+    if (table[i].node != node || table[i].hops == HOP_DISTANCE_UNKNOWN) continue;
+    if (millis() - table[i].heard > HOP_DISTANCE_TIMEOUT_MS) return HOP_DISTANCE_UNKNOWN;
+    return table[i].hops;
+  }
+  return HOP_DISTANCE_UNKNOWN;
+}
+
+// Records a distance to a node, learned from one of its messages.
+// A newer message replaces the distance, so distances follow changes in
+// the network. Copies of the same message that came a shorter way shorten it.
+void LoRaMessageHandler::LearnDistance(Distance* table, uint8_t size, uint16_t node, uint8_t hops, uint16_t messageID)
+{
+  // This node's entry, else a free or expired one, else the oldest
+  Distance* entry = NULL;
+  for (uint8_t i = 0; i < size && !entry; i++)
+    if (table[i].node == node && table[i].hops != HOP_DISTANCE_UNKNOWN) entry = &table[i];
+  bool known = entry != NULL && millis() - entry->heard <= HOP_DISTANCE_TIMEOUT_MS;
+  if (!entry)
+  {
+    entry = &table[0];
+    for (uint8_t i = 0; i < size; i++)
+    {
+      if (table[i].hops == HOP_DISTANCE_UNKNOWN ||
+          millis() - table[i].heard > HOP_DISTANCE_TIMEOUT_MS)
+      {
+        entry = &table[i];
+        break;
+      }
+      if ((long)(table[i].heard - entry->heard) < 0) entry = &table[i];
+    }
+  }
+
+  if (known && messageID == entry->messageID)
+  {
+    if (hops < entry->hops) entry->hops = hops;
+    return;
+  }
+  if (known && (int16_t)(messageID - entry->messageID) < 0) return; // late copy of an older message
+
+  entry->node = node;
+  entry->hops = hops;
+  entry->messageID = messageID;
+  entry->heard = millis();
+}
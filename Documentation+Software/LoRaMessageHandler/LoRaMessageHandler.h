@@ -12,12 +12,34 @@
 // Use the version of the library included with the project.
 #include <LoRa.h> // includes Arduino.h
 
+// CRC-16/DNP, used for the optional end-to-end check.
+#include <crc-16-dnp.h>
+
+// AES-CCM, used for the optional security layer.
+// https://github.com/SergeyBel/AES with local additions.
+#include <AES.h>
+#include <CCM.h>
+
+// Cooperative scheduler, used for waits and transmit retries.
+#include "TaskScheduler.h"
+
+// Classic and compact header formats
+#include "MessageHeader.h"
+
 // These constants are set for a given node within a given system.
 // There is some indication that they can be made permanently 
 // resident on the microcontroller board and queried. 
 // That can be done once we learn how.
 #define SYSTEM_ID 111
 
+// Each system has its own LoRa sync word, so the radio itself drops
+// frames from other systems on the channel before they are read out.
+// The sync word is SYSTEM_ID, moved off 0x34, which LoRaWAN uses, and
+// off 0x12, the radio's default. Nodes of one system must agree on it.
+#ifndef SYNC_WORD
+#define SYNC_WORD (SYSTEM_ID == 0x34 || SYSTEM_ID == 0x12 ? SYSTEM_ID ^ 0x80 : SYSTEM_ID)
+#endif
+
 // Transceiver configuration.
 // LoRa packets are composed of overhead and payload (envelope and contents).
 // Most commonly, the packet is 256 bytes in length.
@@ -50,38 +72,418 @@
 #define LOCATION_REBROADCASTS    8
 #define MESSAGE_HEADER_LENGTH    9
 
+// Optional compact header, described in MessageHeader.h.
+// Messages are sent with it when it is enabled, and always when an
+// address does not fit in one byte. Messages of either format are
+// received, and handed on in the classic layout above. There, addresses
+// keep their low byte only. getSourceAddress() and getDestinationAddress()
+// give the whole address.
+// With long addresses a compact header can be up to MAX_HEADER_GROWTH
+// bytes longer than a classic one.
+#define MAX_HEADER_GROWTH        (COMPACT_HEADER_MAX_LENGTH - MESSAGE_HEADER_LENGTH)
+
+// Request and response messages (types 1 and 2) carry a request ID,
+// high byte first, then the associated value.
+// The requester picks the ID. The response echoes it, which lets a node
+// keep several requests in flight and match responses in any order.
+#define LOCATION_REQUEST_ID       MESSAGE_HEADER_LENGTH
+#define LOCATION_ASSOCIATED_VALUE (MESSAGE_HEADER_LENGTH + 2)
+#define REQUEST_MESSAGE_LENGTH    (MESSAGE_HEADER_LENGTH + 6)
+
+// Batched requests and responses (types 4 and 5) cover several apparatus
+// in one message. Both carry a request ID, as above, then a count.
+// A batch request lists apparatus IDs, one byte each.
+// A batch response lists apparatus ID and associated value, five bytes
+// each, for the apparatus that could be served.
+// LOCATION_APPARATUS_ID holds BATCH_APPARATUS.
+// MAX_BATCH_COUNT entries fit with the largest tag, CRC and header.
+#define LOCATION_BATCH_COUNT      (MESSAGE_HEADER_LENGTH + 2)
+#define LOCATION_BATCH_ENTRIES    (MESSAGE_HEADER_LENGTH + 3)
+#define BATCH_APPARATUS           0xFF
+#define BATCH_VALUE_LENGTH        5
+#define MAX_BATCH_COUNT           ((MAX_MESSAGE_LENGTH - LOCATION_BATCH_ENTRIES - 16 - MESSAGE_CRC_LENGTH - MAX_HEADER_GROWTH) / BATCH_VALUE_LENGTH)
+
+// Datagrams, longer than one message, are sent as fragments (type 7).
+// Each fragment carries the datagram ID, high byte first, then its index
+// and the fragment count. The ID is the message ID of the first fragment.
+// All fragments but the last carry FRAGMENT_DATA_LENGTH bytes, which fit
+// with the largest tag, CRC and header. LOCATION_APPARATUS_ID is the sender's to
+// use, the same in every fragment.
+// The destination puts fragments together in one of REASSEMBLY_BUFFERS
+// buffers. A datagram not completed within REASSEMBLY_TIMEOUT_MS of its
+// latest fragment is dropped. When every buffer is taken, the datagram
+// heard from least recently makes way.
+#define LOCATION_DATAGRAM_ID      MESSAGE_HEADER_LENGTH
+#define LOCATION_FRAGMENT_INDEX   (MESSAGE_HEADER_LENGTH + 2)
+#define LOCATION_FRAGMENT_COUNT   (MESSAGE_HEADER_LENGTH + 3)
+#define LOCATION_FRAGMENT_DATA    (MESSAGE_HEADER_LENGTH + 4)
+#define FRAGMENT_DATA_LENGTH      (MAX_MESSAGE_LENGTH - LOCATION_FRAGMENT_DATA - 16 - MESSAGE_CRC_LENGTH - MAX_HEADER_GROWTH)
+#define MAX_FRAGMENTS             16
+#ifndef MAX_DATAGRAM_LENGTH
+#define MAX_DATAGRAM_LENGTH       1024
+#endif
+#ifndef REASSEMBLY_BUFFERS
+#define REASSEMBLY_BUFFERS        2
+#endif
+#ifndef REASSEMBLY_TIMEOUT_MS
+#define REASSEMBLY_TIMEOUT_MS     30000UL
+#endif
+
+// Optional end-to-end CRC.
+// The LoRa packet CRC is checked hop by hop only. When this flag is set in
+// the message type, the last two bytes of the message are a CRC-16/DNP
+// (high byte first) computed by the source over the whole message except
+// LOCATION_REBROADCASTS, which relays change. The destination checks it.
+#define MESSAGE_FLAG_CRC         0x80
+#define MESSAGE_CRC_LENGTH       2
+
+// Optional security layer.
+// When this flag is set in the message type, the contents after the header
+// are AES-128-CCM encrypted and followed by an authentication tag.
+// The header is authenticated but not encrypted, except
+// LOCATION_REBROADCASTS, so relays forward without the key.
+// With security enabled, a node accepts only messages with a valid tag,
+// except beacons, which are sent without one and are not authenticated.
+// The nonce is (SYSTEM_ID, source, message ID). Message IDs restart at
+// power-up, so a node that restarts repeats nonces under the same key.
+// Change the network key when that matters.
+#define MESSAGE_FLAG_SECURE      0x40
+#define DEFAULT_TAG_LENGTH       4
+
+// Message type without the flags above, or the initial rebroadcasts below.
+#define MESSAGE_TYPE_MASK        0x07
+
+// Adaptive rebroadcast counts.
+// Every node learns how many relays frames from each source came through:
+// the initial count, which the source puts in bits 3 to 5 of the message
+// type, less the count left on arrival. A message is sent with the number
+// learned for its destination plus REBROADCAST_MARGIN, and with
+// DEFAULT_REBROADCASTS to destinations not heard from recently.
+// SetRebroadcasts() fixes the count for a message type instead.
+// Zero initial bits, as older nodes send, mean DEFAULT_REBROADCASTS.
+// Like the flags, the bits are covered by the end-to-end CRC and the
+// security layer, and are removed at the destination.
+#define MESSAGE_REBROADCASTS_MASK  0x38
+#define MESSAGE_REBROADCASTS_SHIFT 3
+#define DEFAULT_REBROADCASTS       5
+#define MAX_REBROADCASTS           7
+#define ADAPTIVE_REBROADCASTS      0xFF
+#define MAX_KNOWN_SOURCES          8
+#ifndef REBROADCAST_MARGIN
+#define REBROADCAST_MARGIN         2
+#endif
+
+// Optional gradient routing.
+// A sink, such as the basestation, sends beacons (type 6) every so often. Nodes learn their hop distance to each sink from them.
+// With gradient routing enabled, a relay forwards a message for a sink
+// only when it is closer to the sink than the node it heard it from.
+// Messages for other destinations, or from nodes that do not know their
+// distance, are flooded as before.
+// The high four bits of LOCATION_REBROADCASTS carry the transmitter's
+// distance to the sink plus one, zero when unknown. The low four bits are
+// the rebroadcast counter. Relays change both, so neither is covered by
+// the end-to-end CRC or the security layer. Beacons are not authenticated.
+#define REBROADCAST_MASK         0x0F
+#define HOP_DISTANCE_SHIFT       4
+#define HOP_DISTANCE_UNKNOWN     0xFF
+#define MAX_HOP_DISTANCE         14
+#define GRADIENT_MAX_SINKS       4
+
+// Learned distances are forgotten when nothing has come from the node
+// for this long.
+#ifndef HOP_DISTANCE_TIMEOUT_MS
+#define HOP_DISTANCE_TIMEOUT_MS  180000UL
+#endif
+
+// Network time.
+// Beacons carry the sink's clock, in milliseconds, high byte first.
+// Relays add the time a beacon spent with them before sending it on, and
+// receivers add its time on the air, so it arrives as the sink's time.
+// Nodes follow one sink's clock: the offset from its latest beacon, and
+// a drift estimate, in parts per million, from successive ones. Each
+// drift measurement is taken in by 1/TIME_DRIFT_GAIN. Time is only as
+// accurate as the sketch is quick to check for messages.
+// Header-only beacons, as older sinks send, are used for distances only.
+// Beacons are not authenticated, so neither is network time.
+#define LOCATION_BEACON_TIME       MESSAGE_HEADER_LENGTH
+#define BEACON_TIME_LENGTH         4
+#define BEACON_LENGTH              (LOCATION_BEACON_TIME + BEACON_TIME_LENGTH)
+#define TIME_DRIFT_GAIN            4
+#define TIME_DRIFT_MIN_INTERVAL_MS 10000UL
+#define MAX_CLOCK_DRIFT_PPM        500
+#ifndef TIME_SYNC_TIMEOUT_MS
+#define TIME_SYNC_TIMEOUT_MS       600000UL
+#endif
+
+// Optional TDMA.
+// A sink can schedule the channel. Network time is divided into
+// superframes of equal slots, counted from time zero. Each slot has an
+// owner. The sink owns the first one, and gives nodes theirs with
+// AssignSlot(), each followed by relay slots, owned by address 0 like the
+// relays. The rest are free. With TDMA enabled, a node sends its own
+// messages in its slots only, and relays others' in relay slots only.
+// A frame starts at least TDMA_GUARD_MS into a slot and has to end within
+// it, or it waits for the next one. A frame too long for a slot goes at
+// the start of one anyway, and counts as a violation (getSlotStatistics()).
+// Nodes that have no slot yet, or have lost the sink's time, send
+// whenever the channel is clear, as without TDMA. The sink hears them,
+// and the sketch assigns them slots.
+// The schedule follows the time in beacons: slot length (milliseconds,
+// high byte first), slots per superframe, hop channels (below), slots
+// assigned, and the owner of each slot assigned (high byte first).
+// Superframes do not line up across the wrap of network time, after
+// about 49 days. Frames near it may be counted as violations.
+#define LOCATION_SCHEDULE          BEACON_LENGTH
+#define SCHEDULE_HEADER_LENGTH     5
+#define TDMA_RELAY_SLOT            0
+#define TDMA_FREE_SLOT             0xFFFF
+#define TDMA_NO_SLOT               0xFF
+#ifndef TDMA_MAX_SLOTS
+#define TDMA_MAX_SLOTS             32 // at most 100, for the beacon to fit
+#endif
+#ifndef TDMA_SLOT_MS
+#define TDMA_SLOT_MS               400 // fits a frame of MAX_MESSAGE_LENGTH
+#endif
+#ifndef TDMA_RELAY_SLOTS
+#define TDMA_RELAY_SLOTS           1
+#endif
+#ifndef TDMA_GUARD_MS
+#define TDMA_GUARD_MS              20
+#endif
+
+// Optional spreading of the slots over channels (frequency hopping),
+// with TDMA. A sink that schedules the channel can spread the slots over
+// the channels of the plan below. Each slot is on a channel picked from
+// its number, counted from network time zero, and its owner's address.
+// Every node that follows the schedule works it out the same way, and
+// retunes when it checks for messages or sends. The whole network hops
+// together, one slot and one channel at a time, so what is spread is
+// airtime and interference, not traffic. The sink's slot, and the relay
+// slots right after it, stay on FREQUENCY, the home channel. Nodes
+// without the time or a schedule stay there, and hear beacons there.
+// Every node needs the same plan.
+// The default plan is US915 sub-band 2: 8 channels, 903.9 .. 905.3 MHz.
+#ifndef HOP_FIRST_FREQUENCY
+#define HOP_FIRST_FREQUENCY        903.9E6
+#endif
+#ifndef HOP_CHANNEL_SPACING
+#define HOP_CHANNEL_SPACING        200E3
+#endif
+#ifndef HOP_MAX_CHANNELS
+#define HOP_MAX_CHANNELS           8
+#endif
+#define HOME_CHANNEL               0xFF
+
+// Messages are not sent while channel activity is detected, or, with
+// TDMA, outside their slots. They wait in a queue and are tried again
+// every CAD_BACKOFF_MS, or at their next slot, by a task or by
+// CheckForIncomingPacket(), whichever comes first.
+// Sending fails only when the queue is full.
+#define CAD_BACKOFF_MS           100
+#define TRANSMIT_QUEUE_LENGTH    2
+
+// Telemetry.
+// Every node keeps a fixed block of counters of what its radio and this
+// handler did since power-up. Frames are counted as they were on the air,
+// whoever they were for. Drops the handler cannot see, such as duplicates,
+// which the sketch finds, are counted by the sketch with CountDrop().
+// A node asked for TELEMETRY_APPARATUS in a request (type 1) answers with
+// SendTelemetry(): the block, as a datagram of one fragment with
+// TELEMETRY_APPARATUS. Relays all have address 0, so the block names the
+// node it comes from, the reporter. Layout, high byte first:
+//   version, reporter (2), uptime (4, seconds), frames received (4),
+//   frames dropped (4 each, one per reason, in the order below),
+//   frames sent (4), airtime sent (4, ms), airtime heard (4, ms),
+//   channel busy (4), backoff (4, ms), transmit queue high-water mark.
+// Counters wrap.
+#define TELEMETRY_APPARATUS      0xFE
+#define TELEMETRY_VERSION        1
+#define TELEMETRY_DROP_SIZE       0 // too short or long, or the header cannot be read
+#define TELEMETRY_DROP_NOT_FOR_ME 1 // another destination or system
+#define TELEMETRY_DROP_TTL        2 // rebroadcast counter expired
+#define TELEMETRY_DROP_DUPLICATE  3 // seen before, counted by the sketch
+#define TELEMETRY_DROP_ROUTE      4 // held back by gradient routing
+#define TELEMETRY_DROP_INVALID    5 // failed its end-to-end CRC or authentication, or a fragment that does not fit
+#define TELEMETRY_DROP_QUEUE      6 // transmit queue full
+#define TELEMETRY_DROP_REASONS    7
+#define TELEMETRY_LENGTH         (32 + 4 * TELEMETRY_DROP_REASONS)
+
 class LoRaMessageHandler
 {
 
 public:
 
   // Constructor
-  LoRaMessageHandler(uint8_t nodeAddress);
+  LoRaMessageHandler(uint16_t nodeAddress);
 
   // Deconstructor
   ~LoRaMessageHandler();
 
   // Send specific messages to specific destinations.
-  bool SendTextMessage(String text, uint8_t destination);
-  bool SendCameraData(uint8_t* imageSegment, uint8_t destination);
-  bool SendRequest(uint8_t apparatus, uint32_t associatedValue, uint8_t destination);
-  bool SendResponse(uint8_t apparatus, uint32_t associatedValue, uint8_t destination);
+  bool SendTextMessage(String text, uint16_t destination);
+  bool SendCameraData(uint8_t* imageSegment, uint16_t destination);
+  // SendRequest() reports the request ID it used in requestID, if given.
+  bool SendRequest(uint8_t apparatus, uint32_t associatedValue, uint16_t destination,
+                   uint16_t* requestID = NULL);
+  bool SendResponse(uint8_t apparatus, uint32_t associatedValue, uint16_t destination,
+                    uint16_t requestID);
+
+  // Several apparatus in one request and one response.
+  // count is at most MAX_BATCH_COUNT.
+  bool SendBatchRequest(const uint8_t* apparatus, uint8_t count, uint16_t destination,
+                        uint16_t* requestID = NULL);
+  bool SendBatchResponse(const uint8_t* apparatus, const uint32_t* associatedValues, uint8_t count,
+                         uint16_t destination, uint16_t requestID);
   
-  // Check for incoming messages
+  // Check for incoming messages.
+  // Fragments are not returned. When the last one of a datagram comes in,
+  // it is returned, and getDatagram() gives the whole datagram.
   int CheckForIncomingPacket();
 
+  // Same, for relays. Only the header is read into MESSAGE. The contents
+  // stay in the radio's FIFO, and RelayMessage() sends the frame on from
+  // there when it can, without reading it out and writing it back.
+  // Call RelayMessage() before anything else that uses the radio.
+  int CheckForRelayPacket();
+
+  // Send messages with the compact header from now on. Off by default.
+  // Only turn it on once every node in the network can receive it.
+  void EnableCompactHeader(bool enable);
+
+  // Add an end-to-end CRC to messages sent from now on. Off by default.
+  void EnableEndToEndCRC(bool enable);
+
+  // Encrypt and authenticate messages sent from now on, and accept only
+  // secured messages for this node, beacons aside. key is the 16-byte
+  // network key.
+  // Tag length is 4 to 16 bytes, even. Off by default.
+  bool EnableSecurity(const uint8_t* key, uint8_t tagLength = DEFAULT_TAG_LENGTH);
+  void DisableSecurity();
+
   // Get a copy of the MESSAGE pointer
   const uint8_t* getMESSAGE();
 
+  // Whole addresses of a received message
+  uint16_t getSourceAddress();
+  uint16_t getDestinationAddress();
+
+  // Fields of a received request or response message
+  uint16_t getRequestID();
+  uint32_t getAssociatedValue();
+
+  // Entries of a received batch request or response.
+  // getBatchCount() is zero if the message is malformed.
+  uint8_t getBatchCount();
+  uint8_t getBatchApparatus(uint8_t index);
+  uint32_t getBatchValue(uint8_t index);
+
+  // Send data of up to MAX_DATAGRAM_LENGTH bytes, in as many fragments as
+  // needed. Waits for room in the transmit queue between fragments.
+  bool SendDatagram(const uint8_t* data, uint16_t length, uint16_t destination,
+                    uint8_t apparatus = 0);
+
+  // The datagram completed by the latest fragment received.
+  // Valid until the next call to CheckForIncomingPacket().
+  const uint8_t* getDatagram();
+  uint16_t getDatagramLength();
+
   // Relay a message with decrmented rebroadcast counter.
-  void RelayMessage();
+  // Returns false if it was not sent, as when gradient routing holds it back.
+  bool RelayMessage();
+
+  // Gradient routing. Off by default.
+  // Distances are learned from beacons either way.
+  void EnableGradientRouting(bool enable);
+  bool SendBeacon(); // sinks only
+  uint8_t HopDistance(uint16_t sink); // HOP_DISTANCE_UNKNOWN if no recent beacon
 
-  // Non-blocking delay for some length of milliseconds
+  // Network time (milliseconds), the clock of the sink followed.
+  // A sink's own clock is network time. Until a beacon with the time
+  // comes in, this is millis().
+  unsigned long NetworkTime();
+  bool TimeSynchronized(); // false when no beacon came in TIME_SYNC_TIMEOUT_MS
+  long ClockDrift() { return clockDrift; } // ppm, network clock rate less local
+
+  // Time on the air of a message of length bytes (microseconds)
+  static unsigned long AirTime(uint8_t length);
+
+  // TDMA. Off by default.
+  // Sinks start a schedule, sent in their beacons, and assign slots.
+  // A superframe has slots slots of length milliseconds, and relays relay
+  // slots follow each node's. AssignSlot() returns the node's slot, or
+  // TDMA_NO_SLOT when the superframe is full.
+  void StartSchedule(uint8_t slots = TDMA_MAX_SLOTS, uint16_t length = TDMA_SLOT_MS,
+                     uint8_t relays = TDMA_RELAY_SLOTS);
+  uint8_t AssignSlot(uint16_t node);
+  // Other nodes follow the schedule in the beacons of the sink whose
+  // time they follow.
+  void EnableTDMA(bool enable);
+  bool Scheduled(); // a schedule and the time to follow it are known
+
+  // Slot use, from when a schedule was first followed.
+  // Utilization is slotsUsed / slots.
+  // Frames heard are checked by when they are checked for, so a slow
+  // sketch sees violations that did not happen.
+  struct SlotStatistics
+  {
+    uint32_t slots;           // slots of this node's gone by
+    uint32_t slotsUsed;       // of those, ones it sent in
+    uint16_t sentViolations;  // frames sent not within a slot of theirs, less the guard time
+    uint16_t heardViolations; // frames heard not within a slot of their transmitter
+  };
+  SlotStatistics getSlotStatistics();
+
+  // Spreading of the slots over channels (frequency hopping), with TDMA.
+  // Off by default. Sinks spread their slots over channels channels of
+  // the plan, at most HOP_MAX_CHANNELS, one slot at a time as before.
+  // Fewer than 2 turns it off. Other nodes hop as the schedule they
+  // follow says.
+  void EnableHopping(uint8_t channels = HOP_MAX_CHANNELS);
+  uint8_t Channel() { return channel; } // tuned to, HOME_CHANNEL for FREQUENCY
+
+  // Time on the air of frames sent and heard on a channel (milliseconds).
+  // HOME_CHANNEL for FREQUENCY.
+  struct ChannelStatistics
+  {
+    uint32_t sent;
+    uint32_t heard;
+  };
+  ChannelStatistics getChannelStatistics(uint8_t channel);
+
+  // Rebroadcast count for messages of a type, 1 .. MAX_REBROADCASTS,
+  // or ADAPTIVE_REBROADCASTS, the default, to set it per destination.
+  void SetRebroadcasts(uint8_t messageType, uint8_t rebroadcasts);
+  uint8_t RelaysFrom(uint16_t node); // HOP_DISTANCE_UNKNOWN if not heard recently
+
+  // Delay for some length of milliseconds.
+  // Scheduled tasks keep running meanwhile.
   void Wait(long milliseconds);
 
+  // Number of messages waiting for a clear channel
+  uint8_t QueuedMessages() { return queueCount; }
+
+  // Counters since power-up
+  struct Telemetry
+  {
+    uint32_t received;       // frames heard
+    uint32_t dropped[TELEMETRY_DROP_REASONS];
+    uint32_t sent;           // frames sent, relayed ones included
+    uint32_t airtimeSent;    // milliseconds
+    uint32_t airtimeHeard;
+    uint32_t channelBusy;    // times channel activity held a frame back
+    uint32_t backoff;        // milliseconds frames were held back, for activity or their slot
+    uint8_t queueHighWater;  // most messages queued at once
+  };
+  Telemetry getTelemetry() { return telemetry; }
+  void CountDrop(uint8_t reason); // for drops the sketch decides on
+
+  // Sends the counters to destination, as from reporter.
+  // Nodes give their address, relays a number of their own.
+  bool SendTelemetry(uint16_t destination, uint16_t reporter);
+
 private:
 
-  uint8_t LOCAL_ADDRESS = 0; // unique node address
+  uint16_t LOCAL_ADDRESS = 0; // unique node address
   uint8_t messageIndex = 0; // cell index in current message vector
 
   // Outgoing-message counter for this SYSTEM_ID/SOURCE_NODE_ID
@@ -90,11 +492,154 @@ private:
   uint8_t sourceMessageID_LowByte = 0;
 
   // Starts a message with its header
-  bool StartMessage(uint8_t messageType, uint8_t destination);
+  bool StartMessage(uint8_t messageType, uint16_t destination);
+
+  // Request and response messages have the same layout
+  void SetRequestContents(uint8_t apparatus, uint32_t associatedValue, uint16_t requestID);
+  void SetBatchContents(uint16_t requestID, uint8_t count);
+
+  // What the classic layout of a message leaves out
+  struct MessageFormat
+  {
+    bool compact;            // sent with the compact header
+    uint8_t sourceHigh;      // high bytes of the addresses
+    uint8_t destinationHigh;
+  };
+  MessageFormat format = { false, 0, 0 }; // of MESSAGE
+  bool compactHeader = false;
+  uint8_t HeaderGrowth(uint16_t destination, uint8_t apparatus = 0);
 
-  // Broadcasts a fully-formed LoRa packet
+  // Header of a received frame, as it was on the air
+  uint8_t frameHeaderLength = MESSAGE_HEADER_LENGTH;
+  uint8_t frameRead = 0; // bytes of the frame read so far
+  int ReadHeader(int frameSize);
+
+  // Broadcasts a fully-formed LoRa packet, or queues it
+  // until the channel is clear
   bool BroadcastPacket();
 
+  // Messages waiting for a clear channel, oldest first
+  uint8_t transmitQueue[TRANSMIT_QUEUE_LENGTH][256];
+  MessageFormat transmitFormat[TRANSMIT_QUEUE_LENGTH];
+  uint8_t queueHead = 0;
+  uint8_t queueCount = 0;
+  unsigned long retryTime = 0; // millis() of the next attempt
+  TaskScheduler::TaskID retryTask = TaskScheduler::NO_TASK;
+  void Transmit(const uint8_t* message, const MessageFormat& messageFormat);
+  void TransmitQueued();
+  void Retry(unsigned long delay);
+  static uint8_t CompactHeader(const uint8_t* message, const MessageFormat& messageFormat, uint8_t* frame);
+  static uint8_t FrameLength(const uint8_t* message, const MessageFormat& messageFormat);
+  static void RetryTask(void* handler);
+
+  Telemetry telemetry;
+
+  // Adds the optional tag and CRC to a fully-formed message
+  void FinishMessage();
+  uint8_t MessageOverhead();
+
+  // End-to-end CRC handling
+  bool endToEndCRC = false;
+  uint16_t MessageCRC(uint8_t messageLength);
+  void AppendCRC();
+
+  // Hop distances learned from received frames
+  struct Distance
+  {
+    uint16_t node;
+    uint8_t hops;         // HOP_DISTANCE_UNKNOWN when the entry is free
+    uint16_t messageID;   // latest message it was learned from
+    unsigned long heard;  // millis() of that message
+  };
+  static void LearnDistance(Distance* table, uint8_t size, uint16_t node, uint8_t hops, uint16_t messageID);
+  static uint8_t FindDistance(const Distance* table, uint8_t size, uint16_t node);
+
+  // Gradient routing: hops to each sink, from beacons
+  Distance sinkDistances[GRADIENT_MAX_SINKS];
+  bool gradientRouting = false;
+  void LearnRoute();
+  uint8_t HopField(uint8_t distance);
+
+  // Network time, from beacons.
+  // While a beacon is held, its time field is network time less millis().
+  bool timeSink = false; // sends beacons
+  bool timeSynced = false;
+  uint16_t timeSource = 0;
+  uint16_t timeMessageID = 0;
+  unsigned long syncLocal = 0;  // millis() at the latest beacon
+  uint32_t syncNetwork = 0;     // network time then
+  long clockDrift = 0;
+  bool LearnTime(int frameSize); // true when the beacon is followed
+  void ReadFrame(uint8_t offset);
+  unsigned long NetworkTimeAt(unsigned long local);
+  static bool TimedBeacon(const uint8_t* message);
+  static void StampBeacon(const uint8_t* message, uint8_t* time);
+
+  // TDMA schedule, made here or learned from beacons
+  bool tdma = false;
+  bool scheduleSink = false; // makes the schedule
+  uint16_t slotLength = TDMA_SLOT_MS;
+  uint8_t superframeSlots = 0; // no schedule when zero
+  uint8_t assignedSlots = 0;
+  uint8_t relaySlots = TDMA_RELAY_SLOTS;
+  uint16_t slotOwners[TDMA_MAX_SLOTS];
+  SlotStatistics slotStatistics = { 0, 0, 0, 0 };
+  uint32_t slotsCountedTo = 0; // network time the slots were counted to
+  uint32_t lastSlotUsed = 0;   // network time / slotLength
+  bool slotUsed = false;
+  void LearnSchedule(int frameSize);
+  uint16_t SlotOwner(uint32_t time);
+  uint16_t SlotFor(const uint8_t* message, const MessageFormat& messageFormat);
+  bool HasSlot(uint16_t owner);
+  bool InSlot(uint16_t owner, uint32_t start, unsigned long duration, unsigned long guard);
+  unsigned long SlotDelay(uint16_t owner, uint8_t frameLength);
+  void SlotSent(uint16_t owner, uint32_t start, uint8_t frameLength);
+  void CheckSlot(int frameSize);
+  void CountSlots();
+  uint32_t OwnSlotsBefore(uint32_t time);
+
+  // Frequency hopping
+  uint8_t hopChannels = 0; // 0 when not hopping
+  uint8_t channel = HOME_CHANNEL; // tuned to
+  ChannelStatistics channelStatistics[HOP_MAX_CHANNELS + 1]; // home last
+  uint8_t SlotChannel(uint32_t time);
+  void Retune(uint8_t to);
+  void Retune();
+  void CountAirtime(uint8_t onChannel, uint8_t frameLength, bool sent);
+
+  // Adaptive rebroadcasts: relays from each source
+  Distance sourceRelays[MAX_KNOWN_SOURCES];
+  uint8_t typeRebroadcasts[MESSAGE_TYPE_MASK + 1];
+  void LearnRelays();
+  uint8_t Rebroadcasts(uint8_t messageType, uint16_t destination);
+
+  // Datagrams being put together, free when count is zero
+  struct Reassembly
+  {
+    uint16_t source;
+    uint16_t datagramID;
+    uint8_t count;        // fragments in the datagram
+    uint16_t received;    // one bit per fragment received
+    uint16_t length;      // known once the last fragment is in
+    unsigned long heard;  // millis() of the latest fragment
+    uint8_t data[MAX_DATAGRAM_LENGTH];
+  };
+  Reassembly reassembly[REASSEMBLY_BUFFERS];
+  Reassembly* datagram = NULL; // completed, returned by getDatagram()
+  int Reassemble(int messageSize);
+  Reassembly* FindReassembly(uint16_t source, uint16_t datagramID);
+
+  // Security layer
+  AES* cipher = NULL;
+  CCM* ccm = NULL;
+  uint8_t tagLength = DEFAULT_TAG_LENGTH;
+  void MessageNonce(uint8_t* nonce);
+  void SecureMessage();
+  bool OpenMessage();
+
+  // Length of a received frame left in the radio's FIFO, 0 if none
+  uint8_t fifoLength = 0;
+
   // Holds the message to be sent.
   // Also holds received messages.
   uint8_t MESSAGE[256]; // never longer
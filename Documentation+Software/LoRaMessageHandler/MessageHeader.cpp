@@ -0,0 +1,74 @@
+#include "MessageHeader.h" // declarations
+
+static uint8_t EncodeVarint(uint16_t value, uint8_t* out)
+{
+  uint8_t length = 0;
+  while (value >= 0x80)
+  {
+    out[length++] = (uint8_t)(value | 0x80);
+    value >>= 7;
+  }
+  out[length++] = (uint8_t)value;
+  return length;
+}
+
+// Returns the bytes read, 0 if the varint runs past the end or past 16 bits.
+static uint8_t DecodeVarint(const uint8_t* in, uint8_t length, uint16_t& value)
+{
+  uint32_t result = 0;
+  for (uint8_t i = 0; i < length && i < 3; i++)
+  {
+    result |= (uint32_t)(in[i] & 0x7F) << (7 * i);
+    if (in[i] & 0x80) continue;
+    if (result > 0xFFFF) return 0;
+    value = (uint16_t)result;
+    return i + 1;
+  }
+  return 0;
+}
+
+uint8_t EncodeCompactHeader(const MessageHeader& header, uint8_t localSystem, uint8_t* frame)
+{
+  uint8_t flags = 0;
+  if (header.system != localSystem) flags |= COMPACT_FLAG_SYSTEM;
+  if (header.apparatus != 0) flags |= COMPACT_FLAG_APPARATUS;
+
+  uint8_t index = 0;
+  frame[index++] = COMPACT_HEADER_MARK | (COMPACT_HEADER_VERSION << COMPACT_VERSION_SHIFT) | flags;
+  frame[index++] = header.rebroadcasts;
+  frame[index++] = header.type;
+  index += EncodeVarint(header.source, frame + index);
+  index += EncodeVarint(header.destination, frame + index);
+  frame[index++] = (uint8_t)(header.messageID >> 8); // high byte
+  frame[index++] = (uint8_t)header.messageID; // low byte
+  if (flags & COMPACT_FLAG_SYSTEM) frame[index++] = header.system;
+  if (flags & COMPACT_FLAG_APPARATUS) frame[index++] = header.apparatus;
+  return index;
+}
+
+uint8_t DecodeCompactHeader(const uint8_t* frame, uint8_t length, uint8_t localSystem, MessageHeader& header)
+{
+  if (length < COMPACT_HEADER_MIN_LENGTH || !IsCompactHeader(frame[0]) ||
+      ((frame[0] & COMPACT_VERSION_MASK) >> COMPACT_VERSION_SHIFT) != COMPACT_HEADER_VERSION)
+    return 0;
+
+  uint8_t flags = frame[0];
+  header.rebroadcasts = frame[1];
+  header.type = frame[2];
+
+  uint8_t index = 3;
+  uint8_t used = DecodeVarint(frame + index, length - index, header.source);
+  if (used == 0) return 0;
+  index += used;
+  used = DecodeVarint(frame + index, length - index, header.destination);
+  if (used == 0) return 0;
+  index += used;
+
+  uint8_t optional = ((flags & COMPACT_FLAG_SYSTEM) ? 1 : 0) + ((flags & COMPACT_FLAG_APPARATUS) ? 1 : 0);
+  if (index + 2 + optional > length) return 0;
+  header.messageID = (uint16_t)((frame[index] << 8) | frame[index + 1]);
+  index += 2;
+  header.system = (flags & COMPACT_FLAG_SYSTEM) ? frame[index++] : localSystem;
+  header.apparatus = (flags & COMPACT_FLAG_APPARATUS) ? frame[index++] : 0;
+  return index;
+}
@@ -0,0 +1,72 @@
+#pragma once
+
+// Message header formats, shared by the firmware and host tools.
+//
+// Classic header, MESSAGE_HEADER_LENGTH bytes at the LOCATION_ offsets:
+//   length, system, source, destination, message ID (2), type,
+//   apparatus, rebroadcasts.
+//
+// Compact header, version 0:
+//   format        COMPACT_HEADER_MARK | version << 3 | flags
+//   rebroadcasts  as classic, at a fixed place for relays
+//   type          as classic
+//   source        varint
+//   destination   varint
+//   message ID    2 bytes, high byte first
+//   system        only with COMPACT_FLAG_SYSTEM, else the receiver's own
+//   apparatus     only with COMPACT_FLAG_APPARATUS, else 0
+// Varints hold 7 bits per byte, low bits first, with the top bit set in
+// all bytes but the last. Addresses below 128 take one byte, so 16-bit
+// addresses cost nothing until they are used.
+// There is no length byte; the radio packet has the length.
+//
+// A classic frame starts with its length, never more than 222, so a
+// first byte with the top three bits set marks a compact frame. Both
+// formats can be received side by side.
+//
+// Only standard headers are used, so that this builds anywhere.
+
+#include <stdint.h>
+
+#define COMPACT_HEADER_MARK         0xE0
+#define COMPACT_HEADER_VERSION      0
+#define COMPACT_VERSION_MASK        0x18
+#define COMPACT_VERSION_SHIFT       3
+#define COMPACT_FLAG_SYSTEM         0x01
+#define COMPACT_FLAG_APPARATUS      0x02
+#define COMPACT_LOCATION_REBROADCASTS 1
+#define COMPACT_HEADER_MIN_LENGTH   7
+#define COMPACT_HEADER_MAX_LENGTH   13
+
+struct MessageHeader
+{
+  uint8_t system;
+  uint16_t source;
+  uint16_t destination;
+  uint16_t messageID;
+  uint8_t type;
+  uint8_t apparatus;
+  uint8_t rebroadcasts;
+};
+
+// True if the frame starts with a compact header.
+inline bool IsCompactHeader(uint8_t firstByte)
+{
+  return (firstByte & COMPACT_HEADER_MARK) == COMPACT_HEADER_MARK;
+}
+
+// Bytes a 16-bit value takes as a varint.
+inline uint8_t VarintLength(uint16_t value)
+{
+  return value < 0x80 ? 1 : value < 0x4000 ? 2 : 3;
+}
+
+// Writes the compact header to frame, COMPACT_HEADER_MAX_LENGTH bytes at
+// most. The system is left out when it is localSystem.
+// Returns the header length.
+uint8_t EncodeCompactHeader(const MessageHeader& header, uint8_t localSystem, uint8_t* frame);
+
+// Reads a compact header from the first length bytes of frame.
+// Returns the header length, or 0 if it is not a compact header this
+// version can read.
+uint8_t DecodeCompactHeader(const uint8_t* frame, uint8_t length, uint8_t localSystem, MessageHeader& header);
@@ -0,0 +1,210 @@
+#include "RequestTable.h" // class declaration
+
+// Constructor
+RequestTable::RequestTable()
+{
+  // All entries start on the free list.
+  for (uint8_t i = 0; i < REQUEST_TABLE_CAPACITY; i++)
+  {
+    entries[i].hashNext = i + 1 < REQUEST_TABLE_CAPACITY ? i + 1 : NONE;
+    entries[i].slot = NONE;
+  }
+  freeList = 0;
+  memset(buckets, NONE, sizeof(buckets));
+  memset(wheel, NONE, sizeof(wheel));
+  tickStart = millis();
+}
+
+// Hash of the request key
+uint8_t RequestTable::Bucket(uint8_t destination, uint8_t apparatus, uint16_t requestID)
+{
+  uint16_t h = requestID * 31 + destination;
+  h = h * 31 + apparatus;
+  return (uint8_t)((h ^ (h >> 5)) & (BUCKETS - 1));
+}
+
+// Index of the entry holding a request, or NONE.
+uint8_t RequestTable::Lookup(uint8_t destination, uint8_t apparatus, uint16_t requestID)
+{
+  uint8_t i = buckets[Bucket(destination, apparatus, requestID)];
+  while (i != NONE)
+  {
+    Request& r = entries[i].request;
+    if (r.destination == destination && r.apparatus == apparatus && r.requestID == requestID)
+      return i;
+    i = entries[i].hashNext;
+  }
+  return NONE;
+}
+
+RequestTable::Request* RequestTable::Add(uint8_t destination, uint8_t apparatus, uint16_t requestID,
+                                         uint32_t associatedValue, unsigned long timeout)
+{
+  if (freeList == NONE) return NULL;
+  if (Lookup(destination, apparatus, requestID) != NONE) return NULL;
+
+  uint8_t i = freeList;
+  Entry& e = entries[i];
+  freeList = e.hashNext;
+
+  e.request.destination = destination;
+  e.request.apparatus = apparatus;
+  e.request.requestID = requestID;
+  e.request.associatedValue = associatedValue;
+  e.request.timeSent = millis();
+
+  uint8_t b = Bucket(destination, apparatus, requestID);
+  e.hashNext = buckets[b];
+  buckets[b] = i;
+
+  // Count from the start of the current tick, rounding up,
+  // so that the request never expires early.
+  unsigned long ticks = (e.request.timeSent - tickStart + timeout + REQUEST_TABLE_TICK_MS - 1) / REQUEST_TABLE_TICK_MS;
+  if (ticks == 0) ticks = 1;
+  e.deadline = currentTick + ticks;
+  Schedule(i);
+
+  count++;
+  return &e.request;
+}
+
+RequestTable::Request* RequestTable::Find(uint8_t destination, uint8_t apparatus, uint16_t requestID)
+{
+  uint8_t i = Lookup(destination, apparatus, requestID);
+  return i == NONE ? NULL : &entries[i].request;
+}
+
+bool RequestTable::Engaged(uint8_t destination, uint8_t apparatus)
+{
+  // Entries in use are the ones on the wheel.
+  for (uint8_t i = 0; i < REQUEST_TABLE_CAPACITY; i++)
+  {
+    Request& r = entries[i].request;
+    if (entries[i].slot != NONE && r.destination == destination && r.apparatus == apparatus)
+      return true;
+  }
+  return false;
+}
+
+bool RequestTable::Remove(uint8_t destination, uint8_t apparatus, uint16_t requestID, Request* removed)
+{
+  uint8_t i = Lookup(destination, apparatus, requestID);
+  if (i == NONE) return false;
+  if (removed) *removed = entries[i].request;
+  Unschedule(i);
+  Release(i);
+  return true;
+}
+
+// Takes an entry out of its hash bucket.
+void RequestTable::Unhash(uint8_t index)
+{
+  Request& r = entries[index].request;
+  uint8_t* link = &buckets[Bucket(r.destination, r.apparatus, r.requestID)];
+  while (*link != index) link = &entries[*link].hashNext;
+  *link = entries[index].hashNext;
+}
+
+// Returns an entry, already off the wheel, to the free list.
+void RequestTable::Release(uint8_t index)
+{
+  Unhash(index);
+  entries[index].hashNext = freeList;
+  freeList = index;
+  count--;
+}
+
+// Puts an entry in the wheel slot for its deadline.
+// Level 0 holds the next 64 ticks, one slot per tick.
+// Level 1 holds the next 4096 ticks, one slot per 64 ticks, and is
+// moved down into level 0 each time level 0 wraps.
+void RequestTable::Schedule(uint8_t index)
+{
+  Entry& e = entries[index];
+  uint32_t delta = e.deadline - currentTick;
+  if ((int32_t)delta < 0) delta = 0;
+
+  if (delta < WHEEL_SIZE)
+    e.slot = (currentTick + delta) & WHEEL_MASK;
+  else
+  {
+    // Beyond the wheel. Park it in the furthest slot and look again then.
+    uint32_t tick = delta < (uint32_t)WHEEL_SIZE * WHEEL_SIZE ? e.deadline : currentTick + WHEEL_SIZE * WHEEL_SIZE - 1;
+    e.slot = WHEEL_SIZE + ((tick >> WHEEL_BITS) & WHEEL_MASK);
+  }
+
+  e.timerPrev = NONE;
+  e.timerNext = wheel[e.slot];
+  if (e.timerNext != NONE) entries[e.timerNext].timerPrev = index;
+  wheel[e.slot] = index;
+}
+
+void RequestTable::Unschedule(uint8_t index)
+{
+  Entry& e = entries[index];
+  if (e.timerPrev != NONE) entries[e.timerPrev].timerNext = e.timerNext;
+  else wheel[e.slot] = e.timerNext;
+  if (e.timerNext != NONE) entries[e.timerNext].timerPrev = e.timerPrev;
+  e.slot = NONE;
+}
+
+uint8_t RequestTable::Expire(ExpiredCallback onExpired)
+{
+  unsigned long ticks = (millis() - tickStart) / REQUEST_TABLE_TICK_MS;
+
+  // tickStart keeps pace with currentTick, so that requests added by
+  // the callback are timed correctly.
+  uint8_t expired = 0;
+  while (ticks > 0 && count > 0)
+  {
+    tickStart += REQUEST_TABLE_TICK_MS;
+    expired += Step(onExpired);
+    ticks--;
+  }
+
+  // Nothing is waiting, so idle ticks can be skipped at once.
+  tickStart += ticks * REQUEST_TABLE_TICK_MS;
+  currentTick += ticks;
+  return expired;
+}
+
+// Advances one tick and expires what is due.
+// Entries are taken off the head of a slot one at a time, so the callback
+// may add or remove requests freely. Nothing it adds is due this tick.
+uint8_t RequestTable::Step(ExpiredCallback onExpired)
+{
+  currentTick++;
+
+  // Level 0 has wrapped. Bring down the next 64 ticks from level 1.
+  if ((currentTick & WHEEL_MASK) == 0)
+  {
+    uint8_t slot = WHEEL_SIZE + ((currentTick >> WHEEL_BITS) & WHEEL_MASK);
+    while (wheel[slot] != NONE)
+    {
+      uint8_t i = wheel[slot];
+      Unschedule(i);
+      Schedule(i);
+    }
+  }
+
+  uint8_t slot = currentTick & WHEEL_MASK;
+  uint8_t expired = 0;
+  while (wheel[slot] != NONE)
+  {
+    uint8_t i = wheel[slot];
+    Unschedule(i);
+
+    if ((int32_t)(entries[i].deadline - currentTick) > 0)
+    {
+      // Parked beyond the wheel. Not due yet.
+      Schedule(i);
+      continue;
+    }
+
+    Request request = entries[i].request;
+    Release(i);
+    expired++;
+    if (onExpired) onExpired(request);
+  }
+  return expired;
+}
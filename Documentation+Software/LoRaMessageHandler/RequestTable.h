@@ -0,0 +1,109 @@
+#pragma once
+
+// Table of outstanding requests for the request/response framework.
+//
+// Requests are keyed by (destination, apparatus, request ID).
+// Storage is a fixed array. Nothing is allocated on the heap.
+// Adding, finding and removing a request are O(1) on average through a
+// small hash index. Unanswered requests are expired by a two-level timer
+// wheel, so each request times out on its own, whatever its position.
+
+#include <Arduino.h>
+
+// Number of requests that can be outstanding at once.
+// Define before including this file to change it.
+#ifndef REQUEST_TABLE_CAPACITY
+#define REQUEST_TABLE_CAPACITY 16
+#endif
+
+// Resolution of timeouts (milliseconds).
+// A request expires no earlier than its timeout and at most one tick later.
+// Timeouts up to 4096 ticks are placed directly. Longer ones are re-placed
+// as they come round.
+#ifndef REQUEST_TABLE_TICK_MS
+#define REQUEST_TABLE_TICK_MS 100
+#endif
+
+class RequestTable
+{
+
+public:
+
+  struct Request
+  {
+    uint8_t destination;
+    uint8_t apparatus;
+    uint16_t requestID;
+    uint32_t associatedValue;
+    unsigned long timeSent; // millis() when added
+  };
+
+  // Called for each request that times out.
+  // The request has already left the table, so it can be added again.
+  typedef void (*ExpiredCallback)(const Request& request);
+
+  // Constructor
+  RequestTable();
+
+  // Adds a request that expires after timeout milliseconds.
+  // Returns NULL if the table is full or the request is already outstanding.
+  Request* Add(uint8_t destination, uint8_t apparatus, uint16_t requestID,
+               uint32_t associatedValue, unsigned long timeout);
+
+  // Returns the outstanding request, or NULL.
+  Request* Find(uint8_t destination, uint8_t apparatus, uint16_t requestID);
+
+  // True if any request to this destination/apparatus is outstanding,
+  // whatever its ID. Scans the table, so it is O(capacity).
+  bool Engaged(uint8_t destination, uint8_t apparatus);
+
+  // Removes an outstanding request, for example once it has been answered.
+  // A copy is left in removed if given.
+  bool Remove(uint8_t destination, uint8_t apparatus, uint16_t requestID,
+              Request* removed = NULL);
+
+  // Removes requests whose timeout has passed and reports each of them.
+  // Call from loop(). Returns the number expired.
+  uint8_t Expire(ExpiredCallback onExpired = NULL);
+
+  uint8_t Count() { return count; }
+  bool Full() { return count == REQUEST_TABLE_CAPACITY; }
+
+private:
+
+  static const uint8_t NONE = 0xFF;
+  static const uint8_t WHEEL_BITS = 6;
+  static const uint8_t WHEEL_SIZE = 1 << WHEEL_BITS;
+  static const uint8_t WHEEL_MASK = WHEEL_SIZE - 1;
+  static const uint8_t BUCKETS = 32; // power of two
+
+  struct Entry
+  {
+    Request request;
+    uint32_t deadline; // tick
+    uint8_t hashNext;  // next in bucket, or next free entry
+    uint8_t timerPrev; // neighbours in a wheel slot
+    uint8_t timerNext;
+    uint8_t slot;      // wheel slot, 0 .. 2 * WHEEL_SIZE - 1
+  };
+
+  Entry entries[REQUEST_TABLE_CAPACITY];
+  uint8_t buckets[BUCKETS];
+  uint8_t wheel[2 * WHEEL_SIZE]; // level 0 by tick, then level 1 by 64 ticks
+  uint8_t freeList;
+  uint8_t count = 0;
+
+  // Time in ticks, advanced by Expire()
+  uint32_t currentTick = 0;
+  unsigned long tickStart; // millis() at the start of currentTick
+
+  static uint8_t Bucket(uint8_t destination, uint8_t apparatus, uint16_t requestID);
+  uint8_t Lookup(uint8_t destination, uint8_t apparatus, uint16_t requestID);
+  void Unhash(uint8_t index);
+  void Schedule(uint8_t index);
+  void Unschedule(uint8_t index);
+  void Release(uint8_t index);
+  uint8_t Step(ExpiredCallback onExpired);
+};
+
+static_assert(REQUEST_TABLE_CAPACITY < 0xFF, "RequestTable indexes entries with a byte");
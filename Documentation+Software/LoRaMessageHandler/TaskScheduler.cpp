@@ -0,0 +1,152 @@
+#include "TaskScheduler.h" // class declaration
+
+TaskScheduler Tasks;
+
+// Constructor
+TaskScheduler::TaskScheduler()
+{
+  for (uint8_t i = 0; i < SCHEDULER_MAX_TASKS; i++)
+  {
+    tasks[i].inUse = false;
+    tasks[i].running = false;
+  }
+}
+
+TaskScheduler::TaskID TaskScheduler::Add(unsigned long delay, unsigned long period, Callback callback,
+                                         ContextCallback contextCallback, void* context)
+{
+  for (uint8_t i = 0; i < SCHEDULER_MAX_TASKS; i++)
+  {
+    Task& t = tasks[i];
+    if (t.inUse || t.running) continue;
+    t.due = millis() + delay;
+    t.period = period;
+    t.callback = callback;
+    t.contextCallback = contextCallback;
+    t.context = context;
+    t.inUse = true;
+    return i;
+  }
+  return NO_TASK;
+}
+
+TaskScheduler::TaskID TaskScheduler::Every(unsigned long period, Callback callback)
+{
+  return Add(period, period, callback, NULL, NULL);
+}
+
+TaskScheduler::TaskID TaskScheduler::Every(unsigned long period, ContextCallback callback, void* context)
+{
+  return Add(period, period, NULL, callback, context);
+}
+
+TaskScheduler::TaskID TaskScheduler::After(unsigned long delay, Callback callback)
+{
+  return Add(delay, 0, callback, NULL, NULL);
+}
+
+TaskScheduler::TaskID TaskScheduler::After(unsigned long delay, ContextCallback callback, void* context)
+{
+  return Add(delay, 0, NULL, callback, context);
+}
+
+bool TaskScheduler::Reschedule(TaskID task, unsigned long delay)
+{
+  if (!Pending(task)) return false;
+  tasks[task].due = millis() + delay;
+  return true;
+}
+
+bool TaskScheduler::Cancel(TaskID task)
+{
+  if (!Pending(task)) return false;
+  tasks[task].inUse = false;
+  return true;
+}
+
+bool TaskScheduler::Pending(TaskID task)
+{
+  return task < SCHEDULER_MAX_TASKS && tasks[task].inUse;
+}
+
+unsigned long TaskScheduler::UntilNext()
+{
+  unsigned long now = millis();
+  unsigned long next = SCHEDULER_MAX_IDLE_MS;
+  for (uint8_t i = 0; i < SCHEDULER_MAX_TASKS; i++)
+  {
+    Task& t = tasks[i];
+    if (!t.inUse || t.running) continue;
+    long remaining = (long)(t.due - now);
+    if (remaining <= 0) return 0;
+    if ((unsigned long)remaining < next) next = remaining;
+  }
+  return next;
+}
+
+// Runs the tasks that are due, each once. Returns how many ran.
+// A periodic task keeps its phase, unless it has fallen a whole
+// period behind, so a late run is not followed by a burst.
+uint8_t TaskScheduler::RunDue()
+{
+  uint8_t ran = 0;
+  for (uint8_t i = 0; i < SCHEDULER_MAX_TASKS; i++)
+  {
+    Task& t = tasks[i];
+    unsigned long now = millis();
+    if (!t.inUse || t.running || (long)(t.due - now) > 0) continue;
+
+    if (t.period == 0) t.inUse = false;
+    else
+    {
+      t.due += t.period;
+      if ((long)(t.due - now) <= 0) t.due = now + t.period;
+    }
+
+    // Copied, since a task that runs once may be replaced while it runs.
+    Callback callback = t.callback;
+    ContextCallback contextCallback = t.contextCallback;
+    void* context = t.context;
+    t.running = true;
+    if (callback) callback();
+    else contextCallback(context);
+    t.running = false;
+    ran++;
+  }
+  return ran;
+}
+
+void TaskScheduler::Run()
+{
+  if (RunDue() > 0) return;
+  unsigned long idle = UntilNext();
+  if (idle > 0) Idle(idle);
+}
+
+void TaskScheduler::Wait(unsigned long milliseconds)
+{
+  unsigned long beginTime = millis();
+  while (millis() - beginTime < milliseconds)
+  {
+    if (RunDue() > 0) continue;
+    unsigned long left = milliseconds - (millis() - beginTime);
+    unsigned long idle = UntilNext();
+    Idle(idle < left ? idle : left);
+  }
+}
+
+void TaskScheduler::Idle(unsigned long milliseconds)
+{
+  if (milliseconds == 0) return;
+  if (idleHook)
+  {
+    idleHook(milliseconds);
+    return;
+  }
+
+#if defined(ARDUINO_ARCH_SAMD)
+  __WFI(); // the 1 ms SysTick, or any other interrupt, wakes the core
+#elif !defined(ARDUINO)
+  if (HostClock::isVirtual()) HostClock::advanceMicros(milliseconds * 1000UL);
+#endif
+}
@@ -0,0 +1,101 @@
+#pragma once
+
+// Cooperative task scheduler.
+//
+// Replaces busy-wait loops on millis(). Work that has to happen later,
+// or periodically, is registered as a task and run from loop() by
+// Tasks.Run(). Between tasks the node idles, through a hook that can put
+// it to sleep, instead of spinning.
+//
+// Tasks run to completion, one at a time, and must not block.
+// Storage is a fixed array. Nothing is allocated on the heap.
+//
+// Host builds on a virtual clock (HostClock::setVirtual) idle by
+// advancing the clock to the next task, so they run at once.
+
+#include <Arduino.h>
+
+// Number of tasks that can be registered at once.
+// Define before including this file to change it.
+#ifndef SCHEDULER_MAX_TASKS
+#define SCHEDULER_MAX_TASKS 8
+#endif
+
+// Longest single idle period (milliseconds), also when no task is due.
+#ifndef SCHEDULER_MAX_IDLE_MS
+#define SCHEDULER_MAX_IDLE_MS 100
+#endif
+
+class TaskScheduler
+{
+
+public:
+
+  typedef uint8_t TaskID;
+  static const TaskID NO_TASK = 0xFF;
+
+  typedef void (*Callback)();
+  typedef void (*ContextCallback)(void* context);
+
+  // Called when nothing is due, with the milliseconds until something is.
+  // It may sleep for up to that long. Wake-ups need not be exact.
+  typedef void (*IdleHook)(unsigned long milliseconds);
+
+  // Constructor
+  TaskScheduler();
+
+  // Runs a task every period milliseconds, first after one period.
+  TaskID Every(unsigned long period, Callback callback);
+  TaskID Every(unsigned long period, ContextCallback callback, void* context);
+
+  // Runs a task once, after delay milliseconds.
+  // The task is removed before it runs, so it can register itself again.
+  TaskID After(unsigned long delay, Callback callback);
+  TaskID After(unsigned long delay, ContextCallback callback, void* context);
+
+  // Next run of a task is delay milliseconds from now.
+  bool Reschedule(TaskID task, unsigned long delay);
+
+  bool Cancel(TaskID task);
+  bool Pending(TaskID task);
+
+  // Runs every task that is due, then idles until the next one is.
+  // Call from loop().
+  void Run();
+
+  // Runs tasks for the given time. Use in place of delay() or busy-wait
+  // loops. A task that calls Wait() is not run again until it returns.
+  void Wait(unsigned long milliseconds);
+
+  // NULL restores the default, which sleeps until the next interrupt on
+  // SAMD boards, advances a virtual clock on the host, and otherwise
+  // returns at once.
+  void SetIdleHook(IdleHook hook) { idleHook = hook; }
+
+  // Milliseconds until the next task is due, 0 if one is due now.
+  unsigned long UntilNext();
+
+private:
+
+  struct Task
+  {
+    unsigned long due;    // millis() of the next run
+    unsigned long period; // 0 for tasks that run once
+    Callback callback;
+    ContextCallback contextCallback;
+    void* context;
+    bool inUse;
+    bool running;
+  };
+
+  Task tasks[SCHEDULER_MAX_TASKS];
+  IdleHook idleHook = NULL;
+
+  TaskID Add(unsigned long delay, unsigned long period, Callback callback,
+             ContextCallback contextCallback, void* context);
+  uint8_t RunDue();
+  void Idle(unsigned long milliseconds);
+};
+
+// The scheduler used by the message handler and the sketches.
+extern TaskScheduler Tasks;
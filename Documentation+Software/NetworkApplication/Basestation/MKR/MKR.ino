@@ -12,6 +12,30 @@
 // Unique address of this network node.
 #define localAddress 3
 
+// Uncomment when relays use gradient routing.
+// Beacons let them learn their distance to this node.
+//#define GRADIENT_ROUTING
+
+// Uncomment to keep the network on this node's clock.
+// Beacons carry its time; nodes adjust theirs to it.
+//#define TIME_SYNC
+
+// Uncomment to schedule the channel (TDMA). Nodes get a slot when this
+// node first hears from them, and learn the schedule from beacons.
+//#define TDMA
+
+// Uncomment, with TDMA, to spread the slots over the channels of the
+// hopping plan. Nodes follow the schedule. See LoRaMessageHandler.h
+//#define FREQUENCY_HOPPING
+const unsigned long beaconInterval = 60000; // milliseconds between beacons
+unsigned long lastBeaconTime = 0;
+
+// Uncomment to ask the relays for their telemetry every so often.
+// It is passed on to the PC. See LoRaMessageHandler.h
+//#define TELEMETRY
+const unsigned long telemetryInterval = 600000; // milliseconds between requests
+unsigned long lastTelemetryTime = 0;
+
 // Establish message-tracking table.
 // Allows for ignoring older messages.
 // Assumes low message rate from any particular node.
@@ -24,15 +48,79 @@
 #define MAX_NUM_NODES 24
 uint16_t MessageTrackingTable[MAX_NUM_NODES + 1];
 
+// Messages go to the PC in records, with how they were received.
+// Values are high byte first, signed where marked.
+//   0  UPLINK_SYNC_0, UPLINK_SYNC_1  start of a record
+//   2  record type, UPLINK_RECORD_MESSAGE
+//   3  time received (network time, milliseconds, 4 bytes)
+//   7  RSSI (dBm, 2 bytes, signed)
+//   9  SNR (1/4 dB, signed)
+//  10  frequency error (Hz, 4 bytes, signed)
+//  14  channel, HOME_CHANNEL unless hopping
+//  15  records dropped just before this one (2 bytes)
+//  17  the message, length first
+//  then a CRC-16/DNP of bytes 2 on (2 bytes)
+// Each record is written in one block. One the USB link does not take
+// is dropped, rather than hold up the radio, and counted in the next.
+// The MKR's serial port is native USB, which runs at USB speed whatever
+// the baud rate. UPLINK_BAUD_RATE matters only for boards with a UART.
+#define UPLINK_BAUD_RATE        115200
+#define UPLINK_SYNC_0           0xA5
+#define UPLINK_SYNC_1           0x5A
+#define UPLINK_RECORD_MESSAGE   1
+#define UPLINK_HEADER_LENGTH    17
+#define UPLINK_CRC_LENGTH       2
+
 // Library for LoRa message handling.
 // Initializes LoRa library.
 #include <LoRaMessageHandler.h>
 LoRaMessageHandler *MessagingLibrary = NULL;
 
+// Sends a received message to the PC, in a record.
+void SendRecord(const uint8_t* message)
+{
+  static uint8_t record[UPLINK_HEADER_LENGTH + 256 + UPLINK_CRC_LENGTH];
+  static uint16_t dropped = 0;
+
+  uint32_t time = MessagingLibrary->NetworkTime();
+  int16_t rssi = LoRa.packetRssi();
+  int8_t snr = (int8_t)(LoRa.packetSnr() * 4);
+  int32_t frequencyError = LoRa.packetFrequencyError();
+  uint8_t i = 0;
+  record[i++] = UPLINK_SYNC_0;
+  record[i++] = UPLINK_SYNC_1;
+  record[i++] = UPLINK_RECORD_MESSAGE;
+  record[i++] = (uint8_t)(time >> 24);
+  record[i++] = (uint8_t)(time >> 16);
+  record[i++] = (uint8_t)(time >> 8);
+  record[i++] = (uint8_t)time;
+  record[i++] = (uint8_t)(rssi >> 8);
+  record[i++] = (uint8_t)rssi;
+  record[i++] = (uint8_t)snr;
+  record[i++] = (uint8_t)(frequencyError >> 24);
+  record[i++] = (uint8_t)(frequencyError >> 16);
+  record[i++] = (uint8_t)(frequencyError >> 8);
+  record[i++] = (uint8_t)frequencyError;
+  record[i++] = MessagingLibrary->Channel();
+  record[i++] = (uint8_t)(dropped >> 8);
+  record[i++] = (uint8_t)dropped;
+
+  uint16_t length = UPLINK_HEADER_LENGTH;
+  memcpy(record + length, message, message[LOCATION_MESSAGE_LENGTH]);
+  length += message[LOCATION_MESSAGE_LENGTH];
+  CRC16DNP crc;
+  crc.Update(record + 2, length - 2);
+  record[length++] = (uint8_t)(crc.Value() >> 8);
+  record[length++] = (uint8_t)crc.Value();
+
+  if (Serial.write(record, length) == length) dropped = 0;
+  else if (dropped < 0xFFFF) dropped++;
+}
+
 void setup()
 {
   // Initialize serial port
-  Serial.begin(9600);
+  Serial.begin(UPLINK_BAUD_RATE);
   while (!Serial) delay(500); // wait for serial port to be ready
   #ifdef DEBUG
     Serial.println("Microcontroller is active");
@@ -40,6 +128,12 @@ void setup()
   
   // Initialize Messaging and LoRa libraries
   MessagingLibrary = new LoRaMessageHandler(localAddress);
+  #ifdef TDMA
+    MessagingLibrary->StartSchedule();
+    #ifdef FREQUENCY_HOPPING
+      MessagingLibrary->EnableHopping();
+    #endif
+  #endif
 
   // Initialize message tracking table
   for(uint8_t i = 0; i <= MAX_NUM_NODES; i++)
@@ -55,6 +149,21 @@ void setup()
 
 void loop()
 {
+  #if defined(GRADIENT_ROUTING) || defined(TIME_SYNC) || defined(TDMA)
+    if(millis() - lastBeaconTime >= beaconInterval)
+    {
+      MessagingLibrary->SendBeacon();
+      lastBeaconTime = millis();
+    }
+  #endif
+  #ifdef TELEMETRY
+    if(millis() - lastTelemetryTime >= telemetryInterval)
+    {
+      MessagingLibrary->SendRequest(TELEMETRY_APPARATUS, 0, 0); // to the relays
+      lastTelemetryTime = millis();
+    }
+  #endif
+
   // Check for incoming messages.
   // Rebroadcast messages as appropriate.
   if(MessagingLibrary->CheckForIncomingPacket() > 0)
@@ -92,6 +201,21 @@ void loop()
       return;
     }
 
+    // Relays all have address 0 and number their messages each on their
+    // own. Their telemetry gets no slot and is not tracked.
+    bool fromRelay = thisMessage[LOCATION_SOURCE_ID] == 0;
+
+    // Nodes heard from get a slot, in the schedule of the next beacon.
+    #ifdef TDMA
+      if(!fromRelay &&
+         MessagingLibrary->AssignSlot(thisMessage[LOCATION_SOURCE_ID]) == TDMA_NO_SLOT)
+      {
+        #ifdef DEBUG
+          Serial.println("*** No slot left for node " + String(thisMessage[LOCATION_SOURCE_ID]));
+        #endif
+      }
+    #endif
+
     // Reset message tracking table as appropriate.
     // What maybe needs to happen is for a node to send out
     // a reset message before its message ID counter resets itself.
@@ -101,12 +225,14 @@ void loop()
       MessageTrackingTable[thisMessage[LOCATION_SOURCE_ID]] = 0;
       
     // Ignore messages already seen.
-    if(thisMessageID <= MessageTrackingTable[thisMessage[LOCATION_SOURCE_ID]])
+    if(!fromRelay &&
+       thisMessageID <= MessageTrackingTable[thisMessage[LOCATION_SOURCE_ID]])
     {
       #ifdef DEBUG
         Serial.println("*** Old message (MsgID / TableID) (" + String(thisMessageID) + 
           " / " + String(MessageTrackingTable[thisMessage[LOCATION_SOURCE_ID]]) + ")");
       #endif
+      MessagingLibrary->CountDrop(TELEMETRY_DROP_DUPLICATE);
       return;
     }
     else MessageTrackingTable[thisMessage[LOCATION_SOURCE_ID]] = thisMessageID;
@@ -127,9 +253,7 @@ void loop()
 
     #else
       // when not debugging, write the message to the serial port
-      for(uint8_t i = 0; i < thisMessage[LOCATION_MESSAGE_LENGTH]; i++)
-        Serial.write(thisMessage[i]);
-      Serial.flush();
+      SendRecord(thisMessage);
     #endif
   }
 }
@@ -0,0 +1,60 @@
+# Converts raw ADC codes sent by sensor nodes, using the nodes' own calibration tables.
+# The tables are read from Calibration/SensorCalibration.h so that there is one copy of them.
+# The arithmetic is the integer arithmetic of Calibration.h, so the results are identical.
+
+import os # https://docs.python.org/3.10/library/os.html
+import re # https://docs.python.org/3.10/library/re.html
+
+# Where the C++ headers are, relative to this file
+CALIBRATION_DIRECTORY = os.path.join(os.path.dirname(os.path.abspath(__file__)), "..", "..", "..", "Calibration")
+
+# Same meaning as the C++ constants. See Calibration.h
+CALIBRATION_SLOPE_BITS = 24
+IN_RANGE = "InRange"
+BELOW_RANGE = "BelowRange"
+ABOVE_RANGE = "AboveRange"
+
+# Division rounded to nearest, halves away from zero, as Divide() in Calibration.h.
+# C++ integer division truncates, so the sign is handled separately.
+def RoundedDivide(numerator, denominator):
+  magnitude = (abs(numerator) + denominator // 2) // denominator
+  return -magnitude if numerator < 0 else magnitude
+
+class CalibrationTable:
+  def __init__(self, points, referenceMillivolts, adcLevels):
+    self.referenceMillivolts = referenceMillivolts
+    self.segments = []
+    for i in range(len(points)):
+      millivolts, value = points[i]
+      slope = 0
+      if i + 1 < len(points) and points[i + 1][0] > millivolts:
+        slope = RoundedDivide((points[i + 1][1] - value) << CALIBRATION_SLOPE_BITS,
+                              (points[i + 1][0] - millivolts) * adcLevels)
+      self.segments.append((millivolts * adcLevels, value, slope))
+
+  # Returns (status, value) for an ADC code. Out-of-range values are clamped.
+  # An oversampled code can be given with its fraction bits.
+  def Convert(self, code, fractionBits = 0):
+    position = code * self.referenceMillivolts
+    if position < self.segments[0][0] << fractionBits: return BELOW_RANGE, self.segments[0][1]
+    if position > self.segments[-1][0] << fractionBits: return ABOVE_RANGE, self.segments[-1][1]
+    segment = self.segments[0]
+    for s in self.segments:
+      if s[0] << fractionBits <= position: segment = s
+    start, value, slope = segment
+    shift = CALIBRATION_SLOPE_BITS + fractionBits
+    return IN_RANGE, value + (((position - (start << fractionBits)) * slope + (1 << (shift - 1))) >> shift)
+
+# Reads the ADC settings from Calibration.h and every table from SensorCalibration.h.
+# Returns a dictionary of CalibrationTable, keyed by the C++ name, for example "SOIL_VWC_POINTS".
+def LoadCalibrations(directory = CALIBRATION_DIRECTORY):
+  with open(os.path.join(directory, "Calibration.h")) as header: text = header.read()
+  referenceMillivolts = int(re.search(r"#define CALIBRATION_REFERENCE_MV (\d+)", text).group(1))
+  adcLevels = 1 << int(re.search(r"#define CALIBRATION_ADC_BITS (\d+)", text).group(1))
+
+  tables = {}
+  with open(os.path.join(directory, "SensorCalibration.h")) as header: text = header.read()
+  for name, body in re.findall(r"CalibrationPoint (\w+)\[\] =\s*\{(.*?)\};", text, re.DOTALL):
+    points = [(int(mv), int(value)) for mv, value in re.findall(r"\{\s*(-?\d+)\s*,\s*(-?\d+)\s*\}", body)]
+    tables[name] = CalibrationTable(points, referenceMillivolts, adcLevels)
+  return tables
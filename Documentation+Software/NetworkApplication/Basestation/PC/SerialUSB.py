@@ -6,6 +6,8 @@ import logging # https://docs.python.org/3.10/library/logging.html
 import threading # https://docs.python.org/3.10/library/threading.html
 import time # https://docs.python.org/3.10/library/time.html
 import queue # https://www.guru99.com/python-queue-example.html, https://docs.python.org/3.10/library/queue.html
+import struct # https://docs.python.org/3.10/library/struct.html
+import collections # https://docs.python.org/3.10/library/collections.html
 
 # Import pyserial library for working with USB/Serial ports
 # https://pypi.org/project/pyserial
@@ -14,7 +16,24 @@ import serial, serial.tools.list_ports
 # Refers to serial port through which microcontroller talks to PC
 Serial_Port = None
 SERIAL_PORT_NAME = 'COM3' # Windows
-SERIAL_PORT_BAUD_RATE = 9600
+SERIAL_PORT_BAUD_RATE = 115200 # UPLINK_BAUD_RATE in the basestation's sketch
+SERIAL_PORT_TIMEOUT = 0.1 # seconds a read waits for data
+
+# Records from the basestation, each a received message and how it was
+# received. See the basestation's sketch (MKR.ino) for the layout.
+UPLINK_SYNC = b'\xA5\x5A'
+UPLINK_RECORD_MESSAGE = 1
+UPLINK_HEADER_LENGTH = 17
+UPLINK_CRC_LENGTH = 2
+UPLINK_HEADER_FORMAT = '>BIhbiBH' # after the sync bytes
+HOME_CHANNEL = 0xFF
+
+# message: the message, as the basestation received it
+# time: network time it came in (milliseconds)
+# rssi (dBm), snr (dB), frequencyError (Hz)
+# channel: hopping channel, HOME_CHANNEL if not hopping
+# dropped: records the basestation could not send just before this one
+Record = collections.namedtuple('Record', 'message time rssi snr frequencyError channel dropped')
 
 # Creates the message queue
 # https://docs.python.org/3.10/library/queue.html
@@ -43,7 +62,7 @@ def ConnectSerialPort(GENERIC_PORT_NAME):
   global Serial_Port
   # Identify the device attached to the named serial port
   try:
-    Serial_Port = serial.Serial(SERIAL_PORT_NAME, SERIAL_PORT_BAUD_RATE)
+    Serial_Port = serial.Serial(SERIAL_PORT_NAME, SERIAL_PORT_BAUD_RATE, timeout = SERIAL_PORT_TIMEOUT)
   except Exception as thisException:  # https://docs.python.org/3/tutorial/errors.html
     logging.info(str(thisException))
     logging.info("\tIs the " + GENERIC_PORT_NAME + " device connected and active?")
@@ -53,16 +72,54 @@ def ConnectSerialPort(GENERIC_PORT_NAME):
     return
   time.sleep(5)  # wait long enough for the device to be ready
 
-# Get the next message from the queue
-def GetNextMessage():
+# CRC-16/DNP, same as crcr16dnp(data, len, 0) in crc-16-dnp.h
+def crc16dnp(data):
+  crc = 0xFFFF
+  for byte in data:
+    crc ^= byte
+    for bit in range(8):
+      if crc & 1: crc = (crc >> 1) ^ 0xA6BC
+      else: crc >>= 1
+  return crc ^ 0xFFFF
+
+# Takes the complete records out of the start of buffer, a bytearray.
+# Bytes that are not part of a good record are skipped, so a record cut
+# short or corrupted costs only itself.
+def ParseRecords(buffer):
+  records = []
+  while True:
+    start = buffer.find(UPLINK_SYNC)
+    if start < 0:
+      del buffer[0 : max(len(buffer) - 1, 0)] # may end with half the sync
+      return records
+    del buffer[0 : start]
+    if len(buffer) <= UPLINK_HEADER_LENGTH: return records
+    length = UPLINK_HEADER_LENGTH + buffer[UPLINK_HEADER_LENGTH] + UPLINK_CRC_LENGTH
+    if len(buffer) < length: return records
+
+    crc = (buffer[length - 2] << 8) | buffer[length - 1]
+    if buffer[2] != UPLINK_RECORD_MESSAGE or \
+       buffer[UPLINK_HEADER_LENGTH] == 0 or \
+       crc16dnp(buffer[2 : length - UPLINK_CRC_LENGTH]) != crc:
+      del buffer[0 : 1] # look for the next sync
+      continue
+
+    recordType, time, rssi, snr, frequencyError, channel, dropped = \
+      struct.unpack_from(UPLINK_HEADER_FORMAT, buffer, len(UPLINK_SYNC))
+    message = bytes(buffer[UPLINK_HEADER_LENGTH : length - UPLINK_CRC_LENGTH])
+    records.append(Record(message, time, rssi, snr / 4, frequencyError, channel, dropped))
+    del buffer[0 : length]
+
+# Get the next record from the queue
+def GetNextRecord():
   messageQueue_mutex.acquire()
   if messageQueue.empty():
     messageQueue_mutex.release()
     return None
   else:
-    message = messageQueue.get()
+    record = messageQueue.get()
     messageQueue_mutex.release()
-    return message
+    return record
 
 # Thread for gathering messages as they arrive
 def USB_Serial_Connection(name):
@@ -87,13 +144,14 @@ def USB_Serial_Connection(name):
   # Tell the LoRa device we are ready to receive and process messages.
   logging.info("Awaiting Messages...\n")
   #Serial_Port.flushInput() # https://stackoverflow.com/questions/7266558/pyserial-buffer-wont-flush
-  # Receive messages and place in queue
+  # Receive records and place in queue.
+  # Reads whatever has arrived in one call, or waits up to the timeout.
+  buffer = bytearray()
   while USB_Serial_Connection_event.is_set():
-    if Serial_Port.in_waiting > 0:
-      messageLength = Serial_Port.read()
-      incomingMessage = messageLength + Serial_Port.read(int.from_bytes(messageLength, 'little') - 1)
+    buffer += Serial_Port.read(max(1, Serial_Port.in_waiting))
+    for record in ParseRecords(buffer):
       messageQueue_mutex.acquire()
-      messageQueue.put(incomingMessage)
+      messageQueue.put(record)
       messageQueue_mutex.release()
 
   # Thread ends
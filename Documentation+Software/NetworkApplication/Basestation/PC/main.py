@@ -31,11 +31,15 @@ import numpy
 # Import python native functions
 import datetime # https://docs.python.org/3.10/library/datetime.html
 import threading # https://docs.python.org/3.10/library/threading.html
+import struct # https://docs.python.org/3.10/library/struct.html
 
 # Import author's library for working with USB/Serial connections.
 # Variables associated with the connection are set here.
 import SerialUSB
 
+# Import author's library for converting raw ADC codes with the sensor nodes' calibrations.
+import Calibration
+
 # ========================================================
 
 # ================ Create Basic GUI Frame ================
@@ -160,13 +164,60 @@ LOCATION_SENSOR_ID       = 7
 LOCATION_REBROADCASTS    = 8
 MESSAGE_HEADER_LENGTH    = 9
 
+# Optional end-to-end CRC. See LoRaMessageHandler.h
+MESSAGE_FLAG_CRC         = 0x80
+MESSAGE_CRC_LENGTH       = 2
+
+# Telemetry, a datagram of one fragment (type 7). See LoRaMessageHandler.h
+LOCATION_FRAGMENT_DATA   = MESSAGE_HEADER_LENGTH + 4
+TELEMETRY_APPARATUS      = 0xFE
+TELEMETRY_VERSION        = 1
+TELEMETRY_FORMAT         = '>BHII7IIIIIIB'
+TELEMETRY_DROP_REASONS   = ["size", "not for it", "TTL", "duplicate", "route", "invalid", "queue full"]
+
 # Communications thread
 USB_Serial_Connection_thread = None
 
+# Calibrations for values sent as raw ADC readings ("RAW" messages).
+# Keyed by the name in the message. Calibrated values are in hundredths.
+# Readings are oversampled, in 1/16 of an ADC code. See Acquisition.h
+calibrationTables = Calibration.LoadCalibrations()
+RAW_CALIBRATIONS = {"VWC" : "SOIL_VWC_POINTS", "BattV" : "BATTERY_POINTS"}
+RAW_FRACTION_BITS = 4
+
 # ========================================================
 
 # ================ Callable Functions ====================
 
+# Summary of the counters in a telemetry message, None if there are none.
+def DecodeTelemetry(message):
+  data = message[LOCATION_FRAGMENT_DATA : len(message)]
+  if len(data) < struct.calcsize(TELEMETRY_FORMAT) or data[0] != TELEMETRY_VERSION: return None
+  values = struct.unpack_from(TELEMETRY_FORMAT, data)
+  reporter, uptime, received = values[1 : 4]
+  dropped = values[4 : 4 + len(TELEMETRY_DROP_REASONS)]
+  sent, airtimeSent, airtimeHeard, channelBusy, backoff, queueHighWater = values[4 + len(TELEMETRY_DROP_REASONS) :]
+  node = ("Relay " if message[LOCATION_SOURCE_ID] == 0 else "Node ") + str(reporter)
+  drops = ", ".join(reason + " " + str(count) for reason, count in zip(TELEMETRY_DROP_REASONS, dropped) if count > 0)
+  return node + ": up " + str(uptime) + " s, heard " + str(received) + \
+         " (" + str(airtimeHeard) + " ms), sent " + str(sent) + " (" + str(airtimeSent) + " ms), busy " + \
+         str(channelBusy) + ", backoff " + str(backoff) + " ms, queue " + str(queueHighWater) + \
+         ", dropped: " + (drops if drops else "none")
+
+# Check the end-to-end CRC of a message that carries one.
+# Returns the message without its CRC, or None if the check fails.
+# Messages without a CRC are returned unchanged.
+def CheckEndToEndCRC(message):
+  if not message[LOCATION_MESSAGE_TYPE] & MESSAGE_FLAG_CRC: return message
+  length = message[LOCATION_MESSAGE_LENGTH]
+  if length != len(message) or length < MESSAGE_HEADER_LENGTH + MESSAGE_CRC_LENGTH: return None
+  covered = message[0 : LOCATION_REBROADCASTS] + message[LOCATION_REBROADCASTS + 1 : length - MESSAGE_CRC_LENGTH]
+  if SerialUSB.crc16dnp(covered) != (message[length - 2] << 8) | message[length - 1]: return None
+  message = bytearray(message[0 : length - MESSAGE_CRC_LENGTH])
+  message[LOCATION_MESSAGE_LENGTH] = length - MESSAGE_CRC_LENGTH
+  message[LOCATION_MESSAGE_TYPE] &= ~MESSAGE_FLAG_CRC & 0xFF
+  return bytes(message)
+
 # What happens when start_button is pressed
 def Start_Button_functionality():
   # Start the thread that receives and queues messages
@@ -188,7 +239,7 @@ def Start_Button_functionality():
   # https://learn.theprogrammingfoundation.org/programming/python/file-handling/?gclid=EAIaIQobChMIstuaj56_gQMVjt3jBx3n6AAeEAAYASAAEgLCSPD_BwE
   sensorDataFile = open(sensorDataFilename, "w")
   if sensorDataFile is None: print("Could not open the file ", sensorDataFilename)
-  else: sensorDataFile.write("Date,Time,Node-Sensor-TypeData,Value Received\n")
+  else: sensorDataFile.write("Date,Time,Node-Sensor-TypeData,Value Received,RSSI,SNR\n")
 
 # What happens when stop_button is pressed
 def Stop_Button_functionality():
@@ -214,8 +265,15 @@ def animate(iteration):
   # Give a chance for other buttons to be checked
   root.update() # https://stackoverflow.com/questions/27050492/how-do-you-create-a-tkinter-gui-stop-button-to-break-an-infinite-loop
 
-  # Retrieve next message
-  message = SerialUSB.GetNextMessage()
+  # Retrieve next message, and how it was received
+  message = None
+  record = SerialUSB.GetNextRecord()
+  if record is not None:
+    message = record.message
+    if record.dropped > 0:
+      postGeneralInformation("Basestation dropped " + str(record.dropped) + " message(s)")
+    message = CheckEndToEndCRC(message)
+    if message is None: print("Message failed its end-to-end CRC. Message Rejected")
   if message is not None:
       # Get the message ID
       messageID = \
@@ -223,7 +281,8 @@ def animate(iteration):
 
       if messageID is not None:
         print("Message ", messageID, " of type ",
-              message[LOCATION_MESSAGE_TYPE], " (", message[LOCATION_MESSAGE_LENGTH] , ")", end = "")
+              message[LOCATION_MESSAGE_TYPE], " (", message[LOCATION_MESSAGE_LENGTH] , ")",
+              " RSSI ", record.rssi, " SNR ", record.snr, end = "")
 
         # Check for message type 3, text-only notification
         if message[LOCATION_MESSAGE_TYPE] == 3:
@@ -233,6 +292,18 @@ def animate(iteration):
           postGeneralInformation(messageDecoded)
           messageDecoded = messageDecoded.split(':') # https://www.freecodecamp.org/news/how-to-parse-a-string-in-python
 
+          # Raw ADC codes are calibrated here, then treated as data
+          if messageDecoded[0].strip() == "RAW" and \
+             (len(messageDecoded) - 1) % 2 == 0:
+            messageDecoded[0] = "DATA"
+            for v in range(1, len(messageDecoded), 2):
+              name = messageDecoded[v].strip()
+              if name not in RAW_CALIBRATIONS: continue
+              status, value = calibrationTables[RAW_CALIBRATIONS[name]].Convert(int(messageDecoded[v + 1]), RAW_FRACTION_BITS)
+              messageDecoded[v + 1] = "%.2f" % (value / 100)
+              if status != Calibration.IN_RANGE:
+                postGeneralInformation(str(message[LOCATION_SOURCE_ID]) + "-" + name + " out of calibrated range")
+
           # What to do with data
           if messageDecoded[0].strip() == "DATA" and \
              (len(messageDecoded) - 1) % 2 == 0:
@@ -245,7 +316,8 @@ def animate(iteration):
               now = now[0 : now.rfind('.')]
               if sensorDataFile is not None:  # https://www.w3schools.com/python/python_file_write.asp
                 sensorDataFile.write(str(datetime.date.today()) + "," + now + "," +
-                                     sensorNomenclature + "," + messageDecoded[v + 1] + "\n")
+                                     sensorNomenclature + "," + messageDecoded[v + 1] + "," +
+                                     str(record.rssi) + "," + str(record.snr) + "\n")
 
               # See if we have that sensor already in our list.
               # If not already in the list, add it.
@@ -322,6 +394,14 @@ def animate(iteration):
                 startColumn += 1 # Get the next column
             else: print("\tAssumed image dimensions less than incoming image. Skipping.")
 
+        # Check for message type 7 with TELEMETRY_APPARATUS, a node's counters
+        elif message[LOCATION_MESSAGE_TYPE] == 7 and message[LOCATION_SENSOR_ID] == TELEMETRY_APPARATUS:
+          telemetry = DecodeTelemetry(message)
+          if telemetry is None: print("\tTelemetry not readable. Message Rejected")
+          else:
+            print("\t", telemetry)
+            postGeneralInformation(telemetry)
+
         # Message type not recognized
         else: print("\tMessage Type ", message[LOCATION_MESSAGE_TYPE], " not recognized. Message Rejected")
 
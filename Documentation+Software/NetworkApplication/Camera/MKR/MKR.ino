@@ -24,7 +24,7 @@ void setup()
 {
   // Initialize Arduino
   Serial.begin(9600);
-  while(!Serial) Wait(100); // make sure Serial is ready
+  while(!Serial) Tasks.Wait(100); // make sure Serial is ready
 
   #ifdef DEBUG
     // Open Serial1
@@ -94,7 +94,7 @@ void TransceiverConnect()
   MESSAGE[1] = 0;
   while((MESSAGE[0] != 2) || (MESSAGE[1] != HANDSHAKE))
   {
-    Wait(100);
+    Tasks.Wait(100);
     ReceiveMessage();
   }
 }
@@ -147,13 +147,3 @@ void ForwardMessage(String text)
   sprintf((char*)(MESSAGE + 1), "%s", text.c_str());
   ForwardMessage();
 }
-
-// Wait for a specific number of milliseconds.
-// delay() is blocking so we do not use that.
-// This approach does not use hardware-specific timers.
-void Wait(long milliseconds)
-{
-  long beginTime = millis();
-  uint8_t doSomething = 0;
-  while ((millis() - beginTime) <= milliseconds) doSomething++;
-}
@@ -0,0 +1,219 @@
+#pragma once
+
+// Resumable camera exporter.
+//
+// Sends an image segment by segment without blocking. Call Step() from
+// loop(). Each call does one small piece of work: it reads commands, packs
+// the next segment, or writes whatever fits in the serial output buffer.
+// The cursor (row, column, segment) keeps its place between calls, so
+// the sketch can do other work between them.
+//
+// The connected device paces the transfer with two-byte messages, as in
+// the handshake:
+//   2 'H'  When idle, requests an image. Afterwards, a credit for one segment.
+//   2 'A'  Aborts the image. The next credit is answered with "Done".
+// The image ends with a "Done" text message, which also takes a credit.
+//
+// Segment layout (message length first):
+//   length, row (2), column (2), pixel count, depth, then the pixels.
+//
+// Pixels come from a CameraSource, so that a synthetic frame can stand in
+// for the camera, for example when benchmarking on a PC.
+
+// Images have depth.
+// Ex: An RGB image has depth of three. Grayscale has a depth of one.
+// Software assumes a depth of no more than 255 and no less than 1.
+// Presently using Pixy2.1 camera, an RGB camera, depth of three.
+#define IMAGE_DEPTH 3
+
+// Number of rows and columns to skip at the image's edges.
+// For Pixy2.1, each pixel referenced exists within a 5x5 box.
+// The referenced pixel is the box' center pixel.
+// The delivered pixel value is an average of those five pixels.
+// Unable to find a reliable way of changing that.
+#define NUMBER_TO_SKIP 2
+
+// Paints the image row by row.
+// The number of columns is divided by SEGMENT_SIZE,
+// the number of pixels that fit within a message envelope.
+// The standard envelope contains MESSAGE_HEADER_LENGTH bytes.
+// The envelope for message type 000 contains an extra 6 bytes.
+#define SEGMENT_SIZE ((MAX_MESSAGE_LENGTH - MESSAGE_HEADER_LENGTH - 6) / IMAGE_DEPTH)
+
+// Commands from the connected device
+#define CAMERA_CREDIT ((unsigned char)'H')
+#define CAMERA_ABORT ((unsigned char)'A')
+
+// Where pixels come from.
+class CameraSource
+{
+public:
+  virtual unsigned int Width() = 0;
+  virtual unsigned int Height() = 0;
+  virtual void GetRGB(unsigned int column, unsigned int row,
+                      unsigned char* red, unsigned char* green, unsigned char* blue) = 0;
+};
+
+class CameraPipeline
+{
+
+public:
+
+  // message holds the segment being sent, MAX_MESSAGE_LENGTH + 1 bytes.
+  // It is only used while an image is being sent.
+  CameraPipeline(CameraSource& camera, Stream& port, unsigned char* message) :
+    camera(camera), port(port), message(message) {}
+
+  // Does one piece of work. Returns true while an image is being sent.
+  bool Step()
+  {
+    ReadCommands();
+    if (!active) return false;
+
+    if (sending)
+    {
+      Write();
+      return active;
+    }
+    if (!packed)
+    {
+      Pack();
+      return true;
+    }
+    if (credits > 0)
+    {
+      credits--;
+      sending = true;
+      written = 0;
+      Write();
+    }
+    return true;
+  }
+
+  // Same as the commands, for callers that do not use the port for them.
+  void Start()
+  {
+    active = true;
+    sending = false;
+    packed = false;
+    done = false;
+    credits = 0;
+    row = NUMBER_TO_SKIP;
+    column = NUMBER_TO_SKIP;
+    segment = 0;
+  }
+  void Credit() { if (active) credits++; }
+  void Abort()
+  {
+    if (!active) return;
+    row = camera.Height(); // the next segment packed is "Done"
+    if (!sending) packed = false;
+  }
+
+  // Packs the segment at the cursor into message and moves the cursor on.
+  // Past the last row, packs "Done". Step() calls this.
+  void Pack()
+  {
+    if (row >= camera.Height() - NUMBER_TO_SKIP)
+    {
+      memcpy(message + 1, "Done", 4);
+      message[0] = 5;
+      done = true;
+      packed = true;
+      return;
+    }
+    unsigned int end = camera.Width() - NUMBER_TO_SKIP;
+    unsigned char count = (unsigned char)(end - column < SEGMENT_SIZE ? end - column : SEGMENT_SIZE);
+
+    // row and column indicate where a given segment of pixels starts.
+    unsigned char messageIndex = 1;
+    message[messageIndex++] = (unsigned char)(row >> 8);
+    message[messageIndex++] = (unsigned char)row;
+    message[messageIndex++] = (unsigned char)(column >> 8);
+    message[messageIndex++] = (unsigned char)column;
+    message[messageIndex++] = count;
+    message[messageIndex++] = IMAGE_DEPTH;
+    for (unsigned char p = 0; p < count; p++, messageIndex += IMAGE_DEPTH)
+      camera.GetRGB(column + p, row, message + messageIndex, message + messageIndex + 1, message + messageIndex + 2);
+
+    column += count;
+    if (column >= end)
+    {
+      column = NUMBER_TO_SKIP;
+      row++;
+    }
+    segment++;
+    done = false;
+    message[0] = messageIndex - 1;
+    packed = true;
+  }
+
+  bool Active() const { return active; }
+
+  // A segment is packed and waits for a credit.
+  bool Waiting() const { return active && packed && !sending && credits == 0; }
+
+  // Cursor
+  unsigned int Row() const { return row; }
+  unsigned int Column() const { return column; }
+  unsigned int Segment() const { return segment; }
+
+  const unsigned char* Message() const { return message; }
+
+private:
+
+  CameraSource& camera;
+  Stream& port;
+  unsigned char* message;
+
+  bool active = false;
+  bool packed = false;  // message holds the next segment
+  bool sending = false; // message is being written
+  bool done = false;    // message is "Done"
+  unsigned char written = 0; // bytes of message written
+  unsigned char credits = 0;
+
+  unsigned int row = NUMBER_TO_SKIP;
+  unsigned int column = NUMBER_TO_SKIP;
+  unsigned int segment = 0; // segments packed in this image
+
+  unsigned char command[2];
+  unsigned char commandLength = 0; // bytes of the command read so far
+
+  // Reads whatever commands have arrived. Other messages are skipped.
+  void ReadCommands()
+  {
+    while (port.available() > 0)
+    {
+      unsigned char inputByte = (unsigned char)port.read();
+      if (commandLength < sizeof(command)) command[commandLength] = inputByte;
+      commandLength++;
+      if (commandLength < command[0] && command[0] > 1) continue;
+
+      if (command[0] == 2)
+      {
+        if (command[1] == CAMERA_CREDIT)
+        {
+          if (active) Credit();
+          else Start();
+        }
+        else if (command[1] == CAMERA_ABORT) Abort();
+      }
+      commandLength = 0;
+    }
+  }
+
+  // Writes as much of message as the output buffer takes without waiting.
+  // MESSAGE[0] is the total length of the message,
+  // not the number of following bytes.
+  void Write()
+  {
+    int room = port.availableForWrite();
+    while (room-- > 0 && written < message[0]) port.write(message[written++]);
+    if (written < message[0]) return;
+
+    sending = false;
+    packed = false;
+    if (done) active = false;
+  }
+};
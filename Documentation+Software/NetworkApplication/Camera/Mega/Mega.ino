@@ -12,6 +12,9 @@
 const uint8_t HANDSHAKE = (uint8_t)'H';
 uint8_t SIZE_OUTPUT_BUFFER = 0;
 
+// Sends the camera's images over Serial, paced by the connected device.
+CameraPipeline pipeline(camera, Serial, MESSAGE);
+
 void setup()
 {
   // Initialize Arduino
@@ -37,15 +40,9 @@ void setup()
 
 void loop()
 {
-  // Wait for picture to be requested.
-  #ifdef DEBUG
-    Serial1.print("Waiting to receive message\n"); Serial1.flush();
-  #endif
-  ReceiveMessage();
-
-  // Assuming for now that the request is for
-  // an entire image to be sent.
-  GatherCameraData();
+  // Sends images as they are requested, one piece at a time.
+  // Other work can be added here. It must not block for long.
+  pipeline.Step();
 }
 
 // ============= Function Definitions =================
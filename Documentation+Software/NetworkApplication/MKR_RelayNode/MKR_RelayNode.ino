@@ -11,6 +11,19 @@
 // since they are not sources nor destinations.
 #define localAddress 0
 
+// Number this relay gives in its telemetry, to tell it from the others.
+// The basestation asks the relays for telemetry. See LoRaMessageHandler.h
+#define relayNumber 1
+
+// Uncomment to forward messages for the basestation only when
+// closer to it than the previous hop. Others are still flooded.
+// The basestation has to send beacons. See LoRaMessageHandler.h
+//#define GRADIENT_ROUTING
+
+// Uncomment when the basestation schedules the channel (TDMA).
+// Messages are relayed in relay slots only.
+//#define TDMA
+
 // Establish message-tracking table.
 // Allows for ignoring older messages.
 // Assumes low message rate.
@@ -27,6 +40,18 @@ int MessageTrackingTable[MAX_NUM_NODES + 1];
 #include <LoRaMessageHandler.h>
 LoRaMessageHandler *MessagingLibrary = NULL;
 
+// Relays asked for telemetry together would answer together, and collide.
+// Each waits telemetryStagger milliseconds for every relay numbered before
+// it. With TDMA they all send in the relay slots, so the stagger is a
+// superframe of the basestation's schedule, for each to have slots of its own.
+#ifdef TDMA
+const unsigned long telemetryStagger = (unsigned long)TDMA_MAX_SLOTS * TDMA_SLOT_MS;
+#else
+const unsigned long telemetryStagger = 2000;
+#endif
+uint16_t telemetryDestination = 0; // node that asked
+long telemetryRequestID = -1;      // its message ID, -1 for none yet
+
 void setup()
 {
   // Initialize serial port
@@ -38,6 +63,12 @@ void setup()
   
   // Initialize Messaging and LoRa libraries
   MessagingLibrary = new LoRaMessageHandler(localAddress);
+  #ifdef GRADIENT_ROUTING
+    MessagingLibrary->EnableGradientRouting(true);
+  #endif
+  #ifdef TDMA
+    MessagingLibrary->EnableTDMA(true);
+  #endif
 
   // Initialize message tracking table
   for(int i = 0; i <= MAX_NUM_NODES; i++)
@@ -53,16 +84,22 @@ void setup()
 
 void loop()
 {
+  // Answer telemetry requests when due. Otherwise idle until the next
+  // interrupt, a millisecond at most.
+  Tasks.Run();
+
   // Check for incoming messages.
   // Rebroadcast messages as appropriate.
-  if(MessagingLibrary->CheckForIncomingPacket() > 0)
+  // Only the header is read. The rest is relayed from the radio.
+  if(MessagingLibrary->CheckForRelayPacket() > 0)
   {
     // Get a pointer to the received message
     const uint8_t* thisMessage = MessagingLibrary->getMESSAGE();
+    uint16_t source = MessagingLibrary->getSourceAddress(); // may not fit in a byte
 
     // Ignore messages with a source address outside the
     // message tracking table.
-    if(thisMessage[LOCATION_SOURCE_ID] > MAX_NUM_NODES)
+    if(source > MAX_NUM_NODES)
     {
       #ifdef DEBUG
         Serial.println("Source ID exceeds node address limit");
@@ -70,12 +107,25 @@ void loop()
       return;
     }
 
+    // Relays all have address 0 and number their messages each on their
+    // own, so copies of their messages cannot be told apart. Their
+    // telemetry is not passed on, and reaches the basestation from
+    // relays in range of it only.
+    if(source == 0)
+    {
+      #ifdef DEBUG
+        Serial.println("Message from a relay");
+      #endif
+      return;
+    }
+
     // Ignore messages whose rebroadcast counter has expired.
-    if(thisMessage[LOCATION_REBROADCASTS] == 00)
+    if((thisMessage[LOCATION_REBROADCASTS] & REBROADCAST_MASK) == 00)
     {
       #ifdef DEBUG
         Serial.println("Rebroadcast counter is zero");
       #endif
+      MessagingLibrary->CountDrop(TELEMETRY_DROP_TTL);
       return;
     }
       
@@ -89,27 +139,60 @@ void loop()
     // In that way, all relays reset their table for that node,
     // whether or not they see a message ID of zero.
     if(thisMessageID == 0) 
-      MessageTrackingTable[thisMessage[LOCATION_SOURCE_ID]] = 0;
+      MessageTrackingTable[source] = 0;
       
     // Ignore older messages.
     // Accept messages with the current message ID.
-    if(thisMessageID < MessageTrackingTable[thisMessage[LOCATION_SOURCE_ID]])
+    if(thisMessageID < MessageTrackingTable[source])
     {
       #ifdef DEBUG
         Serial.println("Old message (MsgID / TableID) (" + String(thisMessageID) + 
-          " / " + String(MessageTrackingTable[thisMessage[LOCATION_SOURCE_ID]]) + ")");
+          " / " + String(MessageTrackingTable[source]) + ")");
       #endif
+      MessagingLibrary->CountDrop(TELEMETRY_DROP_DUPLICATE);
       return;
     }
-    else MessageTrackingTable[thisMessage[LOCATION_SOURCE_ID]] = thisMessageID;
+    else MessageTrackingTable[source] = thisMessageID;
     
     // Rebroadcast messages that pass muster.
-    #ifdef DEBUG
-      Serial.println("Rebroadcasting");
-    #endif
-    MessagingLibrary->RelayMessage();
+    // With gradient routing, some are held back.
+    if(MessagingLibrary->RelayMessage())
+    {
+      #ifdef DEBUG
+        Serial.println("Rebroadcasting");
+      #endif
+    }
+    else
+    {
+      #ifdef DEBUG
+        Serial.println("Not closer to the destination, or queue full. Not rebroadcast");
+      #endif
+    }
+
+    // Answer requests for telemetry sent to the relays.
+    if((thisMessage[LOCATION_MESSAGE_TYPE] & MESSAGE_TYPE_MASK) == 1 &&
+       thisMessage[LOCATION_APPARATUS_ID] == TELEMETRY_APPARATUS &&
+       MessagingLibrary->getDestinationAddress() == localAddress)
+    {
+      // Copies of the request come in from every relay that repeats it.
+      // Answer the first only.
+      if(source == telemetryDestination && thisMessageID == telemetryRequestID)
+        return;
+      #ifdef DEBUG
+        Serial.println("Sending telemetry to node " + String(source));
+      #endif
+      telemetryDestination = source;
+      telemetryRequestID = thisMessageID;
+      Tasks.After((relayNumber - 1) * telemetryStagger, AnswerTelemetry);
+    }
     #ifdef DEBUG
       Serial.println();
     #endif
   }
 }
+
+// Task. Sends the telemetry asked for, once this relay's turn comes.
+void AnswerTelemetry()
+{
+  MessagingLibrary->SendTelemetry(telemetryDestination, relayNumber);
+}
@@ -11,13 +11,29 @@
 #include <LoRaMessageHandler.h>
 LoRaMessageHandler *MessagingLibrary = NULL;
 
-// The resolution is the number of ADC levels.
-// https://electronics.stackexchange.com/questions/406906/how-to-obtain-input-voltage-from-adc-value
-#define analogResolution 4096.0f
+// Calibrations of the battery and soil-moisture readings.
+// ADC codes are converted in fixed point. See Calibration.h
+#include <SensorCalibration.h>
 
-// The voltage reference is 3.3v.
-// https://docs.arduino.cc/language-reference/en/functions/analog-io/analogReference
-#define voltageReference 3.3
+// Oversampled reading of the analog inputs.
+#include <Acquisition.h>
+
+// Uncomment to send raw ADC readings instead of calibrated values.
+// The Basestation's PC then applies the same calibrations,
+// so they can be refined without reprogramming the node.
+//#define SEND_RAW
+
+// Uncomment when relays use gradient routing. The node listens for the
+// basestation's beacons and tells relays how far it is from the basestation.
+//#define GRADIENT_ROUTING
+
+// Uncomment when the basestation sends its time in beacons.
+// The node follows the network time. See LoRaMessageHandler.h
+//#define TIME_SYNC
+
+// Uncomment when the basestation schedules the channel (TDMA).
+// Messages wait for the node's slot, once it has one.
+//#define TDMA
 
 // Identify the battery-voltage input pin.
 #define batteryPin A2
@@ -25,38 +41,40 @@ LoRaMessageHandler *MessagingLibrary = NULL;
 // Identify the soil=moisture sensor input pin.
 #define soilPin A1
 
+// Both inputs are sampled together in one pass.
+const uint8_t analogPins[] = { soilPin, batteryPin };
+enum { soilChannel, batteryChannel };
+Acquisition sensors(analogPins, sizeof(analogPins));
+
 // Timing variables.
-long lastSendTime = 0;          // last send time
 const long maxInterval = 5000;  // maximum millisecond interval between sends
-long interval = 0;              // present interval between sends
+#define receivePollInterval 5   // milliseconds between checks for incoming packets
 
 void setup()
 {
   // Initialize serial port
   Serial.begin(9600);
-  while (!Serial) // wait for serial port to be ready
-  {
-    time_t beginTime = millis(); // delay() is blocking so we do not use that
-    while ((millis() - beginTime) < 5000);
-  }
+  while (!Serial) Tasks.Wait(5000); // wait for serial port to be ready
   Serial.println("Microprocessor is active");
 
-  // Configure analog/digital conversion (ADC).
-  // MKR WAN 1310 is a SAMD board.
-  // Default reference is given by AR_DEFAULT.
-  // https://docs.arduino.cc/language-reference/en/functions/analog-io/analogReference
-  // Capable of 12-bit ADC resolution.
-  // This yields ADC output of 0 .. 4095.
-  // https://docs.arduino.cc/language-reference/en/functions/analog-io/analogReadResolution
-  analogReference(AR_DEFAULT);
-  analogReadResolution(12);
-
-  // Configure analog input pins.
-  pinMode(batteryPin, INPUT);
-  pinMode(soilPin, INPUT);
+  // Configure analog/digital conversion (ADC) and the analog input pins.
+  // Each reading averages 16 conversions. See Acquisition.h
+  sensors.begin();
 
   // Define and configure LoRa messaging library
   MessagingLibrary = new LoRaMessageHandler(localAddress);
+  #ifdef GRADIENT_ROUTING
+    MessagingLibrary->EnableGradientRouting(true);
+  #endif
+  #ifdef TDMA
+    MessagingLibrary->EnableTDMA(true);
+  #endif
+
+  // The node's work is done by tasks, run from loop().
+  // Readings go out at random intervals.
+  // Incoming packets are checked periodically.
+  Tasks.After(random(maxInterval), SendReadings);
+  Tasks.Every(receivePollInterval, CheckForMessages);
 
   // Ready
   Serial.println("=====================================================");
@@ -66,78 +84,87 @@ void setup()
 
 void loop()
 {
-  // Counts the number of packets sent.
-  static uint16_t counter = 0;
-
-  // Send sensor values on appropriate schedule.
-  if (millis() - lastSendTime > interval)
-  {
-    // Read the soil-moisture pin.
-    // Convert voltage to Volumetric Water Content (VWC).
-    float adcValue = (float)analogRead(soilPin);
-    float volts = (adcValue / analogResolution) * voltageReference;
-    float VWC = GetVWC(volts);
-  
-    // Read the battery-voltage pin.
-    adcValue = (float)analogRead(batteryPin);
-    volts = (adcValue / analogResolution) * voltageReference;
-    volts *= 2.0f; // see documentation for voltage divider
-  
-    // Compose message. Broadcast packet.
-    char message[100];
-    sprintf(message, "DATA: BattV:%5.1f: VWC:%5.1f", volts, VWC);
-    String sendString = message;
-    Serial.println();
-    MessagingLibrary->SendTextMessage(sendString, 3);
-    Serial.print("Sent message ");
-    Serial.print(++counter);
-    Serial.println(" '" + sendString + "'");
-    
-    // Select the next time to send sensor values.
-    lastSendTime = millis();
-    interval = random(maxInterval);
-  }
+  // Run whichever tasks are due. Idle until the next one otherwise.
+  Tasks.Run();
 }
 
-// Implements piecewise linear equation.
-// Takes voltage as input, locates it in the table,
-// applies the equation of a line, and delivers VWC.
-float GetVWC(float volts)
+// ============= Function Definitions =================
+
+// Task. Answers requests for telemetry. See LoRaMessageHandler.h
+// Beacons are taken in as they arrive.
+void CheckForMessages()
 {
-  const long numRows = 13;
-  float table[numRows][2] =
-  { // (x_volts, y_VWC)
-    {0.0f,  0.0f},
-    {0.1f,  0.1f},
-    {0.6f,  5.0f},
-    {1.1f, 10.0f},
-    {1.3f, 15.0f},
-    {1.4f, 20.0f},
-    {1.5f, 25.0f},
-    {1.6f, 30.0f},
-    {1.7f, 35.0f},
-    {1.8f, 40.0f},
-    {2.0f, 45.0f},
-    {2.3f, 50.0f},
-    {3.0f, 60.0f}
-  };
-
-  long r;
-  for (r = 1; r < numRows; r++)
+  if (MessagingLibrary->CheckForIncomingPacket() > 0)
   {
-    if ((volts >= table[r - 1][0]) &&
-      (volts <= table[r][0]))
-      break;
+    const uint8_t* thisMessage = MessagingLibrary->getMESSAGE();
+    if ((thisMessage[LOCATION_MESSAGE_TYPE] & MESSAGE_TYPE_MASK) == 1 &&
+        thisMessage[LOCATION_APPARATUS_ID] == TELEMETRY_APPARATUS)
+      MessagingLibrary->SendTelemetry(MessagingLibrary->getSourceAddress(), localAddress);
   }
+}
 
-  if (r == numRows) return (float)NULL;
-  else
-  {
-    float slope =
-      (table[r][1] - table[r - 1][1]) / (table[r][0] - table[r - 1][0]);
-
-    float VWC = slope * (volts - table[r - 1][0]) + table[r - 1][1];
+// Task. Sends the sensor values, then picks when to send them again.
+void SendReadings()
+{
+  // Counts the number of packets sent.
+  static uint16_t counter = 0;
 
-    return VWC;
-  }
+  // Read the soil-moisture and battery-voltage pins.
+  // Readings are in 1/16 of an ADC code.
+  sensors.Sample();
+  uint16_t soilCode = sensors.Reading(soilChannel);
+  uint16_t batteryCode = sensors.Reading(batteryChannel);
+
+  // Compose message. Broadcast packet.
+  char message[100];
+  #ifdef SEND_RAW
+    sprintf(message, "RAW: BattV:%u: VWC:%u", batteryCode, soilCode);
+  #else
+    // Battery voltage and Volumetric Water Content (VWC), in hundredths.
+    // A VWC outside its calibration is left out of the message.
+    int32_t battery, VWC;
+    char value[16];
+    batteryVolts.Convert(batteryCode, battery, ACQUISITION_FRACTION_BITS);
+    FormatHundredths(value, sizeof(value), battery, 5, 1);
+    int length = sprintf(message, "DATA: BattV:%s", value);
+    if (soilVWC.Convert(soilCode, VWC, ACQUISITION_FRACTION_BITS) == CalibrationStatus::InRange)
+    {
+      FormatHundredths(value, sizeof(value), VWC, 5, 1);
+      sprintf(message + length, ": VWC:%s", value);
+    }
+    else Serial.println("\nVWC is outside its calibration");
+  #endif
+  String sendString = message;
+  Serial.println();
+  MessagingLibrary->SendTextMessage(sendString, 3);
+  Serial.print("Sent message ");
+  Serial.print(++counter);
+  Serial.println(" '" + sendString + "'");
+  #ifdef TIME_SYNC
+    if (MessagingLibrary->TimeSynchronized())
+    {
+      Serial.print("Network time ");
+      Serial.print(MessagingLibrary->NetworkTime());
+      Serial.print(" ms, drift ");
+      Serial.print(MessagingLibrary->ClockDrift());
+      Serial.println(" ppm");
+    }
+  #endif
+  #ifdef TDMA
+    if (MessagingLibrary->Scheduled())
+    {
+      LoRaMessageHandler::SlotStatistics slots = MessagingLibrary->getSlotStatistics();
+      Serial.print("Slots used ");
+      Serial.print(slots.slotsUsed);
+      Serial.print(" of ");
+      Serial.print(slots.slots);
+      Serial.print(", guard-time violations sent ");
+      Serial.print(slots.sentViolations);
+      Serial.print(", heard ");
+      Serial.println(slots.heardViolations);
+    }
+  #endif
+
+  // Select the next time to send sensor values.
+  Tasks.After(random(maxInterval), SendReadings);
 }
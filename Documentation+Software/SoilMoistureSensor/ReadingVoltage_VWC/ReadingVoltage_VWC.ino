@@ -8,13 +8,9 @@
 // https://stackoverflow.com/questions/10612385/strings-in-c-class-file-for-arduino-not-compiling
 #include <Arduino.h>
 
-// The resolution is the number of ADC levels.
-// https://electronics.stackexchange.com/questions/406906/how-to-obtain-input-voltage-from-adc-value
-#define analogResolution 4096.0f
-
-// The voltage reference is 3.3v.
-// https://docs.arduino.cc/language-reference/en/functions/analog-io/analogReference
-#define voltageReference 3.3
+// Calibration of the soil-moisture readings.
+// ADC codes are converted in fixed point. See Calibration.h
+#include <SensorCalibration.h>
 
 // Identify the input pin
 #define inputPin A1
@@ -49,63 +45,26 @@ void setup()
 void loop()
 {
   // Read the input pin
-  float adcValue = (float)analogRead(inputPin);
-  float volts = (adcValue / analogResolution) * voltageReference;
+  uint16_t code = analogRead(inputPin);
+  char volts[16];
+  FormatHundredths(volts, sizeof(volts), (CodeToMillivolts(code) + 5) / 10, 0, 2);
 
-  // Convert voltage to Volumetric Water Content (VWC)
-  float VWC = GetVWC(volts);
+  // Convert voltage to Volumetric Water Content (VWC), in hundredths
+  int32_t VWC;
+  bool inRange = soilVWC.Convert(code, VWC) == CalibrationStatus::InRange;
+  char VWCText[16];
+  FormatHundredths(VWCText, sizeof(VWCText), VWC, 0, 2);
 
   // Plot the data
   // https://forum.arduino.cc/t/fixing-the-y-axis-on-the-serial-plotter-can-it-be-done-yes-it-can-sort-of/431095/2
   // https://www.youtube.com/watch?v=4AQg4vZ_vZI
   // https://github.com/vastevenson/multi-line-plots-arduino-demo
+  // VWC is left out when the voltage is outside its calibration.
   Serial.print("Sensor_Volts=" + String(volts));
-  Serial.println(",VWC=" + String(VWC));
-  if(volts != (float)NULL)
-    Serial.print(volts, 1); Serial.print(","); Serial.println(VWC, 1);
+  if(inRange) Serial.print(",VWC=" + String(VWCText));
+  Serial.println();
 
   // Wait a bit before repeating
   time_t beginTime = millis();
   while ((millis() - beginTime) < 1000);
 }
-
-// Takes voltage as input, locates it in the table, applies the equation of a line, and delivers VWC.
-float GetVWC(float volts)
-{
-  const long numRows = 13;
-  float table[numRows][2] =
-  { // (x_volts, y_VWC)
-    {0.0f,  0.0f},
-    {0.1f,  0.1f},
-    {0.6f,  5.0f},
-    {1.1f, 10.0f},
-    {1.3f, 15.0f},
-    {1.4f, 20.0f},
-    {1.5f, 25.0f},
-    {1.6f, 30.0f},
-    {1.7f, 35.0f},
-    {1.8f, 40.0f},
-    {2.0f, 45.0f},
-    {2.3f, 50.0f},
-    {3.0f, 60.0f}
-  };
-
-  long r;
-  for (r = 1; r < numRows; r++)
-  {
-    if ((volts >= table[r - 1][0]) &&
-      (volts <= table[r][0]))
-      break;
-  }
-
-  if (r == numRows) return (float)NULL;
-  else
-  {
-    float slope =
-      (table[r][1] - table[r - 1][1]) / (table[r][0] - table[r - 1][0]);
-
-    float VWC = slope * (volts - table[r - 1][0]) + table[r - 1][1];
-
-    return VWC;
-  }
-}
@@ -21,13 +21,9 @@
 #define SPREADING_FACTOR 7
 #define SIGNAL_BANDWIDTH 125E3
 
-// The resolution is the number of ADC levels.
-// https://electronics.stackexchange.com/questions/406906/how-to-obtain-input-voltage-from-adc-value
-#define analogResolution 4096.0f
-
-// The voltage reference is 3.3v.
-// https://docs.arduino.cc/language-reference/en/functions/analog-io/analogReference
-#define voltageReference 3.3
+// Calibration of the soil-moisture readings.
+// ADC codes are converted in fixed point. See Calibration.h
+#include <SensorCalibration.h>
 
 // Identify the input pin
 #define inputPin A1
@@ -90,20 +86,27 @@ void loop()
   static int counter = 0;
 
   // Read the input pin
-  float adcValue = (float)analogRead(inputPin);
-  float volts = (adcValue / analogResolution) * voltageReference;
+  uint16_t code = analogRead(inputPin);
 
-  // Convert voltage to Volumetric Water Content (VWC)
-  float VWC = GetVWC(volts);
+  // Convert voltage to Volumetric Water Content (VWC), in hundredths
+  int32_t VWC;
+  bool inRange = soilVWC.Convert(code, VWC) == CalibrationStatus::InRange;
 
   // Begin transmit process
   counter++;
   Serial.print("\nSending packet: ");
   Serial.println(counter);
 
-  // Compose message packet
-  char message[100];
-  sprintf(message, "Volts:%5.1f:VWC:%5.1f", volts, VWC);
+  // Compose message packet.
+  // VWC is left out when the voltage is outside its calibration.
+  char message[100], value[16];
+  FormatHundredths(value, sizeof(value), (CodeToMillivolts(code) + 5) / 10, 5, 1);
+  int length = sprintf(message, "Volts:%s", value);
+  if(inRange)
+  {
+    FormatHundredths(value, sizeof(value), VWC, 5, 1);
+    sprintf(message + length, ":VWC:%s", value);
+  }
 
   // Send packet
   LoRa.beginPacket();
@@ -115,44 +118,3 @@ void loop()
   time_t beginTime = millis();
   while ((millis() - beginTime) < 1000);
 }
-
-// Takes voltage as input, locates it in the table, applies the equation of a line, and delivers VWC.
-float GetVWC(float volts)
-{
-  const long numRows = 13;
-  float table[numRows][2] =
-  { // (x_volts, y_VWC)
-    {0.0f,  0.0f},
-    {0.1f,  0.1f},
-    {0.6f,  5.0f},
-    {1.1f, 10.0f},
-    {1.3f, 15.0f},
-    {1.4f, 20.0f},
-    {1.5f, 25.0f},
-    {1.6f, 30.0f},
-    {1.7f, 35.0f},
-    {1.8f, 40.0f},
-    {2.0f, 45.0f},
-    {2.3f, 50.0f},
-    {3.0f, 60.0f}
-  };
-
-  long r;
-  for (r = 1; r < numRows; r++)
-  {
-    if ((volts >= table[r - 1][0]) &&
-      (volts <= table[r][0]))
-      break;
-  }
-
-  if (r == numRows) return (float)NULL;
-  else
-  {
-    float slope =
-      (table[r][1] - table[r - 1][1]) / (table[r][0] - table[r - 1][0]);
-
-    float VWC = slope * (volts - table[r - 1][0]) + table[r - 1][1];
-
-    return VWC;
-  }
-}